@@ -22,5 +22,13 @@ KERN_BASE_VADDR=0x80130000
 KERN_DYN_PADDR=0x1000000
 # Virtual base address for kernel dynamic data
 KERN_DYN_VADDR=0x81000000
-# Length of the kernel dynamic data section
-KERN_DYN_LEN=0x3fe00000
+# Length of the kernel dynamic data section. The section ends at 1GiB, which is how much memory QEMU is started with
+# (see the Makefile). All of it is handed out by kvalloc, so it must not extend past the end of physical memory.
+KERN_DYN_LEN=0x3f000000
+
+# Virtual base address for demand-paged kernel memory. Only virtual addresses are reserved in this window. Physical
+# pages are mapped into it when the memory is first touched. The window starts at 4GiB so that it doesn't overlap the
+# 32-bit MMIO hole, where device registers are identity-mapped.
+KERN_VMEM_VADDR=0x100000000
+# Length of the window for demand-paged kernel memory
+KERN_VMEM_LEN=0x40000000
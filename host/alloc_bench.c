@@ -0,0 +1,170 @@
+// Randomized allocator workloads
+//
+// Every workload keeps a fixed number of slots, each of which either holds an allocation or is empty. Each operation
+// picks a random slot and frees its allocation or allocates a new one. This keeps the allocator about half full and
+// mixes allocations of different lifetimes, which is what causes fragmentation.
+
+#include <config.h>
+#include <host.h>
+#include <tx/arena.h>
+#include <tx/buddy.h>
+#include <tx/pool.h>
+
+#define BENCH_BUDDY_SIZE BIT(28) /* 256MiB */
+#define BENCH_N_SLOTS 1024
+#define BENCH_N_OPS 1000000
+
+#define BENCH_POOL_BLOCK_SIZE 64
+#define BENCH_ARENA_SIZE BIT(24) /* 16MiB */
+
+static u64 global_rand_state = 0x853c49e6748fea9bULL;
+
+// Print the time per operation with one decimal place.
+static void report(struct str name, u64 start_ns, sz n_ops)
+{
+    u64 ns = host_time_ns() - start_ns;
+    u64 tenths = (10 * ns) / (u64)MAX(n_ops, 1);
+    char underlying[128];
+    print_fmt(str_buf_new(underlying, 0, countof(underlying)), STR("%s: %lu.%lu ns/op (%ld ops)\n"), name,
+              tenths / 10, tenths % 10, n_ops);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Buddy allocator                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+// Size distributions return the size of the next allocation in bytes.
+typedef sz (*size_dist_fn)(void);
+
+static sz dist_single_page(void)
+{
+    return PAGE_SIZE;
+}
+
+static sz dist_uniform_small(void)
+{
+    return host_rand_range(&global_rand_state, 1, 16 * PAGE_SIZE);
+}
+
+static sz dist_powers_of_two(void)
+{
+    return PAGE_SIZE << host_rand_range(&global_rand_state, 0, 8);
+}
+
+// Mostly small allocations with a few big buffers mixed in.
+static sz dist_bimodal(void)
+{
+    if (host_rand_range(&global_rand_state, 0, 9))
+        return host_rand_range(&global_rand_state, 1, 2 * PAGE_SIZE);
+    return host_rand_range(&global_rand_state, 64 * PAGE_SIZE, 512 * PAGE_SIZE);
+}
+
+static void bench_buddy(struct str name, size_dist_fn dist, struct byte_array mem, struct arena arn)
+{
+    struct buddy *buddy = buddy_init(mem, &arn);
+    struct byte_array *slots = arena_alloc_array(&arn, BENCH_N_SLOTS, sizeof(*slots));
+    sz n_failed = 0;
+
+    u64 start = host_time_ns();
+    for (sz i = 0; i < BENCH_N_OPS; i++) {
+        struct byte_array *slot = &slots[host_rand_range(&global_rand_state, 0, BENCH_N_SLOTS - 1)];
+        if (slot->dat) {
+            buddy_free(buddy, *slot);
+            *slot = (struct byte_array){ 0 };
+            continue;
+        }
+
+        struct option_byte_array ba = buddy_alloc(buddy, dist());
+        if (ba.is_none)
+            n_failed++;
+        else
+            *slot = option_byte_array_checked(ba);
+    }
+    report(name, start, BENCH_N_OPS);
+
+    char underlying[256];
+    print_fmt(str_buf_new(underlying, 0, countof(underlying)),
+              STR("  peak %ld/%ld pages, %ld failed allocations, fragmentation at the end %ld permille\n"),
+              buddy->n_pages_high_water, buddy->n_pages, n_failed, buddy_fragmentation(buddy));
+
+    for (sz i = 0; i < BENCH_N_SLOTS; i++) {
+        if (slots[i].dat)
+            buddy_free(buddy, slots[i]);
+    }
+    buddy_check(buddy);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pools and arenas                                                          //
+///////////////////////////////////////////////////////////////////////////////
+
+static void bench_pool(struct arena arn)
+{
+    struct pool pool = pool_new(byte_array_from_arena(BENCH_N_SLOTS * BENCH_POOL_BLOCK_SIZE, &arn),
+                                BENCH_POOL_BLOCK_SIZE);
+    void **slots = arena_alloc_array(&arn, BENCH_N_SLOTS, sizeof(*slots));
+
+    u64 start = host_time_ns();
+    for (sz i = 0; i < BENCH_N_OPS; i++) {
+        void **slot = &slots[host_rand_range(&global_rand_state, 0, BENCH_N_SLOTS - 1)];
+        if (*slot) {
+            pool_free(&pool, *slot);
+            *slot = NULL;
+        } else {
+            *slot = pool_alloc(&pool);
+            assert(*slot);
+        }
+    }
+    report(STR("pool: random alloc/free"), start, BENCH_N_OPS);
+}
+
+// Allocate small objects and reset the arena whenever it's full, like the scratch arenas in the network stack.
+static void bench_arena(struct arena arn)
+{
+    struct arena scratch = arena_new(byte_array_from_arena(BENCH_ARENA_SIZE, &arn));
+    struct arena_mark mark = arena_mark(&scratch);
+
+    u64 start = host_time_ns();
+    for (sz i = 0; i < BENCH_N_OPS; i++) {
+        sz size = host_rand_range(&global_rand_state, 1, 256);
+        if (scratch.end - scratch.beg < 2 * size)
+            arena_restore(&scratch, mark);
+        assert(arena_alloc_aligned_nozero(&scratch, size, alignof(void *)));
+    }
+    report(STR("arena: small allocations"), start, BENCH_N_OPS);
+}
+
+// Grow a chained arena from a buddy allocator and throw it away again, like the scratch arena of the web server.
+static void bench_arena_chain(struct byte_array mem, struct arena arn)
+{
+    struct buddy *buddy = buddy_init(mem, &arn);
+    struct arena_chain chain;
+    arena_chain_init(&chain, alloc_new(buddy, buddy_alloc_wrapper, buddy_free_wrapper), 4 * PAGE_SIZE);
+    struct arena scratch = arena_new_chained(&chain);
+    struct arena_mark mark = arena_mark(&scratch);
+
+    u64 start = host_time_ns();
+    for (sz i = 0; i < BENCH_N_OPS; i++) {
+        if (i % 64 == 0)
+            arena_restore(&scratch, mark);
+        sz size = host_rand_range(&global_rand_state, 1, 1024);
+        assert(arena_alloc_aligned_nozero(&scratch, size, alignof(void *)));
+    }
+    report(STR("arena chain: small allocations"), start, BENCH_N_OPS);
+}
+
+int main(void)
+{
+    struct byte_array mem = host_byte_array(BENCH_BUDDY_SIZE);
+    struct arena arn = arena_new(host_byte_array(BENCH_ARENA_SIZE + buddy_init_arena_size(BENCH_BUDDY_SIZE) + BIT(20)));
+
+    bench_buddy(STR("buddy: single pages"), dist_single_page, mem, arn);
+    bench_buddy(STR("buddy: 1 B to 16 pages"), dist_uniform_small, mem, arn);
+    bench_buddy(STR("buddy: powers of two up to 256 pages"), dist_powers_of_two, mem, arn);
+    bench_buddy(STR("buddy: bimodal"), dist_bimodal, mem, arn);
+    bench_pool(arn);
+    bench_arena(arn);
+    bench_arena_chain(mem, arn);
+
+    return 0;
+}
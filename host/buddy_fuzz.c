@@ -0,0 +1,168 @@
+// Fuzz target for the buddy allocator
+//
+// The input is interpreted as a sequence of allocations and frees. After every operation, the allocator's own
+// invariants are checked with `buddy_check` and the allocations are checked against a shadow map of the pages.
+// The entry point follows the libFuzzer interface, so it can be built with `-fsanitize=fuzzer`. Without libFuzzer,
+// fuzz_main.c drives it with random inputs (see the `host-fuzz` target in the Makefile).
+
+#include <config.h>
+#include <host.h>
+#include <tx/arena.h>
+#include <tx/buddy.h>
+
+#define FUZZ_MAX_PAGES 300
+#define FUZZ_N_SLOTS 64
+#define FUZZ_MAX_ALLOC_PAGES 64
+#define FUZZ_MAX_ALIGN_SHIFT 5
+
+#define SHADOW_FREE 0
+#define SHADOW_USED 1
+
+struct fuzz_input {
+    const u8 *dat;
+    sz len;
+};
+
+// Inputs are padded with zeros at the end.
+static u8 fuzz_next(struct fuzz_input *in)
+{
+    if (in->len <= 0)
+        return 0;
+    in->len--;
+    return *in->dat++;
+}
+
+struct fuzz_state {
+    struct buddy *buddy;
+    struct byte_array slots[FUZZ_N_SLOTS];
+    u8 shadow[FUZZ_MAX_PAGES]; // One entry per page of the managed memory.
+    sz n_used_pages;
+};
+
+static sz page_idx(struct fuzz_state *st, byte *addr)
+{
+    return (addr - st->buddy->base) / PAGE_SIZE;
+}
+
+static sz n_pages_of(struct byte_array ba)
+{
+    return ALIGN_UP(ba.len, PAGE_SIZE) / PAGE_SIZE;
+}
+
+static void fuzz_alloc(struct fuzz_state *st, sz slot_idx, sz size, sz align)
+{
+    struct byte_array *slot = &st->slots[slot_idx];
+    if (slot->dat)
+        return;
+
+    struct option_byte_array ba_opt = buddy_alloc_aligned(st->buddy, size, align);
+    if (ba_opt.is_none) {
+        // The allocation may only fail if there is no free block that's big enough.
+        sz ord = LOG2_CEIL(MAX(ALIGN_UP(size, PAGE_SIZE), align) / PAGE_SIZE);
+        assert(!(st->buddy->nonempty_mask >> ord));
+        return;
+    }
+
+    struct byte_array ba = option_byte_array_checked(ba_opt);
+    assert(ba.len == size);
+    assert(IS_ALIGNED(ba.dat - st->buddy->base, align));
+    assert(IN_RANGE(ba.dat, st->buddy->base, st->buddy->n_pages * PAGE_SIZE));
+    assert(page_idx(st, ba.dat) + n_pages_of(ba) <= st->buddy->n_pages);
+
+    for (sz i = 0; i < n_pages_of(ba); i++) {
+        assert(st->shadow[page_idx(st, ba.dat) + i] == SHADOW_FREE);
+        st->shadow[page_idx(st, ba.dat) + i] = SHADOW_USED;
+    }
+    st->n_used_pages += n_pages_of(ba);
+
+    byte_array_set(ba, (byte)slot_idx);
+    *slot = ba;
+}
+
+static void fuzz_free(struct fuzz_state *st, sz slot_idx)
+{
+    struct byte_array *slot = &st->slots[slot_idx];
+    if (!slot->dat)
+        return;
+
+    // Nobody else may have written to the allocation.
+    for (sz i = 0; i < slot->len; i++)
+        assert(slot->dat[i] == (byte)slot_idx);
+
+    for (sz i = 0; i < n_pages_of(*slot); i++)
+        st->shadow[page_idx(st, slot->dat) + i] = SHADOW_FREE;
+    st->n_used_pages -= n_pages_of(*slot);
+
+    buddy_free(st->buddy, *slot);
+    *slot = (struct byte_array){ 0 };
+}
+
+// The free blocks must cover exactly the pages that aren't allocated.
+static void fuzz_check(struct fuzz_state *st)
+{
+    struct buddy *buddy = st->buddy;
+
+    buddy_check(buddy);
+    assert(buddy->n_free_pages + st->n_used_pages == buddy->n_pages);
+
+    for (sz ord = 0; ord <= buddy->max_ord; ord++) {
+        struct dlist *head = &buddy->avail[ord].link;
+        for (struct dlist *link = head->next; link != head; link = link->next) {
+            sz idx = page_idx(st, (byte *)__container_of(link, struct block, link));
+            for (sz i = 0; i < (1 << ord); i++)
+                assert(st->shadow[idx + i] == SHADOW_FREE);
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const u8 *dat, u64 len)
+{
+    static struct byte_array mem;
+    static struct byte_array arena_mem;
+    if (!mem.dat) {
+        mem = host_byte_array(FUZZ_MAX_PAGES * PAGE_SIZE);
+        arena_mem = host_byte_array(buddy_init_arena_size(FUZZ_MAX_PAGES * PAGE_SIZE) + sizeof(struct fuzz_state));
+    }
+
+    struct fuzz_input in = { .dat = dat, .len = (sz)len };
+    struct arena arn = arena_new(arena_mem);
+
+    // The first byte picks the size of the memory so that uneven regions are covered, too.
+    sz n_pages = 1 + fuzz_next(&in) % FUZZ_MAX_PAGES;
+    struct fuzz_state *st = arena_alloc(&arn, sizeof(*st));
+    st->buddy = buddy_init(byte_array_new(mem.dat, n_pages * PAGE_SIZE), &arn);
+
+    while (in.len > 0) {
+        u8 op = fuzz_next(&in);
+        sz slot_idx = fuzz_next(&in) % FUZZ_N_SLOTS;
+
+        switch (op % 3) {
+        case 0: {
+            sz alloc_pages = 1 + fuzz_next(&in) % FUZZ_MAX_ALLOC_PAGES;
+            sz size = alloc_pages * PAGE_SIZE - fuzz_next(&in) * (PAGE_SIZE / 256);
+            fuzz_alloc(st, slot_idx, size, PAGE_SIZE);
+            break;
+        }
+        case 1: {
+            sz size = 1 + fuzz_next(&in) * (PAGE_SIZE / 16);
+            sz align = PAGE_SIZE << (fuzz_next(&in) % (FUZZ_MAX_ALIGN_SHIFT + 1));
+            fuzz_alloc(st, slot_idx, size, align);
+            break;
+        }
+        default:
+            fuzz_free(st, slot_idx);
+            break;
+        }
+
+        fuzz_check(st);
+    }
+
+    // Once everything is freed, the memory must be merged into the blocks that it started out as.
+    for (sz i = 0; i < FUZZ_N_SLOTS; i++)
+        fuzz_free(st, i);
+    fuzz_check(st);
+    for (sz ord = 0; ord <= st->buddy->max_ord; ord++)
+        assert(st->buddy->n_free_blocks[ord] == ((n_pages >> ord) & 1));
+
+    return 0;
+}
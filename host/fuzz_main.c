@@ -0,0 +1,52 @@
+// Driver for fuzz targets when libFuzzer isn't available. Runs the inputs in the files given on the command line, or
+// `FUZZ_RUNS` random inputs if there are none. This file can't include any kernel headers.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FUZZ_RUNS 10000
+#define FUZZ_MAX_LEN 4096
+
+int LLVMFuzzerTestOneInput(const uint8_t *dat, size_t len);
+
+static uint8_t buf[FUZZ_MAX_LEN];
+
+static int run_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            if (run_file(argv[i]))
+                return 1;
+        }
+        return 0;
+    }
+
+    unsigned seed = 1;
+    if (getenv("FUZZ_SEED"))
+        seed = strtoul(getenv("FUZZ_SEED"), NULL, 0);
+    srand(seed);
+
+    for (long run = 0; run < FUZZ_RUNS; run++) {
+        size_t len = rand() % FUZZ_MAX_LEN;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = rand();
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+
+    printf("%d random inputs passed (seed %u)\n", FUZZ_RUNS, seed);
+    return 0;
+}
@@ -0,0 +1,37 @@
+// The parts of the host builds that use the C library (see host.h). This file can't include any kernel headers.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+unsigned long host_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+void *host_map(long n_bytes)
+{
+    void *mem = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    return mem;
+}
+
+void host_write(const char *dat, long len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, dat, len);
+        if (n <= 0)
+            return;
+        dat += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,47 @@
+// Userspace builds of the allocators
+//
+// The buddy allocator, arenas and pools don't depend on the rest of the kernel. The programs in this directory
+// compile them into normal Linux binaries so that they can be benchmarked and fuzzed on the development machine
+// (see the `host-bench` and `host-fuzz` targets in the Makefile).
+//
+// All files in here except host.c and fuzz_main.c are compiled like kernel code with `-nostdinc`. host.c provides
+// the few services that they need from the C library through this header, and shim.c implements the kernel's
+// printing functions on top of these services. Note that `crash` ends in a `hlt`, which faults in userspace. So a
+// failed assertion prints its message and then kills the process with SIGSEGV.
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <tx/assert.h>
+#include <tx/base.h>
+#include <tx/byte.h>
+
+// Implemented in host.c.
+u64 host_time_ns(void);
+void *host_map(sz n_bytes); // Returns page-aligned, zeroed memory or crashes.
+void host_write(const char *dat, sz len);
+
+static inline struct byte_array host_byte_array(sz n_bytes)
+{
+    return byte_array_new(host_map(n_bytes), n_bytes);
+}
+
+// xorshift64* by Sebastiano Vigna. `state` must not be zero.
+static inline u64 host_rand(u64 *state)
+{
+    u64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Returns a random number in [lo, hi].
+static inline sz host_rand_range(u64 *state, sz lo, sz hi)
+{
+    assert(lo <= hi);
+    return lo + (sz)(host_rand(state) % (u64)(hi - lo + 1));
+}
+
+#endif // __HOST_H__
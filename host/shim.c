@@ -0,0 +1,45 @@
+// The kernel's printing functions for the host builds. Output goes to stdout instead of the serial port.
+
+#include <host.h>
+#include <tx/fmt.h>
+#include <tx/print.h>
+
+#define PRINT_DBG_BUF_SIZE 700
+
+struct result print_str(struct str str)
+{
+    host_write(str.dat, str.len);
+    return result_ok();
+}
+
+struct result print_fmt(struct str_buf buf, struct str fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    struct result res = fmt_vfmt(&buf, fmt, argp);
+    va_end(argp);
+    if (res.is_error)
+        return res;
+    return print_str(str_from_buf(buf));
+}
+
+struct result __print_dbg(struct str basename, struct str line, struct str funcname __unused, i16 level,
+                          struct str fmt_str, ...)
+{
+    if (level > __DEBUG__)
+        return result_ok();
+
+    char underlying[PRINT_DBG_BUF_SIZE];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    va_list argp;
+    va_start(argp, fmt_str);
+    struct result res = fmt(&buf, STR("[%s:%s]: "), basename, line);
+    if (!res.is_error)
+        res = fmt_vfmt(&buf, fmt_str, argp);
+    va_end(argp);
+    if (res.is_error)
+        return res;
+
+    return print_str(str_from_buf(buf));
+}
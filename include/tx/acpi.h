@@ -0,0 +1,21 @@
+// Discovery of the processors through the ACPI tables.
+
+#ifndef __TX_ACPI_H__
+#define __TX_ACPI_H__
+
+#include <tx/base.h>
+#include <tx/error.h>
+#include <tx/paging.h>
+#include <tx/smp.h>
+
+struct acpi_cpu_info {
+    paddr_t lapic_base; // Physical address of the local APIC registers (the same for all CPUs).
+    sz n_cpus;
+    u8 apic_ids[SMP_MAX_CPUS]; // Local APIC IDs of the enabled processors in the order they are listed in the MADT.
+};
+
+// Find the RSDP in the BIOS area, follow it to the MADT and collect the local APIC IDs of all enabled processors.
+// CPUs beyond `SMP_MAX_CPUS` are ignored. Tables outside of the dynamic memory are mapped temporarily.
+struct result acpi_find_cpus(struct acpi_cpu_info *info);
+
+#endif // __TX_ACPI_H__
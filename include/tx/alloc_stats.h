@@ -0,0 +1,30 @@
+// Allocator statistics
+//
+// The allocators keep cheap counters all the time: buddy allocators track their free list lengths and peak usage,
+// kvalloc tracks its live and peak usage, and pools and arena chains track their high-water marks. Recording the
+// call site of every kvalloc allocation is more expensive, so it's only done if the kernel was built with
+// `make ALLOC_STATS=1`. In this case, `alloc_stats_report` is also printed whenever an 'm' is received over the
+// serial port.
+
+#ifndef __TX_ALLOC_STATS_H__
+#define __TX_ALLOC_STATS_H__
+
+#include <tx/arena.h>
+#include <tx/base.h>
+#include <tx/pool.h>
+#include <tx/stringdef.h>
+
+#define ALLOC_STATS_MAX_SITES 128
+#define ALLOC_STATS_MAX_SOURCES 16
+
+// Count an allocation of `n_bytes` made at `basename:line`.
+void alloc_stats_record_site(struct str basename, sz line, sz n_bytes);
+
+// Include the statistics of `pool` or `chain` in the report. The pointers must stay valid.
+void alloc_stats_register_pool(struct str name, struct pool *pool);
+void alloc_stats_register_arena_chain(struct str name, struct arena_chain *chain);
+
+// Print all statistics over serial.
+void alloc_stats_report(void);
+
+#endif // __TX_ALLOC_STATS_H__
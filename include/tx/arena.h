@@ -1,6 +1,7 @@
 #ifndef __TX_ARENA_H__
 #define __TX_ARENA_H__
 
+#include <tx/alloc.h>
 #include <tx/assert.h>
 #include <tx/base.h>
 #include <tx/byte.h>
@@ -13,9 +14,40 @@
 // (not a pointer this time) as an argument, that means the function intends to
 // make a temporary internal allocation.
 
+// Growable arenas: An arena that belongs to an arena chain doesn't crash when it runs out of memory. Instead, it
+// gets a new block from the allocator of the chain and continues allocating from there. The blocks stay allocated
+// until the chain is restored to a mark that was taken before they were added (see `arena_restore`). This is
+// also true for blocks that were added through a copy of an arena that was passed by value.
+//
+// Marks make it cheap to use an arena as scratch space that's reset over and over again, e.g., once per request.
+// Restoring a mark is O(1) unless blocks need to be freed.
+
+struct arena_block {
+    struct arena_block *prev;
+    sz len;
+};
+
+struct arena_chain {
+    struct alloc alloc; // Source of new blocks.
+    struct arena_block *top; // Most recently added block.
+    sz block_size; // Minimum size of new blocks.
+
+    // Statistics
+    sz n_blocks; // Blocks that are currently part of the chain.
+    sz n_bytes; // Total length of these blocks.
+    sz n_bytes_high_water; // Maximum of `n_bytes` over the lifetime of the chain.
+};
+
 struct arena {
     byte *beg;
     byte *end;
+    struct arena_chain *chain; // `NULL` if the arena can't grow.
+};
+
+struct arena_mark {
+    byte *beg;
+    byte *end;
+    struct arena_block *top;
 };
 
 // Create a new arena that uses `bb` as its source of memory.
@@ -25,11 +57,106 @@ static inline struct arena arena_new(struct byte_array ba)
 
     arn.beg = ba.dat;
     arn.end = arn.beg + ba.len;
+    arn.chain = NULL;
 
     return arn;
 }
 
-static inline void *arena_alloc_aligned(struct arena *arn, sz n_bytes, sz align)
+static inline void arena_chain_init(struct arena_chain *chain, struct alloc alloc, sz block_size)
+{
+    assert(chain);
+    assert(block_size > (sz)sizeof(struct arena_block));
+
+    chain->alloc = alloc;
+    chain->top = NULL;
+    chain->block_size = block_size;
+    chain->n_blocks = 0;
+    chain->n_bytes = 0;
+    chain->n_bytes_high_water = 0;
+}
+
+// Create a new arena that gets all of its memory from `chain`. The first block is only allocated once the arena
+// is first used.
+static inline struct arena arena_new_chained(struct arena_chain *chain)
+{
+    assert(chain);
+
+    struct arena arn;
+
+    arn.beg = NULL;
+    arn.end = NULL;
+    arn.chain = chain;
+
+    return arn;
+}
+
+// Add a block to the chain of `arn` that can hold an allocation of `n_bytes` bytes with the given alignment and
+// continue allocating from this block. What's left of the current block is wasted.
+static inline void arena_grow(struct arena *arn, sz n_bytes, sz align)
+{
+    assert(arn);
+    assert(arn->chain);
+
+    struct arena_chain *chain = arn->chain;
+    sz hdr_size = sizeof(struct arena_block);
+    if (n_bytes > SZ_MAX - hdr_size - align)
+        crash("Out of memory\n");
+    sz len = MAX(chain->block_size, hdr_size + align + n_bytes);
+
+    struct arena_block *block = alloc_alloc(chain->alloc, len, alignof(struct arena_block));
+    if (!block)
+        crash("Out of memory\n");
+    block->prev = chain->top;
+    block->len = len;
+    chain->top = block;
+    chain->n_blocks++;
+    chain->n_bytes += len;
+    chain->n_bytes_high_water = MAX(chain->n_bytes_high_water, chain->n_bytes);
+
+    arn->beg = (byte *)block + hdr_size;
+    arn->end = (byte *)block + len;
+}
+
+// Take a mark of the current state of `arn`. Use `arena_restore` to return to this state later.
+static inline struct arena_mark arena_mark(struct arena *arn)
+{
+    assert(arn);
+
+    struct arena_mark mark;
+
+    mark.beg = arn->beg;
+    mark.end = arn->end;
+    mark.top = arn->chain ? arn->chain->top : NULL;
+
+    return mark;
+}
+
+// Free all allocations that were made from `arn` after `mark` was taken. All blocks that were added to the chain
+// of `arn` since then are returned to the allocator of the chain.
+static inline void arena_restore(struct arena *arn, struct arena_mark mark)
+{
+    assert(arn);
+
+    if (arn->chain) {
+        struct arena_chain *chain = arn->chain;
+        while (chain->top != mark.top) {
+            // If this fails, the mark is from a different chain or blocks older than the mark were freed already.
+            assert(chain->top);
+            struct arena_block *block = chain->top;
+            chain->top = block->prev;
+            chain->n_blocks--;
+            chain->n_bytes -= block->len;
+            alloc_free(chain->alloc, block, block->len);
+        }
+    }
+
+    arn->beg = mark.beg;
+    arn->end = mark.end;
+}
+
+// Like `arena_alloc_aligned` but the memory isn't zeroed. Use this for big buffers that are always written before
+// they are read (e.g., byte buffers that are only appended to).
+static inline void *arena_alloc_aligned_nozero(struct arena *arn, sz n_bytes, sz align)
 {
     assert(arn);
 
@@ -38,16 +165,26 @@ static inline void *arena_alloc_aligned(struct arena *arn, sz n_bytes, sz align)
 
     sz padding = -(uptr)arn->beg & (align - 1);
     sz available = arn->end - arn->beg - padding;
-    if (available < 0 || n_bytes > available)
-        crash("Out of memory\n");
+    if (available < 0 || n_bytes > available) {
+        if (!arn->chain)
+            crash("Out of memory\n");
+        arena_grow(arn, n_bytes, align);
+        padding = -(uptr)arn->beg & (align - 1);
+    }
     void *p = arn->beg + padding;
     arn->beg += padding + n_bytes;
+    return p;
+}
+
+static inline void *arena_alloc_aligned(struct arena *arn, sz n_bytes, sz align)
+{
+    void *p = arena_alloc_aligned_nozero(arn, n_bytes, align);
     byte_array_set(byte_array_new(p, n_bytes), 0);
     return p;
 }
 
 // Allocate `n_bytes` out of the arena. Crashes if the arena doesn't have
-// enough space. Never returns NULL. The returned bytes are always zeroed.
+// enough space and can't grow. Never returns NULL. The returned bytes are always zeroed.
 static inline void *arena_alloc(struct arena *arn, sz n_bytes)
 {
     return arena_alloc_aligned(arn, n_bytes, alignof(void *));
@@ -94,4 +231,13 @@ static inline struct byte_array byte_array_from_arena(sz n, struct arena *arn)
     return byte_array_new(arena_alloc(arn, n), n);
 }
 
+// The content of the byte array is undefined. See `arena_alloc_aligned_nozero`.
+static inline struct byte_array byte_array_from_arena_nozero(sz n, struct arena *arn)
+{
+    assert(arn);
+    assert(n > 0);
+
+    return byte_array_new(arena_alloc_aligned_nozero(arn, n, alignof(void *)), n);
+}
+
 #endif // __TX_ARENA_H__
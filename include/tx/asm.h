@@ -87,6 +87,32 @@ static inline void enable_interrupts(void)
     __asm__ volatile("sti");
 }
 
+#define RFLAGS_IF BIT(9) /* Interrupt enable flag */
+
+// Disable interrupts and return the previous value of the RFLAGS register. Passing this value to
+// `restore_interrupts` only enables interrupts again if they were enabled before. So unlike
+// `disable_interrupts`/`enable_interrupts`, these two can be nested and used inside interrupt handlers.
+static inline u64 save_and_disable_interrupts(void)
+{
+    u64 flags;
+    __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void restore_interrupts(u64 flags)
+{
+    if (flags & RFLAGS_IF)
+        enable_interrupts();
+}
+
+// Enable interrupts and halt until the next interrupt arrives. Interrupts are disabled again afterwards. Because `sti`
+// only takes effect after the next instruction, an interrupt can't slip in between `sti` and `hlt`. So it's safe to
+// check for pending work with interrupts disabled and then call this function.
+static inline void enable_interrupts_and_halt(void)
+{
+    __asm__ volatile("sti; hlt; cli" : : : "memory");
+}
+
 static inline void insl(u16 port, void *addr, u32 cnt)
 {
     __asm__ volatile("cld; rep insl" : "=D"(addr), "=c"(cnt) : "d"(port), "0"(addr), "1"(cnt) : "memory", "cc");
@@ -97,6 +123,19 @@ static inline void stosb(void *addr, u32 data, u32 cnt)
     __asm__ volatile("cld; rep stosb" : "=D"(addr), "=c"(cnt) : "0"(addr), "1"(cnt), "a"(data) : "memory", "cc");
 }
 
+static inline void stosq(void *addr, u64 data, u64 cnt)
+{
+    __asm__ volatile("cld; rep stosq" : "=D"(addr), "=c"(cnt) : "0"(addr), "1"(cnt), "a"(data) : "memory", "cc");
+}
+
+static inline void movsb(void *dst, const void *src, u64 cnt)
+{
+    __asm__ volatile("cld; rep movsb"
+                     : "=D"(dst), "=S"(src), "=c"(cnt)
+                     : "0"(dst), "1"(src), "2"(cnt)
+                     : "memory", "cc");
+}
+
 static inline void lgdt(volatile void *addr)
 {
     __asm__ volatile("lgdt (%0)" : : "r"(addr));
@@ -107,6 +146,33 @@ static inline void ltr(u16 selector)
     __asm__ volatile("ltr %0" : : "r"(selector));
 }
 
+#define MSR_GS_BASE 0xc0000101
+
+static inline u64 rdmsr(u32 msr)
+{
+    u32 lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((u64)hi << 32) | (u64)lo;
+}
+
+static inline void wrmsr(u32 msr, u64 val)
+{
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((u32)val), "d"((u32)(val >> 32)) : "memory");
+}
+
+// Hint to the CPU that this is a spin-wait loop.
+static inline void cpu_relax(void)
+{
+    __asm__ volatile("pause" : : : "memory");
+}
+
+static inline u64 read_cr2(void)
+{
+    u64 cr2 = 0;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
 static inline void write_cr3(u64 cr3)
 {
     __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
@@ -119,6 +185,11 @@ static inline u64 read_cr3(void)
     return cr3;
 }
 
+static inline void invlpg(u64 vaddr)
+{
+    __asm__ volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
 static inline u64 mmio_read64(u64 addr)
 {
     u64 val;
@@ -112,6 +112,15 @@ typedef double f64;
 #define MUL_OVERFLOW(a, b) __builtin_mul_overflow_p(a, b, (__typeof__((a) * (b)))0)
 #define IN_RANGE(a, base, len) ((a) >= (base) && (a) < (base) + (len))
 
+////////////////////////////////////////////////////////////////////////////////
+// Bit operations                                                             //
+////////////////////////////////////////////////////////////////////////////////
+
+// These compile down to single `bsr`/`bsf` instructions. The argument must be greater than zero.
+#define LOG2_FLOOR(n) ((sz)(U64_WIDTH - 1 - __builtin_clzll((u64)(n))))
+#define LOG2_CEIL(n) ((n) <= 1 ? (sz)0 : LOG2_FLOOR((u64)(n) - 1) + 1)
+#define CTZ(n) ((sz)__builtin_ctzll((u64)(n)))
+
 ////////////////////////////////////////////////////////////////////////////////
 // Variadic functions                                                         //
 ////////////////////////////////////////////////////////////////////////////////
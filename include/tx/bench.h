@@ -0,0 +1,29 @@
+// Helpers for microbenchmarks. The benchmarks are compiled into every kernel, but they only run at boot if the
+// kernel was built with `make BENCH=1`.
+
+#ifndef __TX_BENCH_H__
+#define __TX_BENCH_H__
+
+#include <tx/arena.h>
+#include <tx/asm.h>
+#include <tx/base.h>
+#include <tx/print.h>
+#include <tx/stringdef.h>
+
+#define BENCH_REPORT_BUF_SIZE 128
+
+// Print the average number of TSC cycles that each of the `n_ops` operations took since `start_tsc`. The result is
+// always printed, independently of the debug level.
+static inline void bench_report(struct str name, u64 start_tsc, sz n_ops)
+{
+    u64 cycles = rdtsc() - start_tsc;
+    char underlying[BENCH_REPORT_BUF_SIZE];
+    print_fmt(str_buf_new(underlying, 0, countof(underlying)), STR("bench: %s: %lu cycles/op (%ld ops)\n"), name,
+              cycles / MAX(n_ops, 1), n_ops);
+}
+
+// Compare the string-instruction-based `byte_fill`/`byte_copy` and the non-zeroing arena allocation to the plain byte
+// loops. `arn` must have room for a bit more than 12MiB.
+void byte_run_benchmarks(struct arena arn);
+
+#endif // __TX_BENCH_H__
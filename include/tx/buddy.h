@@ -18,20 +18,47 @@ struct block {
 
 struct buddy {
     struct block avail[N_FREE_LISTS];
-    struct byte_array bitmap;
+    u64 *bitmaps[N_FREE_LISTS]; // One free bitmap per order (see buddy.c).
+    u64 nonempty_mask; // Bit `ord` is set if `avail[ord]` isn't empty.
     sz max_ord;
+    sz n_pages; // Number of pages managed by the allocator. Not necessarily a power of two.
     byte *base;
+
+    // Statistics
+    sz n_free_blocks[N_FREE_LISTS]; // Length of each free list.
+    sz n_free_pages;
+    sz n_pages_high_water; // Maximum number of pages that were allocated at the same time.
 };
 
-// Initialize a buddy allocator. `arn` is used to allocate the buddy allocators
-// structures so the return value will be a pointer from `arn`.
+// Initialize a buddy allocator that manages all whole pages in `ba`. `arn` is used to allocate
+// the buddy allocators structures so the return value will be a pointer from `arn`.
 struct buddy *buddy_init(struct byte_array ba, struct arena *arn);
 
+// Returns how many bytes `buddy_init` will at most allocate from its arena to manage `len` bytes of memory.
+sz buddy_init_arena_size(sz len);
+
 // Allocate `size` bytes from the given buddy allocator. `buddy` must be non-NULL
 // and `size` must be greater than zero. The byte array that this function returns will
-// be aligned to a page boundary.
+// be aligned to a page boundary. `size` doesn't need to be a power of two: only the pages
+// that are needed to hold `size` bytes are kept and the rest is returned to the allocator.
 struct option_byte_array buddy_alloc(struct buddy *buddy, sz size);
 
+// Like `buddy_alloc` but the allocation is aligned to `align` bytes relative to `buddy->base`. `align` must be a
+// power of two. The allocation is freed with `buddy_free` like any other.
+struct option_byte_array buddy_alloc_aligned(struct buddy *buddy, sz size, sz align);
+
+// Returns how fragmented the free memory is in permille: 0 if all free memory is in a single block and close to
+// 1000 if the free memory is scattered over many small blocks. This is one minus the ratio of the largest free
+// block to all free memory.
+sz buddy_fragmentation(struct buddy *buddy);
+
+// Print the usage, the lengths of the free lists and the fragmentation index of `buddy`.
+void buddy_print_stats(struct buddy *buddy);
+
+// Assert that the free lists, the bitmaps and the counters of `buddy` agree with each other. This walks all free
+// blocks, so it's only meant for tests.
+void buddy_check(struct buddy *buddy);
+
 // Free an allocation from the given buddy allocator. `buddy` must be non-NULL,
 // and `ba.len` must match the size must of the original allocation.
 void buddy_free(struct buddy *buddy, struct byte_array ba);
@@ -40,4 +67,9 @@ void buddy_free(struct buddy *buddy, struct byte_array ba);
 void *buddy_alloc_wrapper(void *a, sz size, sz align __unused);
 void buddy_free_wrapper(void *a, void *ptr, sz size);
 
+// Measure allocation and free throughput. `arn` must have room for a bit more than 8MiB.
+void buddy_run_benchmarks(struct arena arn);
+
+void buddy_run_tests(struct arena arn);
+
 #endif // __TX_BUDDY_H__
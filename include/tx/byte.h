@@ -3,6 +3,7 @@
 #ifndef __TX_BYTE_H__
 #define __TX_BYTE_H__
 
+#include <tx/asm.h>
 #include <tx/assert.h>
 #include <tx/base.h>
 #include <tx/stringdef.h>
@@ -143,15 +144,34 @@ static inline struct byte_view byte_view_skip(struct byte_view bv, sz n)
     return byte_view_new(bv.dat + n, bv.len - n);
 }
 
+// Copying and filling memory is done with string instructions. We can't use SSE registers in the kernel
+// (`-mgeneral-regs-only`) but on CPUs with "enhanced rep movsb/stosb" (ERMSB) the string instructions
+// internally move whole cache lines at a time, which is faster than any loop over general purpose registers.
+
+// Copy `n` bytes from `src` to `dst`. The bytes are copied front to back, so `dst` may overlap with `src`
+// if it starts before `src`.
+static inline void byte_copy(byte *dst, byte *src, sz n)
+{
+    assert(n >= 0);
+    movsb(dst, src, n);
+}
+
+// Set `n` bytes starting at `dst` to `value`. Most bytes are written eight at a time.
+static inline void byte_fill(byte *dst, byte value, sz n)
+{
+    assert(n >= 0);
+    u64 pattern = 0x0101010101010101ULL * value;
+    stosq(dst, pattern, n / sizeof(u64));
+    stosb(dst + ALIGN_DOWN(n, sizeof(u64)), value, n % sizeof(u64));
+}
+
 // Use this if you were looking for `memcpy`.
 static inline sz byte_buf_append(struct byte_buf *bb, struct byte_view bv)
 {
     assert(bb);
 
     sz n = MIN(bb->cap - bb->len, bv.len);
-
-    for (sz i = 0; i < n; i++)
-        bb->dat[bb->len + i] = bv.dat[i];
+    byte_copy(bb->dat + bb->len, bv.dat, n);
 
     bb->len += n;
     return n;
@@ -162,9 +182,7 @@ static inline sz byte_buf_append_n(struct byte_buf *bb, sz n, byte value)
     assert(bb);
 
     n = MIN(bb->cap - bb->len, n);
-
-    for (sz i = 0; i < n; i++)
-        bb->dat[bb->len + i] = value;
+    byte_fill(bb->dat + bb->len, value, n);
 
     bb->len += n;
     return n;
@@ -173,8 +191,7 @@ static inline sz byte_buf_append_n(struct byte_buf *bb, sz n, byte value)
 // Use this if you were looking for `memset`.
 static inline void byte_array_set(struct byte_array ba, byte value)
 {
-    for (sz i = 0; i < ba.len; i++)
-        ba.dat[i] = value;
+    byte_fill(ba.dat, value, ba.len);
 }
 
 static inline bool byte_view_is_equal(struct byte_view bv1, struct byte_view bv2)
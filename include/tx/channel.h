@@ -0,0 +1,62 @@
+// Bounded channels for passing fixed-size elements between tasks.
+//
+// A channel is a ring of elements in a buffer that's provided by the caller, so sending and receiving never allocates.
+// Any number of tasks can send and receive on the same channel. Elements are received in the order they were sent.
+//
+// The `try_` functions never block and can also be called from interrupt handlers. The other functions park the task
+// on a wait queue until the channel has room (when sending) or an element (when receiving).
+
+#ifndef __TX_CHANNEL_H__
+#define __TX_CHANNEL_H__
+
+#include <tx/base.h>
+#include <tx/byte.h>
+#include <tx/error.h>
+#include <tx/sched.h>
+#include <tx/spinlock.h>
+#include <tx/time.h>
+
+struct channel {
+    struct byte_array buf;
+    sz elem_size;
+    sz cap; // Number of elements that fit into `buf`.
+    sz head; // Index of the oldest element.
+    sz len; // Number of elements in the channel.
+
+    struct spinlock lock;
+    struct wait_queue senders; // Tasks waiting for room in the channel.
+    struct wait_queue receivers; // Tasks waiting for an element.
+};
+
+// Initialize a channel that stores as many elements of `elem_size` bytes as fit into `buf`. `buf` must hold at
+// least one element. The channel contains pointers to itself, so it can't be moved once it's initialized.
+void channel_init(struct channel *ch, struct byte_array buf, sz elem_size);
+
+// Copy `elem_size` bytes from `elem` into the channel. Returns `EAGAIN` if the channel is full.
+struct result channel_try_send(struct channel *ch, const void *elem);
+
+// Copy the oldest element in the channel to `elem`. Returns `EAGAIN` if the channel is empty.
+struct result channel_try_recv(struct channel *ch, void *elem);
+
+// Like `channel_try_send` but wait until there is room in the channel or until `timeout` has passed. Returns `false`
+// in the latter case.
+bool channel_send_timeout(struct channel *ch, const void *elem, struct time_ms timeout);
+
+// Like `channel_try_recv` but wait until there is an element or until `timeout` has passed. Returns `false` in the
+// latter case.
+bool channel_recv_timeout(struct channel *ch, void *elem, struct time_ms timeout);
+
+static inline void channel_send(struct channel *ch, const void *elem)
+{
+    channel_send_timeout(ch, elem, WAIT_FOREVER);
+}
+
+static inline void channel_recv(struct channel *ch, void *elem)
+{
+    channel_recv_timeout(ch, elem, WAIT_FOREVER);
+}
+
+// Must be called by the main task after the scheduler is initialized.
+void channel_run_tests(void);
+
+#endif // __TX_CHANNEL_H__
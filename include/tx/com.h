@@ -13,5 +13,7 @@
 struct result com_init(u16 port);
 struct result com_write(u16 port, struct str str);
 struct result com_read(u16 port, struct str_buf *buf);
+// Like `com_read` but only reads the bytes that have already arrived. Returns `EAGAIN` if there are none.
+struct result com_try_read(u16 port, struct str_buf *buf);
 
 #endif // __TX_COM__
@@ -0,0 +1,78 @@
+// Memory for DMA
+//
+// Devices access memory using physical addresses, so the buffers they use must be physically contiguous. A
+// `struct dma_buf` pairs the virtual addresses of such a buffer with the physical address the device needs.
+//
+// Drivers that recycle many buffers of the same size (e.g., for packet data) should use a DMA pool. All buffers
+// in a pool come from one contiguous region, so translating between the virtual and physical address of a
+// buffer is a matter of adding an offset.
+
+#ifndef __TX_DMA_H__
+#define __TX_DMA_H__
+
+#include <tx/base.h>
+#include <tx/byte.h>
+#include <tx/error.h>
+#include <tx/option.h>
+#include <tx/paging.h>
+#include <tx/pool.h>
+
+struct dma_buf {
+    struct byte_array mem; // Virtual addresses used by the kernel.
+    paddr_t paddr; // Physical address of `mem.dat`. This is what the device uses.
+};
+
+struct_result(dma_buf, struct dma_buf);
+struct_option(dma_buf, struct dma_buf);
+
+// Allocate a physically contiguous and zeroed buffer of `n_bytes`. Both the virtual and the physical address of
+// the buffer are aligned to `align`, which must be a power of two no bigger than `KVALLOC_MAX_ALIGN`.
+struct result_dma_buf dma_alloc(sz n_bytes, sz align);
+
+// Free a buffer that was allocated with `dma_alloc`.
+void dma_free(struct dma_buf buf);
+
+struct dma_pool {
+    struct dma_buf mem; // All buffers of the pool.
+    struct pool bufs;
+    sz buf_size;
+};
+
+// Initialize a pool of `n_bufs` buffers of `buf_size` bytes each. Every buffer is aligned to `align`.
+struct result dma_pool_init(struct dma_pool *pool, sz buf_size, sz n_bufs, sz align);
+
+// Free the memory of the pool. All buffers must have been returned to the pool.
+void dma_pool_deinit(struct dma_pool *pool);
+
+// Take a buffer from the pool. The buffer isn't zeroed. Returns none if all buffers are in use.
+static inline struct option_dma_buf dma_pool_alloc(struct dma_pool *pool)
+{
+    assert(pool);
+
+    byte *dat = pool_alloc_nozero(&pool->bufs);
+    if (!dat)
+        return option_dma_buf_none();
+
+    struct dma_buf buf;
+    buf.mem = byte_array_new(dat, pool->buf_size);
+    buf.paddr = pool->mem.paddr + (dat - pool->mem.mem.dat);
+    return option_dma_buf_ok(buf);
+}
+
+// Give a buffer back to the pool.
+static inline void dma_pool_free(struct dma_pool *pool, struct dma_buf buf)
+{
+    assert(pool);
+    assert(IN_RANGE(buf.mem.dat, pool->mem.mem.dat, pool->mem.mem.len));
+    pool_free(&pool->bufs, buf.mem.dat);
+}
+
+// Get the virtual address of the buffer in `pool` at the physical address `paddr`.
+static inline byte *dma_pool_virt(struct dma_pool *pool, paddr_t paddr)
+{
+    assert(pool);
+    assert(IN_RANGE(paddr, pool->mem.paddr, pool->mem.mem.len));
+    return pool->mem.mem.dat + (paddr - pool->mem.paddr);
+}
+
+#endif // __TX_DMA_H__
@@ -0,0 +1,23 @@
+// Physical page frame allocator
+//
+// Hands out single physical pages (frames) that back demand-paged memory. The frames are taken from the dynamic
+// memory that kvalloc manages, so physical memory isn't split between kvalloc and the frame allocator up front. Every
+// frame stays accessible through the canonical mapping of the dynamic memory (see `phys_to_virt`).
+
+#ifndef __TX_FRAME_H__
+#define __TX_FRAME_H__
+
+#include <tx/base.h>
+#include <tx/error.h>
+#include <tx/paging.h>
+
+// Allocate a physical page. The memory isn't zeroed.
+struct result_paddr_t frame_alloc(void);
+
+// Return a frame that was allocated with `frame_alloc`.
+void frame_free(paddr_t paddr);
+
+// Number of frames that are currently allocated.
+sz frame_n_in_use(void);
+
+#endif // __TX_FRAME_H__
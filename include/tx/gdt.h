@@ -52,6 +52,9 @@ static_assert(sizeof(struct seg_pseudo_descriptor_64) == 10);
 // we don't need data segments (see IA-32 manual, section 3.4.4).
 void gdt_init(void);
 
+// Set up the GDT and TSS of the CPU with index `cpu_id` (see `struct cpu`). `gdt_init` does this for the BSP.
+void gdt_init_cpu(sz cpu_id);
+
 struct seg_descriptor *gdt_get_global(void);
 
 struct task_state {
@@ -76,6 +79,11 @@ static_assert(sizeof(struct task_state) == 104);
 
 struct task_state *tss_get_global(void);
 
+// Index of the Interrupt Stack Table entry used for double faults. A page fault that happens because a task's stack
+// ran into its guard page can't be delivered on the same stack, so the CPU raises a double fault instead. It needs a
+// stack of its own to be reported.
+#define TSS_IST_DOUBLE_FAULT 1
+
 static inline u16 segment_selector(u16 gdt_idx, u16 rpl)
 {
     return (gdt_idx << 3) | rpl;
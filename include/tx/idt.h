@@ -3,4 +3,7 @@
 
 void interrupt_init(void);
 
+// Load the IDT set up by `interrupt_init` on an application processor. Interrupts stay disabled.
+void interrupt_init_cpu(void);
+
 #endif // __TX_IDT_H__
@@ -71,6 +71,10 @@ void isr_stub_44(void);
 void isr_stub_45(void);
 void isr_stub_46(void);
 void isr_stub_47(void);
+void isr_stub_48(void);
+void isr_stub_49(void);
+void isr_stub_50(void);
+void isr_stub_63(void);
 
 // Ranges for different types of interrupt vectors. Given as intervals: [beg; end)
 #define RESERVED_VECTORS_BEG 0
@@ -78,9 +82,21 @@ void isr_stub_47(void);
 #define NUM_RESERVED_VECTORS (RESERVED_VECTORS_END - RESERVED_VECTORS_BEG)
 #define NUM_USED_RESERVED_VECTORS 22 // Based on the manual, only the first 22 reserved vectors are used
 #define IRQ_VECTORS_BEG RESERVED_VECTORS_END
-#define IRQ_VECTORS_END 48
+#define IRQ_VECTORS_END 64
 #define NUM_IRQ_VECTORS (IRQ_VECTORS_END - IRQ_VECTORS_BEG)
 
+// The first 16 IRQ vectors are raised by the PIC, the others by the local APIC of the CPU that handles them.
+#define PIC_VECTORS_END 48
+#define VECTOR_LAPIC_TIMER 48
+#define VECTOR_IPI_RESCHED 49 // Makes the receiving CPU check its run queue.
+#define VECTOR_IPI_TLB_FLUSH 50 // Makes the receiving CPU flush its TLB (see `smp_flush_tlb_others`).
+#define VECTOR_LAPIC_SPURIOUS 63 // The local APIC doesn't expect an end of interrupt for this one.
+
+#define VECTOR_PAGE_FAULT 14
+// Bits in the error code of a page fault.
+#define PAGE_FAULT_ERROR_P BIT(0) // The fault was caused by a page-level protection violation, not a missing page.
+#define PAGE_FAULT_ERROR_WR BIT(1) // The access was a write.
+
 typedef void (*interrupt_handler_func_t)(struct trap_frame *cpu_state, void *private_data);
 
 struct result isr_register_handler(u64 vector, interrupt_handler_func_t handler, void *private_data);
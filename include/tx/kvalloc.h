@@ -11,15 +11,54 @@
 // manage. All addresses in this range must be accessible.
 struct result kvalloc_init(struct byte_array vaddrs);
 
-// Allocate `n_bytes` bytes with an alignment of at least `align` bytes.
-// kvalloc must be initialized before calling this function for the first time.
-struct option_byte_array kvalloc_alloc(sz n_bytes, sz align);
+// Largest alignment that `kvalloc_alloc` supports.
+#define KVALLOC_MAX_ALIGN 0x200000 /* 2 MiB */
+
+// Allocate `n_bytes` bytes with an alignment of at least `align` bytes. `align` must be a power of two
+// that's at most `KVALLOC_MAX_ALIGN`. The memory isn't zeroed, so there is no separate `_nozero` variant of
+// this function. kvalloc must be initialized before calling this function for the first time.
+//
+// The call site is recorded if the kernel was built with `make ALLOC_STATS=1` (see alloc_stats.h).
+struct option_byte_array __kvalloc_alloc(sz n_bytes, sz align, struct str basename, sz line);
+
+#define kvalloc_alloc(n_bytes, align) __kvalloc_alloc(n_bytes, align, STR(__BASENAME__), __LINE__)
+
+// Like `kvalloc_alloc` but the memory is zeroed. Allocations of a few pages are served from a pool of pages that
+// were zeroed ahead of time if possible.
+struct option_byte_array __kvalloc_alloc_zeroed(sz n_bytes, sz align, struct str basename, sz line);
+
+#define kvalloc_alloc_zeroed(n_bytes, align) __kvalloc_alloc_zeroed(n_bytes, align, STR(__BASENAME__), __LINE__)
+
+// Zero one more block for the pool used by `kvalloc_alloc_zeroed`. Returns `false` if there is nothing left to do.
+// This is meant to be called when the CPU is idle.
+bool kvalloc_prezero_step(void);
 
 // Deallocate the memory in the `ba`.
 void kvalloc_free(struct byte_array ba);
 
+// Reserve `n_bytes` of demand-paged memory. Only virtual addresses are reserved. Each page is backed by a physical
+// frame when it's first accessed, so sparsely used regions only take up as much memory as they touch. The memory
+// isn't zeroed. It has no stable physical address, so it must not be used for DMA.
+struct option_byte_array kvalloc_reserve(sz n_bytes);
+
+// Like `kvalloc_reserve`, but the page below the returned memory is reserved too and never backed. Touching it
+// crashes the kernel. This is used for stacks, which grow down.
+struct option_byte_array kvalloc_reserve_guarded(sz n_bytes);
+
+// Free the physical frames backing all whole pages in `ba`, which must be part of a region returned by
+// `kvalloc_reserve`. The virtual addresses stay reserved and are backed again when they are accessed.
+void kvalloc_release_backing(struct byte_array ba);
+
+// Give back a region that was returned by `kvalloc_reserve` or `kvalloc_reserve_guarded`. This also frees its backing.
+void kvalloc_unreserve(struct byte_array ba);
+
 // Wrappers for tx/alloc.h. `a` isn't used.
 void *kvalloc_alloc_wrapper(void *a, sz size, sz align);
 void kvalloc_free_wrapper(void *a, void *ptr, sz size);
 
+// Print how much memory kvalloc hands out and the state of its buddy allocator.
+void kvalloc_print_stats(void);
+
+void kvalloc_run_tests(void);
+
 #endif // __TX_KVALLOC_H__
@@ -84,6 +84,9 @@ void netdev_intr_receive(struct netdev *netdev, struct byte_view data);
 // done processing it.
 struct input_packet *netdev_get_input(void);
 
+// Block the current task until the input queue contains at least one packet.
+void netdev_wait_input(void);
+
 // Remove the given packet from the input queue. This frees up the entry to store a newly received packet in it.
 void netdev_release_input(struct input_packet *pkt);
 
@@ -7,6 +7,7 @@
 #include <tx/net/ip_addr.h>
 #include <tx/net/netorder.h>
 #include <tx/net/send_buf.h>
+#include <tx/time.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // IP side                                                                   //
@@ -45,6 +46,11 @@ struct tcp_conn *tcp_conn_listen(struct ipv4_addr addr, u16 port, struct arena t
 // Get a handle to a connection that was listened for by `listen_conn` (if any).
 struct tcp_conn *tcp_conn_accept(struct tcp_conn *listen_conn);
 
+// Block the current task until a segment for `conn` arrives or until `timeout` has passed. Returns `false` on timeout.
+// For a LISTEN connection, the task is also woken up when a new connection can be accepted. Use `WAIT_FOREVER` to
+// wait without a timeout. Check the state of the connection again after waking up; there might be nothing new.
+bool tcp_conn_wait(struct tcp_conn *conn, struct time_ms timeout);
+
 // Send `payload` to the other side of the connection `conn`. The return value indicates the number of bytes we were
 // able to transmit. The `peer_closed_conn` flag will be updated to indicate whether the peer closed the connection.
 // Once this has happened, you can continue to transmit data, but the peer may be ignoring it, which makes the
@@ -55,11 +61,11 @@ struct result_sz tcp_conn_send(struct tcp_conn *conn, struct byte_view payload,
                                struct send_buf sb, struct arena tmp);
 
 // Store data received on the connection `conn` into `buf`. On success, returns the maximum number of bytes available
-// to recive. This means 0 is returned if there is no data. In this case, wait a bit and try again. If there is more
-// data available than the buffer can fit, the total number of bytes available is returned and the buffer is filled
-// to its limit. The `peer_closed_conn` flag will be updated to indicate whether the peer closed the connection. Once
-// this has happended, you can receive data for as long as you want, but you won't get any more. At that point, call
-// `tcp_conn_close`.
+// to recive. This means 0 is returned if there is no data. In this case, use `tcp_conn_wait` and try again. If there is
+// more data available than the buffer can fit, the total number of bytes available is returned and the buffer is
+// filled to its limit. The `peer_closed_conn` flag will be updated to indicate whether the peer closed the
+// connection. Once this has happended, you can receive data for as long as you want, but you won't get any more. At
+// that point, call `tcp_conn_close`.
 struct result_sz tcp_conn_recv(struct tcp_conn *conn, struct byte_buf *buf, bool *peer_closed_conn);
 
 // Close the connection `*conn`. `conn` will be set to NULL since it's stale now.
@@ -2,6 +2,7 @@
 #define __TX_PAGING_H__
 
 #include <config.h>
+#include <tx/alloc.h>
 #include <tx/base.h>
 #include <tx/byte.h>
 #include <tx/error.h>
@@ -11,6 +12,7 @@
 #define PT_FLAG_US BIT(2)
 #define PT_FLAG_PWT BIT(3)
 #define PT_FLAG_PCD BIT(4)
+#define PT_FLAG_PS BIT(7) // Set in PDEs and PDPTEs that map a 2 MiB or 1 GiB page instead of pointing to a table.
 
 #define PML4_BIT_BASE 39LU
 #define PDPT_BIT_BASE 30LU
@@ -19,6 +21,7 @@
 
 #define PTE_REGION_SIZE BIT(PT_BIT_BASE)
 #define PDE_REGION_SIZE BIT(PD_BIT_BASE)
+#define PDPTE_REGION_SIZE BIT(PDPT_BIT_BASE)
 
 // Get the index that `vaddr` has in some page table page where `base` is the
 // index of the first of the nine bits in `vaddr` that make up this index.
@@ -102,9 +105,48 @@ struct byte_array paging_init(struct addr_mapping code_addrs, struct addr_mappin
 struct result paging_map_region(struct addr_mapping addrs);
 struct result paging_unmap_region(struct addr_mapping addrs);
 
+// Check if `vaddr` is in the window for demand-paged memory. The window starts at 4 GiB, so the constants don't fit
+// into 32 bits.
+static inline bool is_demand_paged_addr(vaddr_t vaddr)
+{
+    return IN_RANGE(vaddr, (vaddr_t)KERN_VMEM_VADDR, (vaddr_t)KERN_VMEM_LEN);
+}
+
+// Map and unmap single pages in the window for demand-paged memory (`KERN_VMEM_*`). No address mappings are
+// created for these pages. `paging_unmap_page` returns the physical address that the page was mapped to. Once it
+// returns, no CPU has the page in its TLB anymore, so the frame can be freed.
+struct result paging_map_page(vaddr_t vaddr, paddr_t paddr);
+struct result_paddr_t paging_unmap_page(vaddr_t vaddr);
+
+// Page table pages are allocated from memory reserved by `paging_init`. Once this memory is used up, page table
+// pages are taken from `alloc`, which must return page-aligned memory for allocations of `PAGE_SIZE` bytes.
+void paging_set_pt_page_alloc(struct alloc alloc);
+
 // Translate between physical and virtual addresses. The translations are based on the address mappings
 // that were created by calls to `paging_init` and/or `paging_map_region` and `paging_unmap_region`.
-struct result_paddr_t virt_to_phys(vaddr_t vaddr);
-struct result_vaddr_t phys_to_virt(paddr_t paddr);
+//
+// The lookup functions search the address mappings. Most translations are for the canonical mapping of the
+// dynamic memory, though, which `virt_to_phys` and `phys_to_virt` handle inline with a constant offset.
+// Addresses in the window for demand-paged memory are translated by walking the page table, so they can only be
+// translated while they are backed.
+struct result_paddr_t virt_to_phys_lookup(vaddr_t vaddr);
+struct result_vaddr_t phys_to_virt_lookup(paddr_t paddr);
+
+static inline struct result_paddr_t virt_to_phys(vaddr_t vaddr)
+{
+    if (IN_RANGE(vaddr, KERN_DYN_VADDR, KERN_DYN_LEN))
+        return result_paddr_t_ok(vaddr - KERN_DYN_VADDR + KERN_DYN_PADDR);
+    return virt_to_phys_lookup(vaddr);
+}
+
+static inline struct result_vaddr_t phys_to_virt(paddr_t paddr)
+{
+    if (IN_RANGE(paddr, KERN_DYN_PADDR, KERN_DYN_LEN))
+        return result_vaddr_t_ok(paddr - KERN_DYN_PADDR + KERN_DYN_VADDR);
+    return phys_to_virt_lookup(paddr);
+}
+
+// Compare the inline translations to the lookups.
+void paging_run_benchmarks(void);
 
 #endif // __TX_PAGING_H__
@@ -1,68 +1,163 @@
 #ifndef __TX_POOL_H__
 #define __TX_POOL_H__
 
+#include <tx/alloc.h>
 #include <tx/arena.h>
 #include <tx/assert.h>
 #include <tx/base.h>
 #include <tx/byte.h>
 
+/*
+ * Blocks that were never handed out are taken from the current slab with a
+ * bump pointer. Only blocks that were freed are kept on the free list. This
+ * way, creating a pool doesn't touch any of its memory.
+ *
+ * A growable pool gets a new slab from its allocator whenever the current slab
+ * is used up and the free list is empty. Slabs are never given back to the
+ * allocator.
+ */
 struct pool {
-    ptr *head; /* First block in the list */
+    ptr *head; /* First block in the list of freed blocks */
+    byte *bump; /* First block in the current slab that was never handed out */
+    byte *bump_end; /* End of the current slab */
     sz size; /* Size of each block */
+
+    bool can_grow;
+    struct alloc slab_alloc; /* Only used if `can_grow` is set */
+    sz blocks_per_slab;
+
+    /* Statistics */
+    sz n_in_use; /* Blocks that are currently allocated */
+    sz n_high_water; /* Maximum of `n_in_use` over the lifetime of the pool */
+    sz n_slabs; /* Slabs added to a growable pool */
 };
 
+static inline sz pool_block_size(sz block_size)
+{
+    sz align = MAX(sizeof(ptr), alignof(void *));
+
+    assert(block_size > 0);
+    assert(align <= SZ_MAX - block_size);
+    block_size = (block_size + align - 1) & ~(align - 1);
+    assert(block_size > 0);
+
+    return block_size;
+}
+
 /**
  * Create a new pool. It uses `ba.dat` as its source of memory. The minimum
  * block size is `MAX(sizeof(ptr), alignof(void *))`.
  */
 static inline struct pool pool_new(struct byte_array ba, sz block_size)
 {
-    struct pool pool = { .head = NULL, .size = 0 };
-    sz align = MAX(sizeof(ptr), alignof(void *));
-    ptr *block = NULL;
-    sz n_blocks = 0;
+    struct pool pool;
 
     assert(ba.dat);
     assert(ba.len > 0);
-    assert(block_size > 0);
 
-    assert(align <= SZ_MAX - block_size);
-    block_size = (block_size + align - 1) & ~(align - 1);
+    byte_array_set(byte_array_new(&pool, sizeof(pool)), 0);
+    pool.size = pool_block_size(block_size);
+    pool.bump = ba.dat;
+    pool.bump_end = ba.dat + (ba.len / pool.size) * pool.size;
 
-    assert(block_size > 0);
-    n_blocks = ba.len / block_size;
+    return pool;
+}
 
-    /* Link all the blocks that are available */
-    for (sz i = 0; i < n_blocks * block_size; i += block_size) {
-        block = (ptr *)(ba.dat + i);
-        *block = (ptr)pool.head;
-        pool.head = block;
-    }
+/**
+ * Create a new pool that starts out empty. Every time the pool runs out of
+ * blocks, a slab of `blocks_per_slab` blocks is allocated from `slab_alloc`.
+ */
+static inline struct pool pool_new_growable(struct alloc slab_alloc, sz block_size, sz blocks_per_slab)
+{
+    struct pool pool;
+
+    assert(blocks_per_slab > 0);
 
-    pool.size = block_size;
+    byte_array_set(byte_array_new(&pool, sizeof(pool)), 0);
+    pool.size = pool_block_size(block_size);
+    assert(blocks_per_slab <= SZ_MAX / pool.size);
+    pool.can_grow = true;
+    pool.slab_alloc = slab_alloc;
+    pool.blocks_per_slab = blocks_per_slab;
 
     return pool;
 }
 
 /**
- * Allocate a block from the pool. Returns `NULL` if the pool is empty.
+ * Let a pool that was created with `pool_new` get more slabs of
+ * `blocks_per_slab` blocks from `slab_alloc` once its memory is used up.
  */
-static inline void *pool_alloc(struct pool *pool)
+static inline void pool_set_growable(struct pool *pool, struct alloc slab_alloc, sz blocks_per_slab)
+{
+    assert(pool);
+    assert(blocks_per_slab > 0);
+    assert(blocks_per_slab <= SZ_MAX / pool->size);
+
+    pool->can_grow = true;
+    pool->slab_alloc = slab_alloc;
+    pool->blocks_per_slab = blocks_per_slab;
+}
+
+/**
+ * Add a new slab to a growable pool. Returns `false` if the pool can't grow.
+ */
+static inline bool pool_grow(struct pool *pool)
+{
+    assert(pool);
+
+    if (!pool->can_grow)
+        return false;
+
+    sz slab_len = pool->blocks_per_slab * pool->size;
+    byte *slab = alloc_alloc(pool->slab_alloc, slab_len, alignof(void *));
+    if (!slab)
+        return false;
+
+    pool->bump = slab;
+    pool->bump_end = slab + slab_len;
+    pool->n_slabs++;
+
+    return true;
+}
+
+/**
+ * Allocate a block from the pool without zeroing it. Returns `NULL` if the
+ * pool is empty and can't grow. The first word of the block contains garbage.
+ */
+static inline void *pool_alloc_nozero(struct pool *pool)
 {
     ptr *block = NULL;
 
     assert(pool);
 
-    if (!pool->head)
-        return NULL;
+    if (pool->head) {
+        block = pool->head;
+        pool->head = (ptr *)*block;
+    } else {
+        if (pool->bump == pool->bump_end && !pool_grow(pool))
+            return NULL;
+        block = (ptr *)pool->bump;
+        pool->bump += pool->size;
+    }
 
-    block = pool->head;
-    pool->head = (ptr *)*block;
-    byte_array_set(byte_array_new(block, pool->size), 0);
+    pool->n_in_use++;
+    pool->n_high_water = MAX(pool->n_high_water, pool->n_in_use);
 
     return block;
 }
 
+/**
+ * Allocate a block from the pool. Returns `NULL` if the pool is empty and
+ * can't grow.
+ */
+static inline void *pool_alloc(struct pool *pool)
+{
+    void *block = pool_alloc_nozero(pool);
+    if (block)
+        byte_array_set(byte_array_new(block, pool->size), 0);
+    return block;
+}
+
 /**
  * Free a block back to the pool.
  */
@@ -70,9 +165,11 @@ static inline void pool_free(struct pool *pool, void *block)
 {
     assert(pool);
     assert(block);
+    assert(pool->n_in_use > 0);
 
     *(ptr *)block = (ptr)pool->head;
     pool->head = block;
+    pool->n_in_use--;
 }
 
 /**
@@ -9,9 +9,11 @@
 #include <tx/buddy.h>
 #include <tx/error.h>
 #include <tx/pool.h>
+#include <tx/spinlock.h>
 #include <tx/string.h>
 
-#define RAM_FS_MAX_NODES_NUM 10000
+// Nodes are allocated in slabs of this many nodes as the file system grows.
+#define RAM_FS_NODES_PER_SLAB 256
 #define RAM_FS_DEFAULT_FILE_SIZE PAGE_SIZE
 
 enum ram_fs_node_type {
@@ -35,7 +37,8 @@ struct ram_fs_node {
 struct_result(ram_fs_node, struct ram_fs_node *);
 
 struct ram_fs {
-    // TODO: A flexible file system would require the node_alloc and string_alloc to grow dynamically.
+    // Protects the nodes, the allocators and the scratch arena. Tasks on different CPUs can use the same file system.
+    struct spinlock lock;
     struct alloc data_alloc;
     struct pool node_alloc;
     struct arena scratch;
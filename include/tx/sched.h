@@ -1,19 +1,37 @@
-// Simple cooperative scheduling logic.
+// Scheduling of tasks on all CPUs.
+//
+// Every CPU has its own run queues and takes tasks from the run queues of other CPUs when it runs out of work. Tasks
+// switch when they sleep, wait, yield or finish, and with `PREEMPT=1` also when their time slice ends.
 
 #ifndef __TX_SCHED_H__
 #define __TX_SCHED_H__
 
 #include <tx/base.h>
+#include <tx/byte.h>
 #include <tx/error.h>
 #include <tx/list.h>
 #include <tx/time.h>
 
+// Stack size of tasks that don't ask for a different one.
 #define TASK_STACK_SIZE 0x4000
 
 typedef void (*sched_callback_func_t)(void *context);
 
+// A task only runs if no task with a higher priority is ready. Tasks with a high priority must block or sleep
+// regularly, otherwise tasks with lower priorities never run. With `PREEMPT=1`, a task that becomes ready preempts a
+// running task with a lower priority right away.
+enum sched_priority {
+    SCHED_PRIORITY_LOW = -1, // Bulk work that can wait.
+    SCHED_PRIORITY_NORMAL = 0,
+    SCHED_PRIORITY_HIGH = 1, // Latency-sensitive work like packet processing.
+};
+
+#define SCHED_N_PRIORITIES 3
+
 struct sched_task {
-    byte stack[TASK_STACK_SIZE];
+    // Stacks are fully backed, guarded regions with a guard page below them. The main task runs on the boot stack, so
+    // its `stack` is empty.
+    struct byte_array stack;
     u64 *stack_ptr;
 
     struct time_ms wake_time;
@@ -22,7 +40,31 @@ struct sched_task {
     sched_callback_func_t callback;
     void *context;
 
-    struct dlist sleep_list;
+    // Position of the task in the sleep queue, or -1 if it isn't sleeping. Tasks with the same wake time are ordered
+    // by `sleep_seq`, so they run in the order in which they went to sleep.
+    sz sleep_idx;
+    u64 sleep_seq;
+
+    struct str name; // Shown in statistics and traces.
+    enum sched_priority priority;
+    i32 preempt_count; // The task can only be preempted while this is zero (see `sched_preempt_disable`).
+    i32 kernel_lock_depth; // Number of nested `kernel_lock` calls.
+
+    sz cpu; // CPU that the task runs on or ran on last.
+    bool on_cpu; // The task is running or a CPU is still switching away from it.
+    bool is_blocked; // The task sleeps or waits and must be put on a run queue when it's woken up.
+
+    struct dlist task_list; // Entry in the list of all tasks.
+    struct dlist run_list; // Entry in a run queue while the task is ready to run.
+    struct dlist wait_list; // Entry in the wait queue that the task is blocked on (if any).
+
+    // CPU accounting. Times are measured in TSC ticks.
+    u64 run_tsc; // Time spent running.
+    u64 wait_tsc; // Time spent on the run queue.
+    u64 n_switches; // Number of times the task was switched to.
+    u64 n_preemptions; // Number of times the task was preempted.
+    u64 last_tsc; // When the task was last switched to.
+    u64 ready_tsc; // When the task was last put on the run queue.
 };
 
 // Initialize the scheduling subsystem. The current flow of execution that calls `sched_init` becomes the main task.
@@ -33,19 +75,130 @@ struct sched_task {
 // task should periodically sleep to allow the new tasks to run.
 void sched_init(void);
 
-// Create a new task. The task is scheduled the first time `sleep_*` is called after this function return. It can yield
-// control by itself calling `sleep_*`. When `callback` returns, the task is deleted and other tasks are scheduled.
+// Create a new task. The task is put at the end of a run queue, so it runs once the tasks that are already ready on
+// that CPU have had their turn. It can yield control by itself calling `sched_yield` or `sleep_*` or by waiting on a
+// wait queue. When `callback` returns, the task is deleted and other tasks are scheduled. Tasks always run with
+// interrupts enabled.
 struct result sched_create_task(sched_callback_func_t callback, void *context);
 
+struct sched_task_attrs {
+    sz stack_size; // Rounded up to whole pages. Zero means `TASK_STACK_SIZE`.
+    enum sched_priority priority; // Zero means `SCHED_PRIORITY_NORMAL`.
+    struct str name; // Must stay valid while the task exists. Empty means "task".
+};
+
+// Like `sched_create_task` but with the given attributes.
+struct result sched_create_task_attrs(sched_callback_func_t callback, void *context, struct sched_task_attrs attrs);
+
 // Return the ID of the task that is currently running. This function can be called even before the scheduling
 // subsystem was initialized. It will return 0 in that case. This is consitent with the fact that the main task
 // that's executed by calling `sched_init` has ID 0.
 u16 sched_current_id(void);
 
-// Relinquish control of execution for `duration` milliseconds. Execution of the task calling this function will
-// resume once at least `duration` milliseconds have passed. Other tasks will run in the meantime. If these other
-// tasks don't frequently yield control (by calling sleep or completing), the waiting task may be delayed longer
-// than `duration` milliseconds.
+// Print how much time every CPU spent idle (halted because no task was ready) and busy since it started running tasks.
+// For every task, print how long it ran, how long it waited to run once it was ready and how often it was switched to.
+void sched_print_stats(void);
+
+// Print the last context switches as JSON in the Chrome trace event format if the kernel was built with
+// `make SCHED_TRACE=1`. Save the output to a file and open it in https://ui.perfetto.dev or chrome://tracing. Each CPU
+// shows up as a process and each task as a thread in it. The times where no task was ready show up as "idle".
+void sched_dump_trace(void);
+
+// Measure the cost of a context switch while 10, 100 and 1000 other tasks are sleeping. Must be called by the main
+// task while no other tasks exist and before the APs are started.
+void sched_run_benchmarks(void);
+
+// Make the calling AP run tasks. Its boot stack becomes the stack of its idle task. Called by `smp_start_aps` once the
+// AP is online.
+__noreturn void sched_run_ap(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Preemption                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// If the kernel was built with `make PREEMPT=1`, a task that runs for longer than its time slice is preempted by the
+// timer interrupt when other tasks are ready. Otherwise, tasks only switch when they sleep, wait or finish.
+//
+// A section that can't be preempted only keeps out the other tasks on the same CPU, tasks on other CPUs keep running.
+// So state that's shared between tasks must be protected by a spinlock or by the kernel lock. These sections can be
+// nested. The task can still sleep inside of them, which lets other tasks run as usual.
+
+void sched_preempt_disable(void);
+
+// End a section that can't be preempted. If the time slice ran out inside the section, the task is preempted now.
+void sched_preempt_enable(void);
+
+// Called by the timer interrupt handlers of all CPUs. Ends the time slice of the current task if it's used up. On the
+// BSP, it also wakes up the sleeping tasks whose wake time has passed.
+void sched_timer_tick(void);
+
+// Called by the interrupt handling code after the end of an interrupt was signaled. Switches to another
+// task if the time slice of the current task ended and it can be preempted. The state of the preempted task is
+// saved in the trap frame on its stack and restored once the task runs again and returns from the interrupt.
+void sched_preempt_from_interrupt(void);
+
+// Let the other tasks that are ready and have the same or a higher priority run first. The current task is put at the
+// end of its run queue. If no such task is ready, this returns right away. No time is read, so this is the cheapest
+// way to hand off to another task.
+void sched_yield(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernel lock                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+// The kernel lock serializes code that was written for a single CPU, like the network stack, between tasks on all
+// CPUs. Unlike a spinlock, the task that holds it can sleep, wait and yield: it gives up the lock while it's blocked
+// and takes it again before it continues. So the protected state can change while the task is blocked. The lock can
+// be taken recursively and the task can't be preempted while it holds it. A task must not finish while it holds it.
+
+void kernel_lock(void);
+void kernel_unlock(void);
+
+// Relinquish control of execution for `duration` milliseconds. A duration of zero is the same as `sched_yield`.
+// Execution of the task calling this function will resume once at least `duration` milliseconds have passed. Other
+// tasks will run in the meantime. If these other tasks don't frequently yield control (by calling sleep or
+// completing), the waiting task may be delayed longer than `duration` milliseconds.
 void sleep_ms(struct time_ms duration);
 
+///////////////////////////////////////////////////////////////////////////////
+// Wait queues                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+// A wait queue lets tasks block until some event happens instead of polling for it with `sleep_ms`. Whoever causes
+// the event calls `wake_up` on the queue, which makes all tasks waiting on it ready to run. `wake_up` can be called
+// from interrupt handlers.
+
+struct wait_queue {
+    struct dlist waiters;
+};
+
+// Timeout for waiting without a time limit.
+#define WAIT_FOREVER time_ms_new(U64_MAX)
+
+typedef bool (*wait_cond_func_t)(void *context);
+
+void wait_queue_init(struct wait_queue *wq);
+
+// Block the current task until `wake_up` is called on `wq` or until `timeout` has passed. Returns `false` in the
+// latter case. There is no condition to check, so this is only safe to use for events that are caused by tasks that
+// hold the kernel lock while the caller holds it, too. Then no such task can run between checking for the event and
+// calling this function.
+bool wait_queue_sleep(struct wait_queue *wq, struct time_ms timeout);
+
+// Block the current task until `cond(context)` returns true or until `timeout` has passed. The condition is checked
+// again every time the task is woken up through `wq`. Returns the last result of the condition.
+//
+// The task is put on `wq` before the condition is checked, so a `wake_up` from an interrupt handler or another CPU
+// can't get lost between checking the condition and going to sleep. The condition is checked with interrupts disabled,
+// so `cond` must be quick and it must not block.
+bool wait_event_timeout(struct wait_queue *wq, wait_cond_func_t cond, void *context, struct time_ms timeout);
+
+static inline void wait_event(struct wait_queue *wq, wait_cond_func_t cond, void *context)
+{
+    wait_event_timeout(wq, cond, context, WAIT_FOREVER);
+}
+
+// Wake up all tasks waiting on `wq`. This can be called from interrupt handlers.
+void wake_up(struct wait_queue *wq);
+
 #endif // __TX_SCHED_H__
@@ -0,0 +1,60 @@
+// Slab allocator for small, fixed-size objects.
+//
+// A slab cache hands out objects of a single size. It carves them out of slabs, which are power-of-two-sized blocks
+// of pages that the cache gets from a page allocator (usually the buddy allocator behind kvalloc). Every slab starts
+// with a `struct slab` header that's followed by the objects.
+
+#ifndef __TX_SLAB_H__
+#define __TX_SLAB_H__
+
+#include <config.h>
+#include <tx/alloc.h>
+#include <tx/arena.h>
+#include <tx/base.h>
+#include <tx/list.h>
+
+// Slabs are made big enough to fit at least this many objects (minus the space used by the slab header).
+#define SLAB_MIN_OBJS 8
+
+struct slab_cache;
+
+struct slab {
+    struct dlist link; // Entry in either the partial or the full list of the cache.
+    struct slab_cache *cache;
+    ptr *free_head; // Objects that were freed after being handed out once.
+    sz n_carved; // Objects that were handed out at least once. The rest of the slab has never been touched.
+    sz n_used;
+};
+
+struct slab_cache {
+    sz obj_size;
+    sz slab_len; // A power of two and a multiple of `PAGE_SIZE`.
+    sz obj_offset; // Offset of the first object from the start of a slab.
+    sz n_objs; // Number of objects per slab.
+    struct dlist partial; // Slabs with both used and free objects.
+    struct dlist full; // Slabs where all objects are used.
+    struct slab *empty; // We keep at most one empty slab around so that alloc/free pairs don't thrash the pages.
+    struct alloc page_alloc;
+};
+
+// Initialize a slab cache for objects of `obj_size` bytes. `obj_size` must be a power of two. All objects are
+// aligned to `obj_size`. `page_alloc` is used to allocate and free slabs. The slabs it returns must be page-aligned.
+void slab_cache_init(struct slab_cache *cache, sz obj_size, struct alloc page_alloc);
+
+// Allocate an object from the cache. Returns `NULL` if no new slab could be allocated. The memory isn't zeroed.
+void *slab_cache_alloc(struct slab_cache *cache);
+
+// Return `obj` to the slab it was allocated from. Use `slab_lookup` to find the slab.
+void slab_free(struct slab *slab, void *obj);
+
+// Find the slab that `obj` belongs to. This only works if the page allocator of the cache returns slabs that are
+// aligned to `slab_len` relative to `base` (which the buddy allocator does with respect to its base).
+static inline struct slab *slab_lookup(byte *base, sz slab_len, void *obj)
+{
+    assert((byte *)obj >= base);
+    return (struct slab *)(base + ALIGN_DOWN((byte *)obj - base, slab_len));
+}
+
+void slab_run_tests(struct arena arn);
+
+#endif // __TX_SLAB_H__
@@ -0,0 +1,73 @@
+// Multiprocessor support
+//
+// Every CPU has a `struct cpu` that it finds through its GS base. The application processors (APs) are found in the
+// ACPI MADT and started with the INIT-SIPI-SIPI sequence when the kernel is built with `SMP=1`. Once an AP is online,
+// it joins the scheduler and runs tasks from the run queues just like the BSP (see sched.c).
+//
+// The PIC only delivers interrupts to the BSP, so the BSP keeps using the PIT as its timer. The APs use the timer of
+// their local APIC to end time slices. CPUs notify each other with inter-processor interrupts (IPIs): a reschedule
+// IPI wakes up a CPU when a task is put on its run queue, and a TLB flush IPI makes the other CPUs drop translations
+// of pages that were unmapped.
+
+#ifndef __TX_SMP_H__
+#define __TX_SMP_H__
+
+#include <tx/asm.h>
+#include <tx/base.h>
+#include <tx/time.h>
+
+#define SMP_MAX_CPUS 16
+
+struct cpu {
+    struct cpu *self; // Must be the first member. `cpu_current` reads it through the GS base.
+    sz id; // Index into the table of CPUs. The BSP has ID 0.
+    u8 apic_id;
+    bool is_online;
+    u64 tlb_flush_gen; // Last TLB shootdown that this CPU flushed its TLB for (see `smp_flush_tlb_others`).
+};
+
+static inline struct cpu *cpu_current(void)
+{
+    struct cpu *cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Set up the per-CPU data of the BSP. Must be called before anything uses `cpu_current`.
+void smp_init_bsp(void);
+
+// Find the other processors in the ACPI tables. The tables are stored in memory that's handed out by kvalloc, so
+// this must be called after paging is initialized but before kvalloc is.
+void smp_discover_cpus(void);
+
+// Start the APs that were found by `smp_discover_cpus` and wait for them to come online. An AP that doesn't come online
+// in time is stopped with an INIT IPI. The APs start running tasks right away, so this must be called after
+// `sched_init`.
+void smp_start_aps(void);
+
+sz smp_n_cpus_online(void);
+
+// Send a reschedule IPI to the CPU with the given ID. Nothing happens if it isn't online.
+void smp_send_resched(sz cpu_id);
+
+// Make all other CPUs that are online flush their TLBs and wait until they did. Must be called after pages were
+// unmapped and before their frames are reused. The calling CPU must invalidate its own TLB entries itself.
+void smp_flush_tlb_others(void);
+
+// Flush the TLB of the current CPU if another CPU asked for it in `smp_flush_tlb_others`. The IPI can't be delivered
+// while interrupts are disabled, so code that waits for other CPUs with interrupts disabled must call this while it
+// spins. Otherwise, two CPUs that wait for each other would wait forever.
+void smp_handle_tlb_flush(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Local APIC                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// Signal the end of an interrupt that was raised by the local APIC of the current CPU.
+void lapic_send_eoi(void);
+
+// Raise `VECTOR_LAPIC_TIMER` on the current CPU once at `deadline` or earlier. This works like `time_set_oneshot`,
+// but every CPU has a timer of its own. Only available once `smp_start_aps` found a local APIC.
+void lapic_timer_set_oneshot(struct time_ms deadline);
+
+#endif // __TX_SMP_H__
@@ -0,0 +1,69 @@
+// Spinlocks protect state that's shared between CPUs.
+//
+// `spin_lock` also disables preemption, so that no other task on the same CPU can spin on the lock while its owner
+// is switched out. State that's also touched by interrupt handlers must use `spin_lock_irqsave`, which disables
+// interrupts instead. Spinlocks aren't recursive.
+//
+// A CPU that spins with interrupts disabled can't receive the IPI of a TLB shootdown. The owner of the lock might be
+// waiting for that shootdown to complete, so the TLB is flushed while spinning if another CPU asked for it.
+
+#ifndef __TX_SPINLOCK_H__
+#define __TX_SPINLOCK_H__
+
+#include <tx/asm.h>
+#include <tx/base.h>
+#include <tx/sched.h>
+#include <tx/smp.h>
+
+struct spinlock {
+    volatile u32 is_locked;
+};
+
+// Spinlocks in static storage start out unlocked. All others must be initialized with this before they're used.
+static inline void spin_lock_init(struct spinlock *lock)
+{
+    lock->is_locked = 0;
+}
+
+static inline void spin_lock_raw(struct spinlock *lock)
+{
+    while (__atomic_exchange_n(&lock->is_locked, 1, __ATOMIC_ACQUIRE)) {
+        // Only read the lock while it's taken, so the cache line isn't bounced between CPUs.
+        while (__atomic_load_n(&lock->is_locked, __ATOMIC_RELAXED)) {
+            cpu_relax();
+            smp_handle_tlb_flush();
+        }
+    }
+}
+
+static inline void spin_unlock_raw(struct spinlock *lock)
+{
+    __atomic_store_n(&lock->is_locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline void spin_lock(struct spinlock *lock)
+{
+    sched_preempt_disable();
+    spin_lock_raw(lock);
+}
+
+static inline void spin_unlock(struct spinlock *lock)
+{
+    spin_unlock_raw(lock);
+    sched_preempt_enable();
+}
+
+static inline u64 spin_lock_irqsave(struct spinlock *lock)
+{
+    u64 flags = save_and_disable_interrupts();
+    spin_lock_raw(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *lock, u64 flags)
+{
+    spin_unlock_raw(lock);
+    restore_interrupts(flags);
+}
+
+#endif // __TX_SPINLOCK_H__
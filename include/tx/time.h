@@ -20,4 +20,20 @@ void time_init(void);
 
 struct time_ms time_current_ms(void);
 
+// Read the raw time stamp counter. Use this to measure intervals that are much shorter than a millisecond.
+u64 time_current_tsc(void);
+
+// Convert a number of TSC ticks to milliseconds.
+struct time_ms time_ms_from_tsc(u64 ticks);
+
+// Convert a number of TSC ticks to microseconds.
+u64 time_us_from_tsc(u64 ticks);
+
+// Busy-wait for at least `us` microseconds. This doesn't depend on the timer interrupt.
+void time_delay_us(u64 us);
+
+// Raise the timer interrupt once at `deadline` or earlier. The interrupt might arrive early, so check the time
+// again after it fires. Arming the timer again replaces the previous deadline.
+void time_set_oneshot(struct time_ms deadline);
+
 #endif // __TX_TIME_H__
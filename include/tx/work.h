@@ -0,0 +1,43 @@
+// Deferred work
+//
+// Interrupt handlers should do as little as possible, because other interrupts (including the timer) are held back
+// while they run. Everything that doesn't have to happen right away can be put into a `struct work` and scheduled
+// with `work_schedule`. A high-priority worker task then runs it with interrupts enabled soon after.
+//
+// Work items are linked into the queue directly, so scheduling never allocates and never fails. A work item that is
+// scheduled again before it ran only runs once. If it's scheduled while it runs, it runs again afterwards.
+
+#ifndef __TX_WORK_H__
+#define __TX_WORK_H__
+
+#include <tx/base.h>
+#include <tx/list.h>
+
+typedef void (*work_func_t)(void *context);
+
+struct work {
+    work_func_t func;
+    void *context;
+    bool is_pending; // The work is in the queue and hasn't started running yet.
+    struct dlist list;
+};
+
+static inline void work_init(struct work *work, work_func_t func, void *context)
+{
+    work->func = func;
+    work->context = context;
+    work->is_pending = false;
+    dlist_init_empty(&work->list);
+}
+
+// Create the worker task. Must be called after `sched_init` and before any work is scheduled.
+void work_queue_init(void);
+
+// Put `work` at the end of the queue unless it's already pending. Returns `false` if it was. This can be called from
+// interrupt handlers. `work` must stay valid until it ran.
+bool work_schedule(struct work *work);
+
+// Must be called by the main task after `work_queue_init`.
+void work_run_tests(void);
+
+#endif // __TX_WORK_H__
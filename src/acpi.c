@@ -0,0 +1,299 @@
+// ACPI table parsing
+//
+// Only the tables that lead to the MADT are parsed. The MADT lists the local APICs of the processors, which is all
+// that's needed to start the application processors (see src/smp.c).
+//
+// References:
+//  - ACPI Specification 6.5, Section 5.2 (https://uefi.org/specs/ACPI/6.5/05_ACPI_Software_Programming_Model.html)
+
+#include <tx/acpi.h>
+#include <tx/assert.h>
+#include <tx/print.h>
+#include <tx/string.h>
+
+struct acpi_rsdp {
+    char signature[8]; // "RSD PTR "
+    u8 checksum; // Covers the first 20 bytes (the ACPI 1.0 part of the structure).
+    char oem_id[6];
+    u8 revision; // 0 for ACPI 1.0, 2 if the XSDT fields below are present.
+    u32 rsdt_addr;
+    u32 length;
+    u64 xsdt_addr;
+    u8 ext_checksum; // Covers the whole structure.
+    u8 _reserved[3];
+} __packed;
+
+static_assert(sizeof(struct acpi_rsdp) == 36);
+
+#define ACPI_RSDP_V1_LEN 20
+
+struct acpi_sdt_header {
+    char signature[4];
+    u32 length; // Including the header.
+    u8 revision;
+    u8 checksum; // Covers the whole table.
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __packed;
+
+static_assert(sizeof(struct acpi_sdt_header) == 36);
+
+struct acpi_madt {
+    struct acpi_sdt_header hdr;
+    u32 lapic_addr;
+    u32 flags;
+    // Variable-length entries follow, each starting with a `struct acpi_madt_entry`.
+} __packed;
+
+static_assert(sizeof(struct acpi_madt) == 44);
+
+struct acpi_madt_entry {
+    u8 type;
+    u8 length; // Including this header.
+} __packed;
+
+#define ACPI_MADT_TYPE_LAPIC 0
+#define ACPI_MADT_TYPE_LAPIC_ADDR_OVERRIDE 5
+
+struct acpi_madt_lapic {
+    struct acpi_madt_entry hdr;
+    u8 acpi_processor_uid;
+    u8 apic_id;
+    u32 flags;
+} __packed;
+
+#define ACPI_MADT_LAPIC_ENABLED BIT(0)
+#define ACPI_MADT_LAPIC_ONLINE_CAPABLE BIT(1)
+
+struct acpi_madt_lapic_addr_override {
+    struct acpi_madt_entry hdr;
+    u16 _reserved;
+    u64 lapic_addr;
+} __packed;
+
+// The RSDP is located on a 16-byte boundary somewhere in the BIOS read-only memory. It can also be in the first KiB
+// of the EBDA, but QEMU's firmware puts it into the BIOS area.
+#define ACPI_BIOS_AREA_PADDR 0xe0000
+#define ACPI_BIOS_AREA_LEN 0x20000
+
+///////////////////////////////////////////////////////////////////////////////
+// Temporary mappings                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+// Usually, the tables are stored in the last few pages of RAM, which are part of the dynamic memory and thus
+// already mapped. Everything else is identity-mapped until the tables have been parsed.
+
+#define ACPI_MAX_MAPPINGS 8
+
+static struct addr_mapping global_acpi_mappings[ACPI_MAX_MAPPINGS];
+static sz global_acpi_n_mappings;
+
+static struct result_vaddr_t acpi_map(paddr_t paddr, sz len)
+{
+    assert(len > 0);
+
+    struct result_vaddr_t first_res = phys_to_virt(paddr);
+    struct result_vaddr_t last_res = phys_to_virt(paddr + len - 1);
+    if (!first_res.is_error && !last_res.is_error) {
+        if (result_vaddr_t_checked(last_res) - result_vaddr_t_checked(first_res) != (vaddr_t)len - 1)
+            return result_vaddr_t_error(EINVAL);
+        return first_res;
+    }
+
+    // A table that's only partially covered by an existing mapping can't be mapped a second time.
+    if (!first_res.is_error || !last_res.is_error)
+        return result_vaddr_t_error(EINVAL);
+
+    if (global_acpi_n_mappings >= ACPI_MAX_MAPPINGS)
+        return result_vaddr_t_error(ENOMEM);
+
+    struct addr_mapping mapping;
+    mapping.type = ADDR_MAPPING_TYPE_CANONICAL;
+    mapping.mem_type = ADDR_MAPPING_MEMORY_DEFAULT;
+    mapping.perms = 0; // Read-only
+    mapping.pbase = ALIGN_DOWN(paddr, PAGE_SIZE);
+    mapping.vbase = mapping.pbase;
+    mapping.len = ALIGN_UP(paddr + len, PAGE_SIZE) - mapping.pbase;
+
+    struct result res = paging_map_region(mapping);
+    if (res.is_error)
+        return result_vaddr_t_error(res.code);
+
+    global_acpi_mappings[global_acpi_n_mappings++] = mapping;
+
+    return result_vaddr_t_ok(paddr);
+}
+
+static void acpi_unmap_all(void)
+{
+    for (sz i = 0; i < global_acpi_n_mappings; i++)
+        assert(!paging_unmap_region(global_acpi_mappings[i]).is_error);
+    global_acpi_n_mappings = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Table parsing                                                             //
+///////////////////////////////////////////////////////////////////////////////
+
+static bool acpi_checksum_is_valid(const void *dat, sz len)
+{
+    const u8 *bytes = dat;
+    u8 sum = 0;
+    for (sz i = 0; i < len; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+static struct acpi_rsdp *acpi_find_rsdp(void)
+{
+    struct result_vaddr_t area_res = acpi_map(ACPI_BIOS_AREA_PADDR, ACPI_BIOS_AREA_LEN);
+    if (area_res.is_error)
+        return NULL;
+    byte *area = (byte *)result_vaddr_t_checked(area_res);
+
+    for (sz off = 0; off + (sz)sizeof(struct acpi_rsdp) <= ACPI_BIOS_AREA_LEN; off += 16) {
+        struct acpi_rsdp *rsdp = (struct acpi_rsdp *)(area + off);
+        if (!str_is_equal(str_new(rsdp->signature, sizeof(rsdp->signature)), STR("RSD PTR ")))
+            continue;
+        if (!acpi_checksum_is_valid(rsdp, ACPI_RSDP_V1_LEN))
+            continue;
+        if (rsdp->revision >= 2 && !acpi_checksum_is_valid(rsdp, sizeof(*rsdp)))
+            continue;
+        return rsdp;
+    }
+
+    return NULL;
+}
+
+// Map the table at `paddr` and check that it has the expected signature and a valid checksum.
+static struct acpi_sdt_header *acpi_map_table(paddr_t paddr, struct str signature)
+{
+    struct result_vaddr_t hdr_res = acpi_map(paddr, sizeof(struct acpi_sdt_header));
+    if (hdr_res.is_error)
+        return NULL;
+    struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)result_vaddr_t_checked(hdr_res);
+
+    if (!str_is_equal(str_new(hdr->signature, sizeof(hdr->signature)), signature))
+        return NULL;
+    if (hdr->length < sizeof(*hdr))
+        return NULL;
+
+    struct result_vaddr_t table_res = acpi_map(paddr, hdr->length);
+    if (table_res.is_error)
+        return NULL;
+    hdr = (struct acpi_sdt_header *)result_vaddr_t_checked(table_res);
+
+    if (!acpi_checksum_is_valid(hdr, hdr->length))
+        return NULL;
+
+    return hdr;
+}
+
+static struct acpi_madt *acpi_find_madt(struct acpi_rsdp *rsdp)
+{
+    assert(rsdp);
+
+    // The XSDT has 64-bit pointers to the other tables, the RSDT has 32-bit pointers. Prefer the XSDT if it exists.
+    bool use_xsdt = rsdp->revision >= 2 && rsdp->xsdt_addr;
+    struct acpi_sdt_header *root = NULL;
+    if (use_xsdt)
+        root = acpi_map_table(rsdp->xsdt_addr, STR("XSDT"));
+    else
+        root = acpi_map_table(rsdp->rsdt_addr, STR("RSDT"));
+    if (!root)
+        return NULL;
+
+    sz entry_size = use_xsdt ? sizeof(u64) : sizeof(u32);
+    sz n_entries = (root->length - sizeof(*root)) / entry_size;
+    byte *entries = (byte *)(root + 1);
+
+    for (sz i = 0; i < n_entries; i++) {
+        paddr_t paddr = 0;
+        if (use_xsdt)
+            paddr = ((u64 *)entries)[i]; // The entries are only 4-byte aligned but x86 doesn't mind.
+        else
+            paddr = ((u32 *)entries)[i];
+
+        struct result_vaddr_t hdr_res = acpi_map(paddr, sizeof(struct acpi_sdt_header));
+        if (hdr_res.is_error)
+            continue;
+        struct acpi_sdt_header *hdr = (struct acpi_sdt_header *)result_vaddr_t_checked(hdr_res);
+        if (str_is_equal(str_new(hdr->signature, sizeof(hdr->signature)), STR("APIC")))
+            return (struct acpi_madt *)acpi_map_table(paddr, STR("APIC"));
+    }
+
+    return NULL;
+}
+
+static void acpi_parse_madt(struct acpi_madt *madt, struct acpi_cpu_info *info)
+{
+    assert(madt);
+    assert(info);
+
+    info->lapic_base = madt->lapic_addr;
+    info->n_cpus = 0;
+
+    byte *end = (byte *)madt + madt->hdr.length;
+    byte *cur = (byte *)(madt + 1);
+
+    while (cur + sizeof(struct acpi_madt_entry) <= end) {
+        struct acpi_madt_entry *entry = (struct acpi_madt_entry *)cur;
+        if (entry->length < sizeof(*entry) || cur + entry->length > end)
+            break;
+
+        switch (entry->type) {
+        case ACPI_MADT_TYPE_LAPIC: {
+            struct acpi_madt_lapic *lapic = (struct acpi_madt_lapic *)entry;
+            // Processors that are only online-capable could be hot-plugged later. They aren't started.
+            if (!(lapic->flags & ACPI_MADT_LAPIC_ENABLED))
+                break;
+            if (info->n_cpus >= SMP_MAX_CPUS) {
+                print_dbg(PWARN, STR("Ignoring CPU with APIC ID %hhu: only %d CPUs are supported\n"), lapic->apic_id,
+                          SMP_MAX_CPUS);
+                break;
+            }
+            info->apic_ids[info->n_cpus++] = lapic->apic_id;
+            break;
+        }
+        case ACPI_MADT_TYPE_LAPIC_ADDR_OVERRIDE: {
+            struct acpi_madt_lapic_addr_override *override = (struct acpi_madt_lapic_addr_override *)entry;
+            info->lapic_base = override->lapic_addr;
+            break;
+        }
+        default:
+            break;
+        }
+
+        cur += entry->length;
+    }
+}
+
+struct result acpi_find_cpus(struct acpi_cpu_info *info)
+{
+    assert(info);
+
+    struct result res = result_ok();
+
+    struct acpi_rsdp *rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        res = result_error(ENOENT);
+        goto out;
+    }
+
+    struct acpi_madt *madt = acpi_find_madt(rsdp);
+    if (!madt) {
+        res = result_error(ENOENT);
+        goto out;
+    }
+
+    acpi_parse_madt(madt, info);
+    if (info->n_cpus == 0)
+        res = result_error(ENODEV);
+
+out:
+    acpi_unmap_all();
+    return res;
+}
@@ -0,0 +1,121 @@
+// Allocator statistics
+
+#include <tx/alloc_stats.h>
+#include <tx/assert.h>
+#include <tx/kvalloc.h>
+#include <tx/print.h>
+#include <tx/spinlock.h>
+#include <tx/string.h>
+
+struct alloc_site {
+    struct str basename;
+    sz line;
+    sz n_allocs;
+    sz n_bytes; // Total number of bytes requested at this site.
+};
+
+// The call sites are only recorded by kvalloc while it holds its lock. The report reads them without that lock, so a
+// new site is only counted once its entry is filled in.
+static struct alloc_site global_alloc_sites[ALLOC_STATS_MAX_SITES];
+static sz global_n_alloc_sites = 0;
+static sz global_n_dropped_site_allocs = 0; // Allocations from sites that didn't fit into the table.
+
+struct alloc_source {
+    struct str name;
+    struct pool *pool; // Either this ...
+    struct arena_chain *chain; // ... or this is set.
+};
+
+// Allocators are registered by tasks on any CPU, so the sources are protected by their own lock.
+static struct spinlock global_alloc_sources_lock;
+static struct alloc_source global_alloc_sources[ALLOC_STATS_MAX_SOURCES];
+static sz global_n_alloc_sources = 0;
+
+void alloc_stats_record_site(struct str basename, sz line, sz n_bytes)
+{
+    for (sz i = 0; i < global_n_alloc_sites; i++) {
+        struct alloc_site *site = &global_alloc_sites[i];
+        if (site->line == line && str_is_equal(site->basename, basename)) {
+            site->n_allocs++;
+            site->n_bytes += n_bytes;
+            return;
+        }
+    }
+
+    if (global_n_alloc_sites == ALLOC_STATS_MAX_SITES) {
+        global_n_dropped_site_allocs++;
+        return;
+    }
+
+    struct alloc_site *site = &global_alloc_sites[global_n_alloc_sites];
+    site->basename = basename;
+    site->line = line;
+    site->n_allocs = 1;
+    site->n_bytes = n_bytes;
+    __atomic_store_n(&global_n_alloc_sites, global_n_alloc_sites + 1, __ATOMIC_RELEASE);
+}
+
+static void alloc_stats_register(struct alloc_source source)
+{
+    if (!__ALLOC_STATS__)
+        return;
+
+    spin_lock(&global_alloc_sources_lock);
+    if (global_n_alloc_sources == ALLOC_STATS_MAX_SOURCES) {
+        spin_unlock(&global_alloc_sources_lock);
+        print_dbg(PWARN, STR("Too many allocators to keep statistics for. Ignoring %s\n"), source.name);
+        return;
+    }
+
+    global_alloc_sources[global_n_alloc_sources++] = source;
+    spin_unlock(&global_alloc_sources_lock);
+}
+
+void alloc_stats_register_pool(struct str name, struct pool *pool)
+{
+    assert(pool);
+    alloc_stats_register((struct alloc_source){ .name = name, .pool = pool, .chain = NULL });
+}
+
+void alloc_stats_register_arena_chain(struct str name, struct arena_chain *chain)
+{
+    assert(chain);
+    alloc_stats_register((struct alloc_source){ .name = name, .pool = NULL, .chain = chain });
+}
+
+void alloc_stats_report(void)
+{
+    char underlying[256];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    print_str(STR("*** Allocator statistics\n"));
+
+    kvalloc_print_stats();
+
+    spin_lock(&global_alloc_sources_lock);
+    for (sz i = 0; i < global_n_alloc_sources; i++) {
+        struct alloc_source *source = &global_alloc_sources[i];
+        if (source->pool) {
+            struct pool *pool = source->pool;
+            print_fmt(buf, STR("pool %s: %ld blocks of %ld bytes in use (peak %ld), %ld slabs\n"), source->name,
+                      pool->n_in_use, pool->size, pool->n_high_water, pool->n_slabs);
+        } else {
+            struct arena_chain *chain = source->chain;
+            print_fmt(buf, STR("arena chain %s: %ld blocks, %ld KiB (peak %ld KiB)\n"), source->name, chain->n_blocks,
+                      chain->n_bytes / 1024, chain->n_bytes_high_water / 1024);
+        }
+    }
+    spin_unlock(&global_alloc_sources_lock);
+
+    if (__ALLOC_STATS__) {
+        print_str(STR("kvalloc call sites:\n"));
+        sz n_sites = __atomic_load_n(&global_n_alloc_sites, __ATOMIC_ACQUIRE);
+        for (sz i = 0; i < n_sites; i++) {
+            struct alloc_site *site = &global_alloc_sites[i];
+            print_fmt(buf, STR("  %s:%ld: %ld allocs, %ld bytes\n"), site->basename, site->line, site->n_allocs,
+                      site->n_bytes);
+        }
+        if (global_n_dropped_site_allocs)
+            print_fmt(buf, STR("  (%ld allocs from other sites)\n"), global_n_dropped_site_allocs);
+    }
+}
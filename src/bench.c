@@ -0,0 +1,66 @@
+// Benchmarks for the inline helpers in byte.h and arena.h, which don't have a translation unit of their own.
+
+#include <config.h>
+#include <tx/arena.h>
+#include <tx/bench.h>
+#include <tx/byte.h>
+
+// This is the size of the web server's response buffer.
+#define BYTE_BENCH_SIZE BIT(22) /* 4 MiB */
+#define BYTE_BENCH_N_ITERS 16
+
+// These are the byte loops that `byte_array_set` and `byte_buf_append` used before they were
+// implemented with string instructions.
+
+static void byte_fill_loop(byte *dst, byte value, sz n)
+{
+    for (sz i = 0; i < n; i++)
+        dst[i] = value;
+}
+
+static void byte_copy_loop(byte *dst, byte *src, sz n)
+{
+    for (sz i = 0; i < n; i++)
+        dst[i] = src[i];
+}
+
+void byte_run_benchmarks(struct arena arn)
+{
+    byte *src = arena_alloc_aligned_nozero(&arn, BYTE_BENCH_SIZE, PAGE_SIZE);
+    byte *dst = arena_alloc_aligned_nozero(&arn, BYTE_BENCH_SIZE, PAGE_SIZE);
+
+    u64 start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++)
+        byte_fill_loop(src, (byte)i, BYTE_BENCH_SIZE);
+    bench_report(STR("byte loop fill (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+
+    start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++)
+        byte_fill(src, (byte)i, BYTE_BENCH_SIZE);
+    bench_report(STR("byte_fill (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+
+    start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++)
+        byte_copy_loop(dst, src, BYTE_BENCH_SIZE);
+    bench_report(STR("byte loop copy (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+
+    start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++)
+        byte_copy(dst, src, BYTE_BENCH_SIZE);
+    bench_report(STR("byte_copy (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+
+    // This is what the web server does for every request. The arena is reset every time.
+    start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++) {
+        struct arena tmp = arn;
+        byte_array_from_arena(BYTE_BENCH_SIZE, &tmp);
+    }
+    bench_report(STR("byte_array_from_arena (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+
+    start = rdtsc();
+    for (sz i = 0; i < BYTE_BENCH_N_ITERS; i++) {
+        struct arena tmp = arn;
+        byte_array_from_arena_nozero(BYTE_BENCH_SIZE, &tmp);
+    }
+    bench_report(STR("byte_array_from_arena_nozero (4 MiB)"), start, BYTE_BENCH_N_ITERS);
+}
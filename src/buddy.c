@@ -1,4 +1,5 @@
 #include <config.h>
+#include <tx/bench.h>
 #include <tx/buddy.h>
 
 // The algorithms in this implementation of the buddy system are from
@@ -11,42 +12,98 @@
 // provides a higher-level abstraction, converting byte-based sizes into the appropriate orders
 // before invoking the raw functions.
 
-// Returns the smallest power of two greater than or equal to the given number.
-static inline sz min_power_of_two_geq(sz n)
+// Returns the length corresponding to a given order as a power of two.
+static inline sz length_of_order(sz ord)
 {
-    if (n == 0)
-        return 1;
-    if ((n & (n - 1)) == 0)
-        return n; // Already a power of two
-    for (sz shift = 1; shift < sizeof(n) * BYTE_WIDTH; shift <<= 1)
-        n |= n >> shift;
-    return n + 1;
+    assert(ord < SZ_WIDTH);
+    return ((sz)1LL) << ord;
 }
 
-// Returns the largest power of two less than or equal to the given number.
-static inline sz max_power_of_two_leq(sz n)
+// Each order has its own bitmap with one bit per block of that order. A bit is set if the block is free _as a block
+// of this order_. This way, marking a block as (not) available and checking if a buddy can be merged are both a
+// single bit operation, no matter how big the block is.
+
+static inline sz bitmap_idx(struct buddy *buddy, void *addr, sz ord)
 {
-    assert(n > 0); // There is no power of two below  or equal to 0.
-    if ((n & (n - 1)) == 0)
-        return n; // Already a power of two
-    return min_power_of_two_geq(n) / 2;
+    assert(buddy);
+    assert(0 <= ord && ord <= buddy->max_ord);
+    sz page_idx = ((byte *)addr - buddy->base) / PAGE_SIZE;
+    assert(0 <= page_idx && page_idx < buddy->n_pages);
+    return page_idx >> ord;
 }
 
-// Returns the base-two exponent (order) of a given power-of-two length.
-static inline sz order_of(sz len)
+static inline void set_avail(struct buddy *buddy, void *addr, sz ord)
 {
-    assert(len > 0 && (len & (len - 1)) == 0);
-    int ord = 0;
-    while (len >>= 1)
-        ord++;
-    return ord;
+    sz idx = bitmap_idx(buddy, addr, ord);
+    buddy->bitmaps[ord][idx / U64_WIDTH] |= BIT(idx % U64_WIDTH);
 }
 
-// Returns the length corresponding to a given order as a power of two.
-static inline sz length_of_order(sz ord)
+static inline void set_not_avail(struct buddy *buddy, void *addr, sz ord)
 {
-    assert(ord < SZ_WIDTH);
-    return ((sz)1LL) << ord;
+    sz idx = bitmap_idx(buddy, addr, ord);
+    buddy->bitmaps[ord][idx / U64_WIDTH] &= ~BIT(idx % U64_WIDTH);
+}
+
+static inline bool is_avail(struct buddy *buddy, void *addr, sz ord)
+{
+    sz idx = bitmap_idx(buddy, addr, ord);
+    return (buddy->bitmaps[ord][idx / U64_WIDTH] & BIT(idx % U64_WIDTH)) != 0;
+}
+
+// The free lists are only modified through these two functions so that `nonempty_mask` always has the bits
+// of the non-empty free lists set.
+
+static inline void free_list_insert(struct buddy *buddy, struct block *block, sz ord)
+{
+    block->ord = ord;
+    set_avail(buddy, block, ord);
+    dlist_insert(&buddy->avail[ord].link, &block->link);
+    buddy->nonempty_mask |= BIT(ord);
+    buddy->n_free_blocks[ord]++;
+    buddy->n_free_pages += length_of_order(ord);
+}
+
+static inline void free_list_remove(struct buddy *buddy, struct block *block, sz ord)
+{
+    set_not_avail(buddy, block, ord);
+    dlist_remove(&block->link);
+    if (dlist_is_empty(&buddy->avail[ord].link))
+        buddy->nonempty_mask &= ~BIT(ord);
+    buddy->n_free_blocks[ord]--;
+    buddy->n_free_pages -= length_of_order(ord);
+}
+
+// The memory that the buddy allocator manages doesn't need to have a power-of-two length. Like an allocation
+// trimmed by `buddy_alloc`, it's made up of one top-level block for every bit that's set in the number of pages,
+// largest first. The buddy of a block at the end of the memory may thus lie (partially) outside the memory.
+static inline bool block_in_range(struct buddy *buddy, struct block *block, sz ord)
+{
+    sz page_idx = ((byte *)block - buddy->base) / PAGE_SIZE;
+    return page_idx <= buddy->n_pages - length_of_order(ord);
+}
+
+// Returns the number of 64-bit words in the free bitmap of order `ord`.
+static inline sz bitmap_n_words(sz n_pages, sz ord)
+{
+    sz n_blocks = n_pages >> ord;
+    return MAX(1, ALIGN_UP(n_blocks, U64_WIDTH) / U64_WIDTH);
+}
+
+// Returns the number of 64-bit words in the free bitmaps of all orders together.
+static inline sz bitmap_total_n_words(sz n_pages)
+{
+    sz n_words = 0;
+    for (sz ord = 0; ord <= LOG2_FLOOR(n_pages); ord++)
+        n_words += bitmap_n_words(n_pages, ord);
+    return n_words;
+}
+
+sz buddy_init_arena_size(sz len)
+{
+    assert(len >= PAGE_SIZE);
+    // Leave room for aligning both allocations.
+    return sizeof(struct buddy) + alignof(struct buddy) + bitmap_total_n_words(len / PAGE_SIZE) * sizeof(u64) +
+           alignof(u64);
 }
 
 struct buddy *buddy_init(struct byte_array ba, struct arena *arn)
@@ -56,54 +113,42 @@ struct buddy *buddy_init(struct byte_array ba, struct arena *arn)
     assert(arn);
 
     sz padding = -(uptr)ba.dat & (PAGE_SIZE - 1);
-    sz avail = ba.len - padding;
-    assert(avail > 0);
-    // The maximum length that we can use is the biggest power of two that's not greater than `avail`.
-    sz n_pages = max_power_of_two_leq(avail) / PAGE_SIZE;
+    assert(ba.len - padding >= PAGE_SIZE);
+    sz n_pages = (ba.len - padding) / PAGE_SIZE;
     byte *base = ba.dat + padding;
-    sz bitmap_len = ((n_pages + BYTE_WIDTH) - 1) / BYTE_WIDTH;
 
     struct buddy *buddy = arena_alloc(arn, sizeof(*buddy));
-    buddy->bitmap = byte_array_from_arena(bitmap_len, arn);
 
-    for (sz i = 0; i < N_FREE_LISTS; i++)
-        dlist_init_empty(&buddy->avail[i].link);
-
-    buddy->max_ord = order_of(n_pages);
+    buddy->max_ord = LOG2_FLOOR(n_pages);
+    buddy->n_pages = n_pages;
     buddy->base = base;
-
-    struct block *block = (struct block *)base;
-    block->ord = buddy->max_ord;
     assert(buddy->max_ord < N_FREE_LISTS);
-    dlist_insert(&buddy->avail[buddy->max_ord].link, &block->link);
 
-    print_dbg(PDBG, STR("Initialized buddy: base=0x%lx max_ord=%ld\n"), buddy->base, buddy->max_ord);
-    return buddy;
-}
-
-static void set_bitmap(struct buddy *buddy, void *addr, sz ord, byte value)
-{
-    assert(buddy);
-    assert(ord >= 0);
-
-    sz bit_idx = ((byte *)addr - buddy->base) / PAGE_SIZE;
-    sz bit_end = bit_idx + length_of_order(ord);
-    assert(buddy->bitmap.len <= SZ_MAX / BYTE_WIDTH);
-    assert(bit_end <= buddy->bitmap.len * BYTE_WIDTH);
-    for (; bit_idx < bit_end; bit_idx++) {
-        buddy->bitmap.dat[bit_idx / BYTE_WIDTH] &= ~(1 << (bit_idx % BYTE_WIDTH));
-        buddy->bitmap.dat[bit_idx / BYTE_WIDTH] |= value << (bit_idx % BYTE_WIDTH);
+    // There is one bitmap per order. The bitmaps of all orders are stored back to back in the same allocation.
+    u64 *words = arena_alloc_array(arn, bitmap_total_n_words(n_pages), sizeof(*words));
+    assert(words);
+
+    for (sz ord = 0; ord < N_FREE_LISTS; ord++) {
+        dlist_init_empty(&buddy->avail[ord].link);
+        if (ord <= buddy->max_ord) {
+            buddy->bitmaps[ord] = words;
+            words += bitmap_n_words(n_pages, ord);
+        } else {
+            buddy->bitmaps[ord] = NULL;
+        }
     }
-}
 
-static inline void set_avail(struct buddy *buddy, void *addr, sz ord)
-{
-    set_bitmap(buddy, addr, ord, 1);
-}
+    buddy->nonempty_mask = 0;
+    sz i = 0;
+    while (i < n_pages) {
+        sz ord = LOG2_FLOOR(n_pages - i);
+        free_list_insert(buddy, (struct block *)(base + i * PAGE_SIZE), ord);
+        i += length_of_order(ord);
+    }
 
-static inline void set_not_avail(struct buddy *buddy, void *addr, sz ord)
-{
-    set_bitmap(buddy, addr, ord, 0);
+    print_dbg(PDBG, STR("Initialized buddy: base=0x%lx n_pages=%ld max_ord=%ld\n"), buddy->base, buddy->n_pages,
+              buddy->max_ord);
+    return buddy;
 }
 
 static inline struct block *split_block(struct block *block, sz ord)
@@ -122,21 +167,18 @@ static void *buddy_alloc_raw(struct buddy *buddy, sz req_ord)
 {
     assert(req_ord >= 0);
 
-    sz ord = req_ord;
-    while (ord <= buddy->max_ord) {
-        if (!dlist_is_empty(&buddy->avail[ord].link))
-            break;
-        ord++;
-    }
-
-    if (ord > buddy->max_ord) {
+    // The lowest set bit at or above `req_ord` in the mask of non-empty free lists is the smallest order that
+    // has a free block big enough.
+    u64 candidates = req_ord < U64_WIDTH ? buddy->nonempty_mask & ~(BIT(req_ord) - 1) : 0;
+    if (!candidates) {
         print_dbg(PVERBOSE, STR("No block found, all blocks too small: ord=%ld\n"), req_ord);
         return NULL;
     }
+    sz ord = CTZ(candidates);
+    assert(ord <= buddy->max_ord);
 
     struct block *ret = __container_of(buddy->avail[ord].link.next, struct block, link);
-    set_not_avail(buddy, ret, ord);
-    dlist_remove(buddy->avail[ord].link.next);
+    free_list_remove(buddy, ret, ord);
 
     if (ord == req_ord) {
         print_dbg(PVERBOSE, STR("Found perfect fit: ret=0x%lx ord=%ld\n"), ret, ord);
@@ -147,9 +189,7 @@ static void *buddy_alloc_raw(struct buddy *buddy, sz req_ord)
     while (ord > req_ord) {
         ord -= 1;
         struct block *rem = split_block(ret, ord);
-        set_avail(buddy, rem, ord);
-        rem->ord = ord;
-        dlist_insert(&buddy->avail[ord].link, &rem->link);
+        free_list_insert(buddy, rem, ord);
         print_dbg(PVERBOSE, STR("Split blocks: ret=0x%lx rem=0x%lx ord=%ld\n"), ret, rem, ord);
     }
 
@@ -159,28 +199,14 @@ static void *buddy_alloc_raw(struct buddy *buddy, sz req_ord)
 
 static inline struct block *get_buddy(struct buddy *buddy, struct block *block, sz ord)
 {
-    ptr base_offset = (ptr)block - (ptr)buddy->base;
-    assert(length_of_order(ord + 1) <= SZ_MAX / PAGE_SIZE);
-    sz mod = length_of_order(ord + 1) * PAGE_SIZE;
+    // Blocks are aligned to their size relative to the base, so a block and its buddy only differ in the bit that
+    // corresponds to their size.
     assert(length_of_order(ord) <= SZ_MAX / PAGE_SIZE);
-    sz halfway_offset = length_of_order(ord) * PAGE_SIZE;
-    if (base_offset % mod == 0) {
-        return (struct block *)((ptr)block + halfway_offset);
-    } else if (base_offset % mod == halfway_offset) {
-        return (struct block *)((ptr)block - halfway_offset);
-    } else {
+    sz len = length_of_order(ord) * PAGE_SIZE;
+    ptr base_offset = (ptr)block - (ptr)buddy->base;
+    if (!IS_ALIGNED(base_offset, len))
         crash("Invalid block pointer\n");
-    }
-}
-
-static inline bool is_avail(struct buddy *buddy, void *addr)
-{
-    assert(buddy);
-    sz bit_idx = ((ptr)addr - (ptr)buddy->base) / PAGE_SIZE;
-    sz byte_idx = bit_idx / BYTE_WIDTH;
-    assert(0 <= bit_idx);
-    assert(0 <= byte_idx && byte_idx < buddy->bitmap.len);
-    return (buddy->bitmap.dat[byte_idx] & (1 << (bit_idx % BYTE_WIDTH))) != 0;
+    return (struct block *)((ptr)buddy->base + (base_offset ^ len));
 }
 
 static void buddy_free_raw(struct buddy *buddy, void *ptr, sz ord)
@@ -194,47 +220,152 @@ static void buddy_free_raw(struct buddy *buddy, void *ptr, sz ord)
 
     print_dbg(PVERBOSE, STR("Freeing block: block=0x%lx ord=%ld\n"), block, ord);
 
-    while (ord < buddy->max_ord && is_avail(buddy, buddy_block)) {
+    while (ord < buddy->max_ord && block_in_range(buddy, buddy_block, ord) && is_avail(buddy, buddy_block, ord)) {
         print_dbg(PVERBOSE, STR("Coalescing blocks: block=0x%lx buddy_block=0x%lx ord=%ld\n"), block, buddy_block, ord);
-        dlist_remove(&buddy_block->link);
+        free_list_remove(buddy, buddy_block, ord);
         ord++;
         if (buddy_block < block)
             block = buddy_block;
         buddy_block = get_buddy(buddy, block, ord);
     }
 
-    set_avail(buddy, block, ord);
-    dlist_insert(&buddy->avail[ord].link, &block->link);
+    free_list_insert(buddy, block, ord);
 }
 
-struct option_byte_array buddy_alloc(struct buddy *buddy, sz size)
+// Allocations made through `buddy_alloc` aren't rounded up to a power of two. Instead, the request is served from
+// the smallest block that's big enough and the pages after the end of the allocation are given back right away
+// ("trimming"). Hence, no more than the rest of the last page is wasted.
+//
+// The pages that remain allocated are made up of one block for each bit that's set in the number of pages. These
+// blocks are ordered from largest to smallest, which means that every one of them is aligned to its size relative to
+// the start of the allocation. The same holds for the blocks that make up the trimmed tail, only there the blocks
+// are ordered from smallest to largest. This is how `buddy_free` can later find the blocks it needs to free from
+// the length of the allocation alone.
+
+static inline sz n_pages_of_size(sz size)
+{
+    assert(size > 0);
+    assert(size <= SZ_MAX - PAGE_SIZE);
+    return ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+}
+
+struct option_byte_array buddy_alloc_aligned(struct buddy *buddy, sz size, sz align)
 {
     assert(buddy);
     assert(size > 0);
-    // `order_of` expects the argument it gets to be greater than 0. We need to round
-    // up to `PAGE_SIZE` so `order_of` isn't passed 0 if `size` is below `PAGE_SIZE`.
-    sz real_size = ALIGN_UP(size, PAGE_SIZE);
-    // The buddy system can only allocate memory in power-of-two-sized blocks
-    // so we need to round up to the nearest power of two to satisfy the request.
-    // Because this implementation deals in pages as the smallest unit, we need
-    // to divide by the page size to arrive at the number of blocks that are needed.
-    sz ord = order_of(min_power_of_two_geq(real_size) / PAGE_SIZE);
-    void *mem = buddy_alloc_raw(buddy, ord);
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    // The buddy system can only allocate memory in power-of-two-sized blocks so we need to
+    // get a block that's at least as big as the next power of two above the number of pages.
+    // `LOG2_CEIL` expects its argument to be greater than 0, which `n_pages` always is.
+    // Blocks are aligned to their size, so a block that's at least as big as `align` is aligned, too.
+    sz n_pages = n_pages_of_size(size);
+    sz ord = LOG2_CEIL(MAX(n_pages, n_pages_of_size(align)));
+    byte *mem = buddy_alloc_raw(buddy, ord);
     if (!mem)
         return option_byte_array_none();
+
+    // The block that starts at page `i` in the tail can be as big as the alignment of `i` permits. It never
+    // reaches beyond the end of the original block because that block's length is a multiple of this alignment.
+    for (sz i = n_pages; i < length_of_order(ord); i += length_of_order(CTZ(i)))
+        buddy_free_raw(buddy, mem + i * PAGE_SIZE, CTZ(i));
+
+    buddy->n_pages_high_water = MAX(buddy->n_pages_high_water, buddy->n_pages - buddy->n_free_pages);
+
     return option_byte_array_ok(byte_array_new(mem, size));
 }
 
+struct option_byte_array buddy_alloc(struct buddy *buddy, sz size)
+{
+    return buddy_alloc_aligned(buddy, size, PAGE_SIZE);
+}
+
 void buddy_free(struct buddy *buddy, struct byte_array ba)
 {
     assert(buddy);
     assert(ba.len > 0);
     assert(ba.dat);
 
-    // See `buddy_alloc` for comments.
-    sz real_size = ALIGN_UP(ba.len, PAGE_SIZE);
-    sz ord = order_of(min_power_of_two_geq(real_size) / PAGE_SIZE);
-    buddy_free_raw(buddy, ba.dat, ord);
+    // See the comment above `buddy_alloc` for how allocations are split into blocks.
+    sz n_pages = n_pages_of_size(ba.len);
+    sz i = 0;
+    while (i < n_pages) {
+        sz ord = LOG2_FLOOR(n_pages - i);
+        buddy_free_raw(buddy, ba.dat + i * PAGE_SIZE, ord);
+        i += length_of_order(ord);
+    }
+}
+
+sz buddy_fragmentation(struct buddy *buddy)
+{
+    assert(buddy);
+
+    if (!buddy->n_free_pages)
+        return 0;
+
+    sz largest = length_of_order(LOG2_FLOOR(buddy->nonempty_mask));
+    return 1000 - (1000 * largest) / buddy->n_free_pages;
+}
+
+void buddy_print_stats(struct buddy *buddy)
+{
+    assert(buddy);
+
+    char underlying[256];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    print_fmt(buf, STR("buddy 0x%lx: %ld/%ld pages in use (peak %ld), fragmentation %ld permille\n"), buddy->base,
+              buddy->n_pages - buddy->n_free_pages, buddy->n_pages, buddy->n_pages_high_water,
+              buddy_fragmentation(buddy));
+    for (sz ord = 0; ord <= buddy->max_ord; ord++) {
+        if (buddy->n_free_blocks[ord])
+            print_fmt(buf, STR("  order %ld: %ld free blocks\n"), ord, buddy->n_free_blocks[ord]);
+    }
+}
+
+void buddy_check(struct buddy *buddy)
+{
+    assert(buddy);
+
+    sz n_free_pages = 0;
+
+    for (sz ord = 0; ord < N_FREE_LISTS; ord++) {
+        sz n_blocks = 0;
+        struct dlist *head = &buddy->avail[ord].link;
+
+        for (struct dlist *link = head->next; link != head; link = link->next) {
+            struct block *block = __container_of(link, struct block, link);
+            assert(ord <= buddy->max_ord);
+            assert(block->ord == ord);
+            assert(IS_ALIGNED((byte *)block - buddy->base, length_of_order(ord) * PAGE_SIZE));
+            assert(block_in_range(buddy, block, ord));
+            assert(is_avail(buddy, block, ord));
+
+            // Free buddies are always merged, except at the maximum order where there is nothing to merge with.
+            struct block *buddy_block = get_buddy(buddy, block, ord);
+            if (ord < buddy->max_ord && block_in_range(buddy, buddy_block, ord))
+                assert(!is_avail(buddy, buddy_block, ord));
+
+            n_blocks++;
+        }
+
+        assert(n_blocks == buddy->n_free_blocks[ord]);
+        assert(!!(buddy->nonempty_mask & BIT(ord)) == (n_blocks > 0));
+        n_free_pages += n_blocks * length_of_order(ord);
+
+        // Every bit that's set in the bitmap belongs to a block on the free list.
+        if (ord <= buddy->max_ord) {
+            sz n_bits = 0;
+            for (sz i = 0; i < bitmap_n_words(buddy->n_pages, ord); i++) {
+                for (u64 word = buddy->bitmaps[ord][i]; word; word &= word - 1)
+                    n_bits++;
+            }
+            assert(n_bits == n_blocks);
+        }
+    }
+
+    assert(n_free_pages == buddy->n_free_pages);
+    assert(n_free_pages <= buddy->n_pages);
 }
 
 void *buddy_alloc_wrapper(void *a, sz size, sz align __unused)
@@ -249,3 +380,150 @@ void buddy_free_wrapper(void *a, void *ptr, sz size)
 {
     buddy_free((struct buddy *)a, byte_array_new(ptr, size));
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+#define BUDDY_TEST_SIZE BIT(20) /* 1MiB */
+
+static void test_trimmed_alloc(struct arena arn)
+{
+    void *mem = arena_alloc_aligned(&arn, BUDDY_TEST_SIZE, PAGE_SIZE);
+    struct buddy *buddy = buddy_init(byte_array_new(mem, BUDDY_TEST_SIZE), &arn);
+    sz total_pages = length_of_order(buddy->max_ord);
+    assert(total_pages * PAGE_SIZE == BUDDY_TEST_SIZE);
+
+    // Three pages come out of a four-page block. The fourth page must be available again right away.
+    struct byte_array three = option_byte_array_checked(buddy_alloc(buddy, 3 * PAGE_SIZE - 10));
+    assert(three.len == 3 * PAGE_SIZE - 10);
+    struct byte_array one = option_byte_array_checked(buddy_alloc(buddy, PAGE_SIZE));
+    assert(one.dat == three.dat + 3 * PAGE_SIZE);
+
+    // Slightly more than a quarter of the memory takes up the upper half, minus the trimmed tail.
+    sz big_size = (total_pages / 4 + 1) * PAGE_SIZE;
+    struct byte_array big = option_byte_array_checked(buddy_alloc(buddy, big_size));
+    assert(big.dat == buddy->base + BUDDY_TEST_SIZE / 2);
+    byte_array_set(big, 0xab);
+
+    // Every page that isn't part of an allocation must be available.
+    sz n_free_pages = total_pages - 4 - big_size / PAGE_SIZE;
+    byte **pages = arena_alloc_array(&arn, n_free_pages, sizeof(*pages));
+    for (sz i = 0; i < n_free_pages; i++)
+        pages[i] = byte_array_ptr(option_byte_array_checked(buddy_alloc(buddy, PAGE_SIZE)));
+    assert(buddy_alloc(buddy, PAGE_SIZE).is_none);
+
+    // Freeing the trimmed allocations must restore the blocks they were made from.
+    for (sz i = 0; i < n_free_pages; i++)
+        buddy_free(buddy, byte_array_new(pages[i], PAGE_SIZE));
+    buddy_free(buddy, big);
+    buddy_free(buddy, one);
+    buddy_free(buddy, three);
+    buddy_check(buddy);
+    assert(!buddy_alloc(buddy, BUDDY_TEST_SIZE).is_none);
+}
+
+// The memory is made up of blocks of 8, 4, and 1 pages.
+static void test_uneven_region(struct arena arn)
+{
+    sz n_pages = 13;
+    void *mem = arena_alloc_aligned(&arn, n_pages * PAGE_SIZE, PAGE_SIZE);
+    struct buddy *buddy = buddy_init(byte_array_new(mem, n_pages * PAGE_SIZE), &arn);
+    assert(buddy->n_pages == n_pages);
+    assert(buddy->max_ord == 3);
+
+    // Every page can be allocated.
+    byte *pages[13];
+    for (sz i = 0; i < n_pages; i++) {
+        pages[i] = byte_array_ptr(option_byte_array_checked(buddy_alloc(buddy, PAGE_SIZE)));
+        assert(IN_RANGE(pages[i], (byte *)mem, n_pages * PAGE_SIZE));
+    }
+    assert(buddy_alloc(buddy, PAGE_SIZE).is_none);
+
+    // Blocks at the end of the memory are never merged with the non-existent memory beyond it.
+    for (sz i = 0; i < n_pages; i++)
+        buddy_free(buddy, byte_array_new(pages[i], PAGE_SIZE));
+    buddy_check(buddy);
+    struct byte_array eight = option_byte_array_checked(buddy_alloc(buddy, 8 * PAGE_SIZE));
+    struct byte_array four = option_byte_array_checked(buddy_alloc(buddy, 4 * PAGE_SIZE));
+    struct byte_array one = option_byte_array_checked(buddy_alloc(buddy, PAGE_SIZE));
+    assert(buddy_alloc(buddy, PAGE_SIZE).is_none);
+    assert(eight.dat == mem && four.dat == eight.dat + 8 * PAGE_SIZE && one.dat == four.dat + 4 * PAGE_SIZE);
+}
+
+static void test_aligned_alloc(struct arena arn)
+{
+    sz n_pages = 64;
+    void *mem = arena_alloc_aligned(&arn, n_pages * PAGE_SIZE, PAGE_SIZE);
+    struct buddy *buddy = buddy_init(byte_array_new(mem, n_pages * PAGE_SIZE), &arn);
+
+    // Take the first page so that the next allocation isn't aligned by chance.
+    struct byte_array first = option_byte_array_checked(buddy_alloc(buddy, PAGE_SIZE));
+    struct byte_array aligned = option_byte_array_checked(buddy_alloc_aligned(buddy, PAGE_SIZE, 16 * PAGE_SIZE));
+    assert(IS_ALIGNED(aligned.dat - buddy->base, 16 * PAGE_SIZE));
+    assert(aligned.dat != first.dat);
+
+    // Everything merges again after freeing the aligned allocation like any other.
+    buddy_free(buddy, first);
+    buddy_free(buddy, aligned);
+    struct byte_array all = option_byte_array_checked(buddy_alloc(buddy, n_pages * PAGE_SIZE));
+    assert(all.dat == mem);
+}
+
+void buddy_run_tests(struct arena arn)
+{
+    test_trimmed_alloc(arn);
+    test_uneven_region(arn);
+    test_aligned_alloc(arn);
+    print_dbg(PINFO, STR("Buddy selftest passed\n"));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+#define BUDDY_BENCH_SIZE BIT(23) /* 8MiB */
+#define BUDDY_BENCH_N_ITERS 10000
+
+// Allocating and immediately freeing a block splits and merges all blocks between `ord` and the maximum order.
+static void bench_alloc_free_pairs(struct buddy *buddy, sz ord, struct str name)
+{
+    u64 start = rdtsc();
+    for (sz i = 0; i < BUDDY_BENCH_N_ITERS; i++) {
+        void *mem = buddy_alloc_raw(buddy, ord);
+        assert(mem);
+        buddy_free_raw(buddy, mem, ord);
+    }
+    bench_report(name, start, BUDDY_BENCH_N_ITERS);
+}
+
+// Allocate every page individually and then free all of them again.
+static void bench_fill_and_drain(struct buddy *buddy, struct arena arn)
+{
+    sz n_pages = length_of_order(buddy->max_ord);
+    void **pages = arena_alloc_array(&arn, n_pages, sizeof(*pages));
+
+    u64 start = rdtsc();
+    for (sz i = 0; i < n_pages; i++) {
+        pages[i] = buddy_alloc_raw(buddy, 0);
+        assert(pages[i]);
+    }
+    bench_report(STR("buddy fill (order 0)"), start, n_pages);
+
+    start = rdtsc();
+    for (sz i = 0; i < n_pages; i++)
+        buddy_free_raw(buddy, pages[i], 0);
+    bench_report(STR("buddy drain (order 0)"), start, n_pages);
+}
+
+void buddy_run_benchmarks(struct arena arn)
+{
+    void *mem = arena_alloc_aligned(&arn, BUDDY_BENCH_SIZE, PAGE_SIZE);
+    struct buddy *buddy = buddy_init(byte_array_new(mem, BUDDY_BENCH_SIZE), &arn);
+    assert(length_of_order(buddy->max_ord) * PAGE_SIZE == BUDDY_BENCH_SIZE);
+
+    bench_alloc_free_pairs(buddy, 0, STR("buddy alloc/free pair (order 0)"));
+    bench_alloc_free_pairs(buddy, 4, STR("buddy alloc/free pair (order 4)"));
+    bench_alloc_free_pairs(buddy, buddy->max_ord, STR("buddy alloc/free pair (max order)"));
+    bench_fill_and_drain(buddy, arn);
+}
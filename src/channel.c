@@ -0,0 +1,180 @@
+#include <tx/assert.h>
+#include <tx/channel.h>
+#include <tx/print.h>
+
+// Both sides are protected by the same lock. A sender that fills the last free slot wakes up the receivers and a
+// receiver that takes an element wakes up the senders. Because `wake_up` makes all waiting tasks ready, a task that's
+// woken up doesn't necessarily get the element or slot. The blocking functions simply try again in that case.
+
+void channel_init(struct channel *ch, struct byte_array buf, sz elem_size)
+{
+    assert(ch);
+    assert(buf.dat);
+    assert(elem_size > 0);
+    assert(buf.len >= elem_size);
+
+    ch->buf = buf;
+    ch->elem_size = elem_size;
+    ch->cap = buf.len / elem_size;
+    ch->head = 0;
+    ch->len = 0;
+    spin_lock_init(&ch->lock);
+    wait_queue_init(&ch->senders);
+    wait_queue_init(&ch->receivers);
+}
+
+static byte *channel_slot(struct channel *ch, sz idx)
+{
+    return ch->buf.dat + ((ch->head + idx) % ch->cap) * ch->elem_size;
+}
+
+struct result channel_try_send(struct channel *ch, const void *elem)
+{
+    assert(ch);
+    assert(elem);
+
+    u64 flags = spin_lock_irqsave(&ch->lock);
+    if (ch->len == ch->cap) {
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return result_error(EAGAIN);
+    }
+    byte_copy(channel_slot(ch, ch->len), DECONST(byte *, elem), ch->elem_size);
+    ch->len++;
+    spin_unlock_irqrestore(&ch->lock, flags);
+
+    wake_up(&ch->receivers);
+    return result_ok();
+}
+
+struct result channel_try_recv(struct channel *ch, void *elem)
+{
+    assert(ch);
+    assert(elem);
+
+    u64 flags = spin_lock_irqsave(&ch->lock);
+    if (ch->len == 0) {
+        spin_unlock_irqrestore(&ch->lock, flags);
+        return result_error(EAGAIN);
+    }
+    byte_copy(elem, channel_slot(ch, 0), ch->elem_size);
+    ch->head = (ch->head + 1) % ch->cap;
+    ch->len--;
+    spin_unlock_irqrestore(&ch->lock, flags);
+
+    wake_up(&ch->senders);
+    return result_ok();
+}
+
+struct channel_op {
+    struct channel *ch;
+    void *elem;
+};
+
+static bool channel_send_cond(void *context)
+{
+    struct channel_op *op = context;
+    return !channel_try_send(op->ch, op->elem).is_error;
+}
+
+static bool channel_recv_cond(void *context)
+{
+    struct channel_op *op = context;
+    return !channel_try_recv(op->ch, op->elem).is_error;
+}
+
+bool channel_send_timeout(struct channel *ch, const void *elem, struct time_ms timeout)
+{
+    assert(ch);
+    assert(elem);
+
+    struct channel_op op = { ch, DECONST(void *, elem) };
+    return wait_event_timeout(&ch->senders, channel_send_cond, &op, timeout);
+}
+
+bool channel_recv_timeout(struct channel *ch, void *elem, struct time_ms timeout)
+{
+    assert(ch);
+    assert(elem);
+
+    struct channel_op op = { ch, elem };
+    return wait_event_timeout(&ch->receivers, channel_recv_cond, &op, timeout);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+static void test_channel_try(void)
+{
+    u64 buf[4];
+    struct channel ch;
+    channel_init(&ch, byte_array_new((byte *)buf, sizeof(buf)), sizeof(u64));
+    assert(ch.cap == 4);
+
+    u64 val = 0;
+    assert(channel_try_recv(&ch, &val).code == EAGAIN);
+
+    for (u64 i = 0; i < 4; i++)
+        assert(!channel_try_send(&ch, &i).is_error);
+    val = 4;
+    assert(channel_try_send(&ch, &val).code == EAGAIN);
+
+    // Take two elements out and put two more in so that the ring wraps around.
+    for (u64 i = 0; i < 2; i++) {
+        assert(!channel_try_recv(&ch, &val).is_error);
+        assert(val == i);
+    }
+    for (u64 i = 4; i < 6; i++)
+        assert(!channel_try_send(&ch, &i).is_error);
+
+    for (u64 i = 2; i < 6; i++) {
+        assert(!channel_try_recv(&ch, &val).is_error);
+        assert(val == i);
+    }
+    assert(channel_try_recv(&ch, &val).code == EAGAIN);
+
+    assert(!channel_recv_timeout(&ch, &val, time_ms_new(10)));
+}
+
+#define CHANNEL_TEST_N_ELEMS 1000
+
+struct channel_test_ctx {
+    struct channel *ch;
+    bool is_done;
+};
+
+static void channel_test_producer(void *context)
+{
+    struct channel_test_ctx *ctx = context;
+    for (u64 i = 0; i < CHANNEL_TEST_N_ELEMS; i++)
+        channel_send(ctx->ch, &i);
+    ctx->is_done = true;
+}
+
+static void test_channel_blocking(void)
+{
+    // The channel is much smaller than the number of elements, so the producer and the consumer both block.
+    u64 buf[2];
+    struct channel ch;
+    channel_init(&ch, byte_array_new((byte *)buf, sizeof(buf)), sizeof(u64));
+
+    struct channel_test_ctx ctx = { &ch, false };
+    assert(!sched_create_task(channel_test_producer, &ctx).is_error);
+
+    for (u64 i = 0; i < CHANNEL_TEST_N_ELEMS; i++) {
+        u64 val = 0;
+        channel_recv(&ch, &val);
+        assert(val == i);
+    }
+
+    // The producer still uses the channel after it sent the last element.
+    while (!ctx.is_done)
+        sched_yield();
+}
+
+void channel_run_tests(void)
+{
+    test_channel_try();
+    test_channel_blocking();
+    print_dbg(PINFO, STR("Channel selftest passed\n"));
+}
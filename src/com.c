@@ -90,3 +90,19 @@ struct result com_read(u16 port, struct str_buf *buf)
     buf->len = len;
     return result_ok();
 }
+
+struct result com_try_read(u16 port, struct str_buf *buf)
+{
+    sz len = 0;
+
+    if (!buf || !buf->dat || buf->cap <= 0)
+        return result_error(EINVAL);
+
+    while (len < buf->cap && (inb(port + OFFSET_LINE_STATUS) & LINE_STATUS_RX_READY))
+        buf->dat[len++] = inb(port);
+
+    buf->len = len;
+    if (!len)
+        return result_error(EAGAIN);
+    return result_ok();
+}
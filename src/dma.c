@@ -0,0 +1,65 @@
+// Memory for DMA
+//
+// DMA buffers are allocated from kvalloc. kvalloc hands out memory from the canonical mapping of the dynamic
+// memory, where virtual and physical addresses differ by a constant offset. This is what makes the buffers
+// physically contiguous and aligned.
+
+#include <config.h>
+#include <tx/assert.h>
+#include <tx/dma.h>
+#include <tx/kvalloc.h>
+
+struct result_dma_buf dma_alloc(sz n_bytes, sz align)
+{
+    assert(n_bytes > 0);
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    struct option_byte_array mem_opt = kvalloc_alloc_zeroed(n_bytes, align);
+    if (mem_opt.is_none)
+        return result_dma_buf_error(ENOMEM);
+
+    struct dma_buf buf;
+    buf.mem = option_byte_array_checked(mem_opt);
+
+    // Demand-paged memory has no stable physical address and kvalloc doesn't return any.
+    assert(IN_RANGE((vaddr_t)buf.mem.dat, KERN_DYN_VADDR, KERN_DYN_LEN));
+    buf.paddr = result_paddr_t_checked(virt_to_phys((vaddr_t)buf.mem.dat));
+    assert(IS_ALIGNED(buf.paddr, align));
+
+    return result_dma_buf_ok(buf);
+}
+
+void dma_free(struct dma_buf buf)
+{
+    kvalloc_free(buf.mem);
+}
+
+struct result dma_pool_init(struct dma_pool *pool, sz buf_size, sz n_bufs, sz align)
+{
+    assert(pool);
+    assert(buf_size > 0);
+    assert(n_bufs > 0);
+
+    // Rounding the block size up to the alignment keeps all buffers aligned.
+    sz block_size = ALIGN_UP(pool_block_size(buf_size), align);
+    assert(n_bufs <= SZ_MAX / block_size);
+
+    struct result_dma_buf mem_res = dma_alloc(n_bufs * block_size, MAX(align, alignof(void *)));
+    if (mem_res.is_error)
+        return result_error(mem_res.code);
+
+    pool->mem = result_dma_buf_checked(mem_res);
+    pool->bufs = pool_new(pool->mem.mem, block_size);
+    pool->buf_size = buf_size;
+
+    return result_ok();
+}
+
+void dma_pool_deinit(struct dma_pool *pool)
+{
+    assert(pool);
+    assert(pool->bufs.n_in_use == 0);
+
+    dma_free(pool->mem);
+    pool->mem.mem = byte_array_new(NULL, 0);
+}
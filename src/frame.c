@@ -0,0 +1,43 @@
+// Physical page frame allocator
+
+// The frames come from kvalloc, which has a lock of its own. The counter is updated atomically.
+
+#include <config.h>
+#include <tx/assert.h>
+#include <tx/frame.h>
+#include <tx/kvalloc.h>
+
+static sz global_frames_n_in_use = 0;
+
+struct result_paddr_t frame_alloc(void)
+{
+    // kvalloc hands out page-aligned memory for allocations of one page. Because this memory is in the canonical
+    // mapping of the dynamic memory, the pages are physically contiguous and aligned, too.
+    struct option_byte_array mem_opt = kvalloc_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (mem_opt.is_none)
+        return result_paddr_t_error(ENOMEM);
+
+    struct byte_array mem = option_byte_array_checked(mem_opt);
+    assert(IS_ALIGNED((vaddr_t)mem.dat, PAGE_SIZE));
+
+    __atomic_fetch_add(&global_frames_n_in_use, 1, __ATOMIC_RELAXED);
+
+    return virt_to_phys((vaddr_t)mem.dat);
+}
+
+void frame_free(paddr_t paddr)
+{
+    assert(IS_ALIGNED(paddr, PAGE_SIZE));
+    assert(__atomic_load_n(&global_frames_n_in_use, __ATOMIC_RELAXED) > 0);
+
+    vaddr_t vaddr = result_vaddr_t_checked(phys_to_virt(paddr));
+    assert(IN_RANGE(vaddr, KERN_DYN_VADDR, KERN_DYN_LEN));
+    kvalloc_free(byte_array_new((byte *)vaddr, PAGE_SIZE));
+
+    __atomic_fetch_sub(&global_frames_n_in_use, 1, __ATOMIC_RELAXED);
+}
+
+sz frame_n_in_use(void)
+{
+    return __atomic_load_n(&global_frames_n_in_use, __ATOMIC_RELAXED);
+}
@@ -1,12 +1,18 @@
 #include <tx/asm.h>
 #include <tx/assert.h>
 #include <tx/gdt.h>
+#include <tx/smp.h>
 // #include <tx/bytes.h>
 
+// Every CPU needs a TSS of its own, and `ltr` marks the TSS descriptor as busy. So each CPU also gets its own GDT.
+
 // The last _two_ entries in this array make up a single 16-byte TSS descriptor.
-static __aligned(16) struct seg_descriptor gdt[7];
+static __aligned(16) struct seg_descriptor gdt[SMP_MAX_CPUS][7];
+
+static __aligned(8) struct task_state ts[SMP_MAX_CPUS];
 
-static __aligned(8) struct task_state ts;
+// Double faults are handled on this stack (see `TSS_IST_DOUBLE_FAULT`).
+static __aligned(16) byte double_fault_stack[SMP_MAX_CPUS][0x1000];
 
 static void gdt_init_seg_descriptor(struct seg_descriptor *desc, u8 type, u8 dpl)
 {
@@ -46,28 +52,38 @@ static void gdt_init_tss_descriptor(struct task_state *ts, sz limit, struct seg_
     *((u32 *)high) = ((ptr)ts >> 32) & 0xffffffff;
 }
 
-void gdt_init(void)
+void gdt_init_cpu(sz cpu_id)
 {
+    assert(cpu_id >= 0 && cpu_id < SMP_MAX_CPUS);
+
     volatile struct seg_pseudo_descriptor_64 gdtr;
+    struct seg_descriptor *cpu_gdt = gdt[cpu_id];
+    struct task_state *cpu_ts = &ts[cpu_id];
 
-    gdt_init_seg_descriptor(&gdt[SEG_IDX_KERN_CODE], SEG_DESC_TYPE_CODE_RX, SEG_DESC_DPL_KERN);
-    gdt_init_seg_descriptor(&gdt[SEG_IDX_KERN_DATA], SEG_DESC_TYPE_DATA_RW, SEG_DESC_DPL_KERN);
-    gdt_init_seg_descriptor(&gdt[SEG_IDX_USER_CODE], SEG_DESC_TYPE_CODE_RX, SEG_DESC_DPL_USER);
-    gdt_init_seg_descriptor(&gdt[SEG_IDX_USER_DATA], SEG_DESC_TYPE_DATA_RW, SEG_DESC_DPL_USER);
-    static_assert(sizeof(ts));
+    gdt_init_seg_descriptor(&cpu_gdt[SEG_IDX_KERN_CODE], SEG_DESC_TYPE_CODE_RX, SEG_DESC_DPL_KERN);
+    gdt_init_seg_descriptor(&cpu_gdt[SEG_IDX_KERN_DATA], SEG_DESC_TYPE_DATA_RW, SEG_DESC_DPL_KERN);
+    gdt_init_seg_descriptor(&cpu_gdt[SEG_IDX_USER_CODE], SEG_DESC_TYPE_CODE_RX, SEG_DESC_DPL_USER);
+    gdt_init_seg_descriptor(&cpu_gdt[SEG_IDX_USER_DATA], SEG_DESC_TYPE_DATA_RW, SEG_DESC_DPL_USER);
+    static_assert(sizeof(ts[0]));
 
-    ts.io_map_base = 0xffff;
-    gdt_init_tss_descriptor(&ts, sizeof(ts) - 1, &gdt[SEG_IDX_TSS], &gdt[SEG_IDX_TSS + 1]);
+    cpu_ts->io_map_base = 0xffff;
+    cpu_ts->ist1 = (u64)(double_fault_stack[cpu_id] + sizeof(double_fault_stack[cpu_id]));
+    gdt_init_tss_descriptor(cpu_ts, sizeof(*cpu_ts) - 1, &cpu_gdt[SEG_IDX_TSS], &cpu_gdt[SEG_IDX_TSS + 1]);
 
-    static_assert(sizeof(gdt));
-    gdtr.limit = sizeof(gdt) - 1;
-    gdtr.base = (u64)&gdt[0];
+    static_assert(sizeof(gdt[0]));
+    gdtr.limit = sizeof(gdt[0]) - 1;
+    gdtr.base = (u64)cpu_gdt;
     lgdt(&gdtr);
 
     ltr(segment_selector(SEG_IDX_TSS, SEG_DESC_DPL_KERN));
 }
 
+void gdt_init(void)
+{
+    gdt_init_cpu(0);
+}
+
 struct task_state *tss_get_global(void)
 {
-    return &ts;
+    return &ts[0];
 }
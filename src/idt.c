@@ -34,6 +34,9 @@ static_assert(sizeof(struct idtr) == 10);
 
 __aligned(16) static struct idt_entry idt[NUM_IDT_ENTRIES];
 
+// All CPUs share the same IDT.
+static struct idtr global_idtr;
+
 void init_idt_entry(struct idt_entry *ent, ptr handler, u8 attributes)
 {
     ent->offset1 = (u16)(handler & 0xffff);
@@ -48,9 +51,8 @@ void init_idt_entry(struct idt_entry *ent, ptr handler, u8 attributes)
 
 void init_idt(void)
 {
-    struct idtr idtr;
-    idtr.limit = sizeof(struct idt_entry) * NUM_IDT_ENTRIES - 1;
-    idtr.base = (u64)idt;
+    global_idtr.limit = sizeof(struct idt_entry) * NUM_IDT_ENTRIES - 1;
+    global_idtr.base = (u64)idt;
 
     init_idt_entry(&idt[0], (ptr)isr_stub_0, ATTR_INTERRUPT_GATE);
     init_idt_entry(&idt[1], (ptr)isr_stub_1, ATTR_INTERRUPT_GATE);
@@ -74,6 +76,7 @@ void init_idt(void)
     init_idt_entry(&idt[19], (ptr)isr_stub_19, ATTR_INTERRUPT_GATE);
     init_idt_entry(&idt[20], (ptr)isr_stub_20, ATTR_INTERRUPT_GATE);
     init_idt_entry(&idt[21], (ptr)isr_stub_21, ATTR_INTERRUPT_GATE);
+    idt[8].ist = TSS_IST_DOUBLE_FAULT;
 
     init_idt_entry(&idt[32], (ptr)isr_stub_32, ATTR_INTERRUPT_GATE);
     init_idt_entry(&idt[33], (ptr)isr_stub_33, ATTR_INTERRUPT_GATE);
@@ -92,7 +95,12 @@ void init_idt(void)
     init_idt_entry(&idt[46], (ptr)isr_stub_46, ATTR_INTERRUPT_GATE);
     init_idt_entry(&idt[47], (ptr)isr_stub_47, ATTR_INTERRUPT_GATE);
 
-    __asm__ volatile("lidt %0" : : "m"(idtr));
+    init_idt_entry(&idt[VECTOR_LAPIC_TIMER], (ptr)isr_stub_48, ATTR_INTERRUPT_GATE);
+    init_idt_entry(&idt[VECTOR_IPI_RESCHED], (ptr)isr_stub_49, ATTR_INTERRUPT_GATE);
+    init_idt_entry(&idt[VECTOR_IPI_TLB_FLUSH], (ptr)isr_stub_50, ATTR_INTERRUPT_GATE);
+    init_idt_entry(&idt[VECTOR_LAPIC_SPURIOUS], (ptr)isr_stub_63, ATTR_INTERRUPT_GATE);
+
+    __asm__ volatile("lidt %0" : : "m"(global_idtr));
 }
 
 void interrupt_init(void)
@@ -102,3 +110,8 @@ void interrupt_init(void)
     init_idt();
     enable_interrupts();
 }
+
+void interrupt_init_cpu(void)
+{
+    __asm__ volatile("lidt %0" : : "m"(global_idtr));
+}
@@ -1,10 +1,13 @@
 #include <config.h>
+#include <tx/alloc_stats.h>
 #include <tx/archive.h>
 #include <tx/arena.h>
 #include <tx/assert.h>
 #include <tx/base.h>
+#include <tx/bench.h>
 #include <tx/buddy.h>
 #include <tx/byte.h>
+#include <tx/channel.h>
 #include <tx/com.h>
 #include <tx/gdt.h>
 #include <tx/idt.h>
@@ -23,8 +26,11 @@
 #include <tx/ramfs.h>
 #include <tx/rtcfg.h>
 #include <tx/sched.h>
+#include <tx/slab.h>
+#include <tx/smp.h>
 #include <tx/time.h>
 #include <tx/web.h>
+#include <tx/work.h>
 
 extern char _rootfs_archive_start[];
 extern char _rootfs_archive_end[];
@@ -84,9 +90,52 @@ __section(".entry.text") __noreturn void _start(void)
 
 void ram_fs_selftest(void)
 {
-    struct byte_array test_arn_mem = option_byte_array_checked(kvalloc_alloc(5 * BIT(20), alignof(void *)));
-    struct arena test_arn = arena_new(test_arn_mem);
+    // The tests need a few MiB of memory each. The chain only holds on to the memory until the tests are done.
+    struct arena_chain test_chain;
+    arena_chain_init(&test_chain, alloc_new(&test_chain, kvalloc_alloc_wrapper, kvalloc_free_wrapper), BIT(20));
+    struct arena test_arn = arena_new_chained(&test_chain);
+    struct arena_mark test_mark = arena_mark(&test_arn);
     ram_fs_run_tests(test_arn);
+    arena_restore(&test_arn, test_mark);
+}
+
+void buddy_selftest(void)
+{
+    struct byte_array test_arn_mem = option_byte_array_checked(kvalloc_alloc(2 * BIT(20), alignof(void *)));
+    buddy_run_tests(arena_new(test_arn_mem));
+    kvalloc_free(test_arn_mem);
+}
+
+void kvalloc_selftest(void)
+{
+    kvalloc_run_tests();
+}
+
+void slab_selftest(void)
+{
+    struct byte_array test_arn_mem = option_byte_array_checked(kvalloc_alloc(2 * BIT(20), alignof(void *)));
+    slab_run_tests(arena_new(test_arn_mem));
+    kvalloc_free(test_arn_mem);
+}
+
+// Only called when the kernel was built with `make BENCH=1`.
+void run_benchmarks(void)
+{
+    struct byte_array bench_arn_mem = option_byte_array_checked(kvalloc_alloc(16 * BIT(20), alignof(void *)));
+    buddy_run_benchmarks(arena_new(bench_arn_mem));
+    byte_run_benchmarks(arena_new(bench_arn_mem));
+    paging_run_benchmarks();
+    kvalloc_free(bench_arn_mem);
+}
+
+void channel_selftest(void)
+{
+    channel_run_tests();
+}
+
+void work_selftest(void)
+{
+    work_run_tests();
 }
 
 void ipv4_addr_selftest(void)
@@ -110,7 +159,7 @@ void print_hello_txt(struct ram_fs *rfs)
 
 static void handle_timer_interrupt(struct trap_frame *cpu_state __unused, void *private_data __unused)
 {
-    return;
+    sched_timer_tick();
 }
 
 static void init_memory(void)
@@ -130,6 +179,10 @@ static void init_memory(void)
     // First, initialize paging.
     struct byte_array dyn = paging_init(code_addrs, dyn_addrs);
 
+    // The ACPI tables are at the end of RAM. Read them before kvalloc starts handing out this memory.
+    if (__SMP__)
+        smp_discover_cpus();
+
     // Then initialize the kernel virtual memory allocator.
     struct result res = kvalloc_init(dyn);
     assert(!res.is_error);
@@ -144,7 +197,10 @@ static struct ram_fs *init_ram_fs(void)
     rfs_alloc.a_ptr = NULL;
     rfs_alloc.alloc = kvalloc_alloc_wrapper;
     rfs_alloc.free = kvalloc_free_wrapper;
-    return ram_fs_new(rfs_alloc);
+    struct ram_fs *rfs = ram_fs_new(rfs_alloc);
+    if (rfs)
+        alloc_stats_register_pool(STR("ram_fs_node"), &rfs->node_alloc);
+    return rfs;
 }
 
 void init_net(struct runtime_config *cfg, struct arena arn)
@@ -194,44 +250,54 @@ void task_net_receive(void *ctx_ptr)
     struct result res = result_ok();
     struct input_packet *in_packet = NULL;
 
+    // The network stack is protected by the kernel lock.
+    kernel_lock();
+
     while (true) {
         in_packet = netdev_get_input();
-        if (in_packet) {
-            if (in_packet->n_failed_to_handle > 5) {
-                netdev_release_input(in_packet);
-                continue;
-            }
+        if (!in_packet) {
+            netdev_wait_input();
+            continue;
+        }
 
-            send_buf_clear(&ctx->sb);
-
-            switch (in_packet->proto) {
-            case NETDEV_PROTO_ARP:
-                res = arp_handle_packet(in_packet, ctx->sb, ctx->tmp_arn);
-                break;
-            case NETDEV_PROTO_IPV4:
-                res = ipv4_handle_packet(in_packet, ctx->sb, ctx->tmp_arn);
-                break;
-            default:
-                print_dbg(PINFO, STR("Received packet with unknown protocol 0x%hx. Dropping ...\n"), in_packet->proto);
-                break;
-            }
+        if (in_packet->n_failed_to_handle > 5) {
+            netdev_release_input(in_packet);
+            continue;
+        }
 
-            // Release the packet if the handler returned a sucess. Otherwise, leave the packet in the queue
-            // so that it can be handled again.
-            if (res.is_error) {
-                print_dbg(PWARN, STR("Failed to handle packet 0x%lx. Total attempts: %ld\n"), in_packet,
-                          in_packet->n_failed_to_handle);
-                in_packet->n_failed_to_handle++;
-            } else {
-                netdev_release_input(in_packet);
-            }
+        send_buf_clear(&ctx->sb);
+
+        switch (in_packet->proto) {
+        case NETDEV_PROTO_ARP:
+            res = arp_handle_packet(in_packet, ctx->sb, ctx->tmp_arn);
+            break;
+        case NETDEV_PROTO_IPV4:
+            res = ipv4_handle_packet(in_packet, ctx->sb, ctx->tmp_arn);
+            break;
+        default:
+            print_dbg(PINFO, STR("Received packet with unknown protocol 0x%hx. Dropping ...\n"), in_packet->proto);
+            break;
+        }
+
+        // Release the packet if the handler returned a sucess. Otherwise, leave the packet in the queue
+        // so that it can be handled again.
+        if (res.is_error) {
+            print_dbg(PWARN, STR("Failed to handle packet 0x%lx. Total attempts: %ld\n"), in_packet,
+                      in_packet->n_failed_to_handle);
+            in_packet->n_failed_to_handle++;
+            sleep_ms(time_ms_new(10)); // Give the failure some time to resolve itself.
+        } else {
+            netdev_release_input(in_packet);
+            // Tasks that were woken up by the packet have a lower priority. They run once the input queue is empty.
+            sched_yield();
         }
-        sleep_ms(time_ms_new(10));
     }
 }
 
 void task_net_ping(void *ctx_ptr __unused)
 {
+    kernel_lock(); // The network stack is protected by the kernel lock.
+
     struct result res = result_ok();
     struct arena tmp_arn = arena_new(option_byte_array_checked(kvalloc_alloc(0x2000, 64)));
     struct send_buf sb = send_buf_new(arena_new(option_byte_array_checked(kvalloc_alloc(0x4000, 64))));
@@ -244,6 +310,7 @@ void task_net_ping(void *ctx_ptr __unused)
     }
 
     assert(!res.is_error);
+    kernel_unlock();
 }
 
 struct web_listen_ctx {
@@ -263,14 +330,27 @@ __noreturn void kernel_init(void)
 {
     isr_register_handler(0x20, handle_timer_interrupt, NULL);
     gdt_init();
+    smp_init_bsp();
     com_init(COM1_PORT);
     interrupt_init();
     time_init();
 
     init_memory();
+    buddy_selftest();
+    slab_selftest();
+    kvalloc_selftest();
+    if (__BENCH__)
+        run_benchmarks();
     struct arena arn = arena_new(option_byte_array_checked(kvalloc_alloc(0x2000, 64)));
 
     sched_init();
+    if (__BENCH__)
+        sched_run_benchmarks();
+    channel_selftest();
+    work_queue_init();
+    work_selftest();
+    if (__SMP__)
+        smp_start_aps();
 
     struct ram_fs *rfs = init_ram_fs();
     assert(rfs);
@@ -307,12 +387,37 @@ __noreturn void kernel_init(void)
     web_listen_ctx.port = 80;
     web_listen_ctx.root = web_dir;
 
-    sched_create_task(task_net_ping, NULL);
-    sched_create_task(task_net_receive, &recv_ctx);
-    sched_create_task(task_web_listen, &web_listen_ctx);
+    struct sched_task_attrs ping_attrs = { 0 };
+    ping_attrs.name = STR("net_ping");
+    sched_create_task_attrs(task_net_ping, NULL, ping_attrs);
+
+    // Packets must be taken off the input queue quickly, or it overflows during bursts.
+    struct sched_task_attrs recv_attrs = { 0 };
+    recv_attrs.priority = SCHED_PRIORITY_HIGH;
+    recv_attrs.name = STR("net_receive");
+    sched_create_task_attrs(task_net_receive, &recv_ctx, recv_attrs);
+
+    struct sched_task_attrs web_attrs = { 0 };
+    web_attrs.name = STR("web_listen");
+    sched_create_task_attrs(task_web_listen, &web_listen_ctx, web_attrs);
+
+    char cmd_buf[16];
 
-    while (true)
+    while (true) {
+        // Print the allocator or scheduler statistics or the scheduler trace when asked to over serial.
+        struct str_buf cmd = str_buf_new(cmd_buf, 0, countof(cmd_buf));
+        if (!com_try_read(COM1_PORT, &cmd).is_error) {
+            for (sz i = 0; i < cmd.len; i++) {
+                if (__ALLOC_STATS__ && cmd.dat[i] == 'm')
+                    alloc_stats_report();
+                if (cmd.dat[i] == 's')
+                    sched_print_stats();
+                if (cmd.dat[i] == 't')
+                    sched_dump_trace();
+            }
+        }
         sleep_ms(time_ms_new(1000));
+    }
 
     hlt();
 }
@@ -6,6 +6,8 @@
 #include <tx/fmt.h>
 #include <tx/isr.h>
 #include <tx/pic.h>
+#include <tx/sched.h>
+#include <tx/smp.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Interrupt handling                                                        //
@@ -52,7 +54,16 @@ static void handle_interrupt(struct trap_frame *cpu_state)
         }
     }
 
-    pic_send_eoi(cpu_state->vector);
+    // Exceptions like page faults don't come from the PIC or the local APIC. Switching to another task must wait until
+    // the end of the interrupt was signaled, otherwise further interrupts are held back until the preempted task runs
+    // again.
+    if (cpu_state->vector >= IRQ_VECTORS_BEG) {
+        if (cpu_state->vector < PIC_VECTORS_END)
+            pic_send_eoi(cpu_state->vector);
+        else if (cpu_state->vector != VECTOR_LAPIC_SPURIOUS)
+            lapic_send_eoi();
+        sched_preempt_from_interrupt();
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -164,6 +175,12 @@ ISR_STUB(45)
 ISR_STUB(46)
 ISR_STUB(47)
 
+// Local APIC interrupt vectors
+ISR_STUB(48)
+ISR_STUB(49)
+ISR_STUB(50)
+ISR_STUB(63)
+
 static void fmt_cpu_state(struct trap_frame *cpu_state, struct str_buf *buf)
 {
     fmt(buf,
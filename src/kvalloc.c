@@ -1,73 +1,540 @@
 // Kernel virtual address allocator (kvalloc)
 //
-// This allocator manages virtual memory for use by the kernel using the buddy system.
+// This allocator manages virtual memory for use by the kernel using the buddy system. Small allocations
+// are served from slab caches with power-of-two size classes (see slab.h) so that they don't take up a full page.
 //
 // The kvalloc implements a typical alloc/free interface. Kernel subsystems can get
 // memory for their internal structures here. It's recommended that these subsystems
 // make infrequent allocations and manage the memory they need internally.
+//
+// kvalloc also keeps a few blocks of pages that are already zeroed. They are zeroed while the CPU has nothing else to
+// do (see `kvalloc_prezero_step`), so that callers of `kvalloc_alloc_zeroed` don't have to wait for it.
+//
+// In addition, kvalloc can reserve demand-paged regions. Only virtual addresses are reserved for these
+// regions. Each page is backed by a physical frame (see frame.h) when it's touched for the first time. Regions can
+// start with a guard page that's never backed, so that running off the bottom of a region crashes.
 
-// TODO(sync): kvalloc manages kernel memory, a resource shared among all processes.
-// Accesses to kvalloc will requires synchronization.
+// kvalloc manages kernel memory, a resource shared among all tasks and CPUs. All of its state is protected by a
+// single spinlock. The lock isn't held while page tables are modified, so paging code can allocate from kvalloc.
 
 #include <config.h>
+#include <tx/alloc_stats.h>
 #include <tx/arena.h>
 #include <tx/base.h>
 #include <tx/buddy.h>
 #include <tx/error.h>
+#include <tx/frame.h>
+#include <tx/isr.h>
 #include <tx/kvalloc.h>
 #include <tx/paging.h>
+#include <tx/slab.h>
+#include <tx/spinlock.h>
+
+// Allocations of up to `KVALLOC_SLAB_MAX_SIZE` bytes are served by the slab caches. The size classes are all
+// the powers of two from `KVALLOC_SLAB_MIN_SIZE` to `KVALLOC_SLAB_MAX_SIZE`.
+#define KVALLOC_SLAB_MIN_SIZE 16
+#define KVALLOC_SLAB_MAX_SIZE 2048
+#define KVALLOC_NUM_SIZE_CLASSES 8
+
+static_assert(KVALLOC_SLAB_MIN_SIZE << (KVALLOC_NUM_SIZE_CLASSES - 1) == KVALLOC_SLAB_MAX_SIZE);
+
+// Pre-zeroed blocks are kept for allocations of up to `KVALLOC_ZEROED_MAX_PAGES` pages. There are at most
+// `KVALLOC_ZEROED_MAX_BLOCKS` blocks of each size.
+#define KVALLOC_ZEROED_MAX_PAGES 8
+#define KVALLOC_ZEROED_MAX_BLOCKS 4
+
+struct kvalloc_zeroed_class {
+    byte *blocks[KVALLOC_ZEROED_MAX_BLOCKS];
+    sz n_blocks;
+    // Number of blocks to keep around. Only sizes that were asked for are kept, so this starts at zero and grows
+    // every time a request can't be served from the pool.
+    sz target;
+};
 
 struct kvalloc {
+    struct spinlock lock;
     struct buddy *virt_alloc; // Manages virtual pages handed out by this allocator.
+    struct slab_cache size_classes[KVALLOC_NUM_SIZE_CLASSES];
+    // One entry for every page managed by `virt_alloc`. The entry is zero if the page doesn't belong to a slab.
+    // Otherwise, it's the order of the slab plus one. This is how `kvalloc_free` finds out if some memory
+    // belongs to a slab and where the header of that slab is.
+    u8 *slab_map;
+    sz n_pages;
+    struct dlist regions; // Reserved demand-paged regions sorted by address.
+    // Pre-zeroed blocks. The blocks in entry `i` are `i + 1` pages long.
+    struct kvalloc_zeroed_class zeroed[KVALLOC_ZEROED_MAX_PAGES];
+
+    // Statistics. Small allocations count with the size of their size class and big allocations with their
+    // number of pages.
+    sz n_bytes_live;
+    sz n_bytes_high_water;
+    sz n_allocs;
+    sz n_frees;
+    sz n_zeroed_hits;
+    sz n_zeroed_misses;
 };
 
 // We can't dynamically allocate memory for these structures because they are needed to
 // initialize kvalloc, the dymamic allocator.
-
-// An instance of a buddy allocator requires some memory for the heads of its free lists
-// and for the bitmaps it uses. The amount of memory required depends on the size of the
-// managed region because the bitmap increases in size with bigger regions.
-#define VIRT_ALLOC_BACKING_MEM_SIZE 0x5000
-static byte virt_alloc_backing_mem[VIRT_ALLOC_BACKING_MEM_SIZE];
-
 static struct kvalloc global_kvalloc;
 static bool global_kvalloc_is_initiallized = false;
 
+///////////////////////////////////////////////////////////////////////////////
+// Slab map                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline sz kvalloc_page_idx(void *addr)
+{
+    sz idx = ((byte *)addr - global_kvalloc.virt_alloc->base) / PAGE_SIZE;
+    assert(0 <= idx && idx < global_kvalloc.n_pages);
+    return idx;
+}
+
+static void kvalloc_set_slab_map(void *slab, sz slab_len, u8 value)
+{
+    sz idx = kvalloc_page_idx(slab);
+    assert(slab_len / PAGE_SIZE <= global_kvalloc.n_pages - idx);
+    for (sz i = 0; i < slab_len / PAGE_SIZE; i++)
+        global_kvalloc.slab_map[idx + i] = value;
+}
+
+// Page allocator for the slab caches. Marks all pages of new slabs in the slab map.
+static void *kvalloc_slab_alloc(void *a __unused, sz size, sz align __unused)
+{
+    struct option_byte_array mem_opt = buddy_alloc(global_kvalloc.virt_alloc, size);
+    if (mem_opt.is_none)
+        return NULL;
+    void *slab = byte_array_ptr(option_byte_array_checked(mem_opt));
+
+    sz ord = CTZ(size / PAGE_SIZE);
+    assert((PAGE_SIZE << ord) == size);
+    kvalloc_set_slab_map(slab, size, ord + 1);
+
+    return slab;
+}
+
+static void kvalloc_slab_free(void *a __unused, void *slab, sz size)
+{
+    kvalloc_set_slab_map(slab, size, 0);
+    buddy_free(global_kvalloc.virt_alloc, byte_array_new(slab, size));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Demand paging                                                             //
+///////////////////////////////////////////////////////////////////////////////
+
+// A range of virtual addresses in the window for demand-paged memory (`KERN_VMEM_*`).
+struct kvalloc_region {
+    struct dlist link;
+    vaddr_t base;
+    sz len; // Multiple of `PAGE_SIZE`. Includes the guard page.
+    sz guard_len; // Length of the guard page at `base`, or 0 if there is none.
+};
+
+static struct kvalloc_region *kvalloc_find_region(vaddr_t vaddr)
+{
+    struct dlist *head = &global_kvalloc.regions;
+    for (struct dlist *pos = head->next; pos != head; pos = pos->next) {
+        struct kvalloc_region *region = __container_of(pos, struct kvalloc_region, link);
+        if (IN_RANGE(vaddr, region->base, region->len))
+            return region;
+    }
+    return NULL;
+}
+
+static void kvalloc_handle_page_fault(struct trap_frame *cpu_state, void *private_data __unused)
+{
+    vaddr_t vaddr = read_cr2();
+
+    // Only faults caused by accesses to pages that aren't backed yet can be handled here.
+    spin_lock(&global_kvalloc.lock);
+    struct kvalloc_region *region = kvalloc_find_region(vaddr);
+    bool is_guard = region && vaddr < region->base + region->guard_len;
+    spin_unlock(&global_kvalloc.lock);
+
+    if (cpu_state->error_code & PAGE_FAULT_ERROR_P || !region) {
+        print_dbg(PERROR, STR("Page fault: addr=0x%lx error_code=0x%lx rip=0x%lx\n"), vaddr, cpu_state->error_code,
+                  cpu_state->rip);
+        crash("Unhandled page fault\n");
+    }
+
+    if (is_guard) {
+        print_dbg(PERROR, STR("Guard page hit: addr=0x%lx rip=0x%lx rsp=0x%lx\n"), vaddr, cpu_state->rip,
+                  cpu_state->rsp);
+        crash("Access to guard page (stack overflow?)\n");
+    }
+
+    struct result_paddr_t frame_res = frame_alloc();
+    if (frame_res.is_error)
+        crash("Out of memory while backing a demand-paged region\n");
+
+    // Another CPU might have faulted on the same page and mapped it in the meantime.
+    struct result res = paging_map_page(ALIGN_DOWN(vaddr, PAGE_SIZE), result_paddr_t_checked(frame_res));
+    if (res.is_error && res.code == EEXIST)
+        frame_free(result_paddr_t_checked(frame_res));
+    else
+        assert(!res.is_error);
+}
+
+static struct option_byte_array kvalloc_alloc_locked(sz n_bytes, sz align, struct str basename, sz line);
+static void kvalloc_free_locked(struct byte_array ba);
+
+// Must be called with the lock held.
+static struct option_byte_array kvalloc_reserve_region(sz n_bytes, sz guard_len)
+{
+    assert(global_kvalloc_is_initiallized);
+    assert(n_bytes > 0);
+
+    sz len = ALIGN_UP(n_bytes, PAGE_SIZE) + guard_len;
+
+    // Find the first gap between the existing regions that's big enough.
+    struct dlist *head = &global_kvalloc.regions;
+    struct dlist *next = head->next;
+    vaddr_t base = KERN_VMEM_VADDR;
+    for (; next != head; next = next->next) {
+        struct kvalloc_region *region = __container_of(next, struct kvalloc_region, link);
+        if (region->base - base >= len)
+            break;
+        base = region->base + region->len;
+    }
+    if (next == head && (vaddr_t)KERN_VMEM_VADDR + KERN_VMEM_LEN - base < len)
+        return option_byte_array_none();
+
+    struct option_byte_array mem_opt = kvalloc_alloc_locked(sizeof(struct kvalloc_region),
+                                                            alignof(struct kvalloc_region), STR(__BASENAME__),
+                                                            __LINE__);
+    if (mem_opt.is_none)
+        return option_byte_array_none();
+    struct kvalloc_region *region = byte_array_ptr(option_byte_array_checked(mem_opt));
+    region->base = base;
+    region->len = len;
+    region->guard_len = guard_len;
+    dlist_insert(next->prev, &region->link);
+
+    print_dbg(PDBG, STR("Reserved demand-paged region: base=0x%lx len=0x%lx guard_len=0x%lx\n"), base, len,
+              guard_len);
+
+    return option_byte_array_ok(byte_array_new((byte *)base + guard_len, n_bytes));
+}
+
+struct option_byte_array kvalloc_reserve(sz n_bytes)
+{
+    spin_lock(&global_kvalloc.lock);
+    struct option_byte_array region = kvalloc_reserve_region(n_bytes, 0);
+    spin_unlock(&global_kvalloc.lock);
+    return region;
+}
+
+struct option_byte_array kvalloc_reserve_guarded(sz n_bytes)
+{
+    spin_lock(&global_kvalloc.lock);
+    struct option_byte_array region = kvalloc_reserve_region(n_bytes, PAGE_SIZE);
+    spin_unlock(&global_kvalloc.lock);
+    return region;
+}
+
+void kvalloc_release_backing(struct byte_array ba)
+{
+    assert(global_kvalloc_is_initiallized);
+
+    if (!ba.len)
+        return;
+
+    spin_lock(&global_kvalloc.lock);
+    struct kvalloc_region *region = kvalloc_find_region((vaddr_t)ba.dat);
+    assert(region);
+    assert((vaddr_t)ba.dat + ba.len <= region->base + region->len);
+    spin_unlock(&global_kvalloc.lock);
+
+    // The page tables have a lock of their own and freeing the frames takes the kvalloc lock again.
+
+    // Pages that are only partially contained in `ba` might still be in use.
+    vaddr_t beg = ALIGN_UP((vaddr_t)ba.dat, PAGE_SIZE);
+    vaddr_t end = ALIGN_DOWN((vaddr_t)ba.dat + ba.len, PAGE_SIZE);
+    for (vaddr_t vaddr = beg; vaddr < end; vaddr += PAGE_SIZE) {
+        struct result_paddr_t paddr_res = paging_unmap_page(vaddr);
+        if (!paddr_res.is_error)
+            frame_free(result_paddr_t_checked(paddr_res)); // Pages that were never touched have no frame.
+    }
+}
+
+void kvalloc_unreserve(struct byte_array ba)
+{
+    assert(global_kvalloc_is_initiallized);
+
+    if (!ba.dat)
+        return;
+
+    spin_lock(&global_kvalloc.lock);
+    struct kvalloc_region *region = kvalloc_find_region((vaddr_t)ba.dat);
+    assert(region && region->base + region->guard_len == (vaddr_t)ba.dat);
+    spin_unlock(&global_kvalloc.lock);
+
+    kvalloc_release_backing(byte_array_new((byte *)region->base, region->len));
+
+    spin_lock(&global_kvalloc.lock);
+    dlist_remove(&region->link);
+    kvalloc_free_locked(byte_array_new((byte *)region, sizeof(*region)));
+    spin_unlock(&global_kvalloc.lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pre-zeroed memory                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+// A pre-zeroed block of `n_pages` pages can be handed out for a request with an alignment of up to `align` because
+// the buddy allocator aligns every block to its size rounded up to a power of two.
+static struct kvalloc_zeroed_class *kvalloc_zeroed_class(sz n_pages, sz align)
+{
+    if (n_pages > KVALLOC_ZEROED_MAX_PAGES || align > PAGE_SIZE << LOG2_CEIL(n_pages))
+        return NULL;
+    return &global_kvalloc.zeroed[n_pages - 1];
+}
+
+static byte *kvalloc_zeroed_pop(struct kvalloc_zeroed_class *class)
+{
+    if (!class->n_blocks)
+        return NULL;
+    return class->blocks[--class->n_blocks];
+}
+
+bool kvalloc_prezero_step(void)
+{
+    if (!global_kvalloc_is_initiallized)
+        return false;
+
+    spin_lock(&global_kvalloc.lock);
+    for (sz i = 0; i < KVALLOC_ZEROED_MAX_PAGES; i++) {
+        struct kvalloc_zeroed_class *class = &global_kvalloc.zeroed[i];
+        if (class->n_blocks >= class->target)
+            continue;
+
+        struct option_byte_array mem_opt = buddy_alloc(global_kvalloc.virt_alloc, (i + 1) * PAGE_SIZE);
+        spin_unlock(&global_kvalloc.lock);
+        if (mem_opt.is_none)
+            return false;
+
+        // The block isn't reachable by anyone else yet, so it's zeroed without holding the lock.
+        struct byte_array mem = option_byte_array_checked(mem_opt);
+        byte_array_set(mem, 0);
+
+        spin_lock(&global_kvalloc.lock);
+        if (class->n_blocks < KVALLOC_ZEROED_MAX_BLOCKS)
+            class->blocks[class->n_blocks++] = mem.dat;
+        else
+            buddy_free(global_kvalloc.virt_alloc, mem);
+        spin_unlock(&global_kvalloc.lock);
+        return true;
+    }
+    spin_unlock(&global_kvalloc.lock);
+
+    return false;
+}
+
+// Give all pre-zeroed blocks back to the buddy allocator. They are zeroed again once the memory isn't needed
+// elsewhere anymore.
+static void kvalloc_release_zeroed(void)
+{
+    for (sz i = 0; i < KVALLOC_ZEROED_MAX_PAGES; i++) {
+        struct kvalloc_zeroed_class *class = &global_kvalloc.zeroed[i];
+        byte *block = NULL;
+        while ((block = kvalloc_zeroed_pop(class)))
+            buddy_free(global_kvalloc.virt_alloc, byte_array_new(block, (i + 1) * PAGE_SIZE));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Outward-facing interface                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
 struct result kvalloc_init(struct byte_array vaddrs)
 {
     assert(!global_kvalloc_is_initiallized);
 
-    struct arena arn = arena_new(byte_array_new(virt_alloc_backing_mem, VIRT_ALLOC_BACKING_MEM_SIZE));
-    global_kvalloc.virt_alloc = buddy_init(vaddrs, &arn);
+    // An instance of a buddy allocator requires some memory for the heads of its free lists and for the bitmaps
+    // it uses. The amount of memory required depends on the size of the managed region because the bitmaps
+    // increase in size with bigger regions. We take this memory from the start of `vaddrs`.
+    // The region managed by the buddy allocator starts at the next `KVALLOC_MAX_ALIGN` boundary after this
+    // memory so that big alignments relative to its base are absolute alignments, too.
+    sz backing_mem_len = ALIGN_UP(buddy_init_arena_size(vaddrs.len), PAGE_SIZE);
+    sz managed_offset = ALIGN_UP((ptr)vaddrs.dat + backing_mem_len, KVALLOC_MAX_ALIGN) - (ptr)vaddrs.dat;
+    if (vaddrs.len <= managed_offset + PAGE_SIZE)
+        return result_error(ENOMEM);
+    struct arena arn = arena_new(byte_array_new(vaddrs.dat, backing_mem_len));
+    global_kvalloc.virt_alloc =
+        buddy_init(byte_array_new(vaddrs.dat + managed_offset, vaddrs.len - managed_offset), &arn);
+    global_kvalloc.n_pages = global_kvalloc.virt_alloc->n_pages;
+
+    print_dbg(PINFO, STR("kvalloc manages %ld KiB of usable memory (%ld KiB used for metadata and alignment)\n"),
+              global_kvalloc.n_pages * PAGE_SIZE / 1024, (vaddrs.len - global_kvalloc.n_pages * PAGE_SIZE) / 1024);
+
+    // The slab map is the first allocation made from the buddy allocator. It has one byte for every page.
+    struct option_byte_array slab_map_opt = buddy_alloc(global_kvalloc.virt_alloc, global_kvalloc.n_pages);
+    if (slab_map_opt.is_none)
+        return result_error(ENOMEM);
+    struct byte_array slab_map = option_byte_array_checked(slab_map_opt);
+    byte_array_set(slab_map, 0);
+    global_kvalloc.slab_map = slab_map.dat;
+
+    struct alloc slab_page_alloc = alloc_new(&global_kvalloc, kvalloc_slab_alloc, kvalloc_slab_free);
+    for (sz i = 0; i < KVALLOC_NUM_SIZE_CLASSES; i++)
+        slab_cache_init(&global_kvalloc.size_classes[i], KVALLOC_SLAB_MIN_SIZE << i, slab_page_alloc);
+
+    dlist_init_empty(&global_kvalloc.regions);
+    struct result res = isr_register_handler(VECTOR_PAGE_FAULT, kvalloc_handle_page_fault, NULL);
+    if (res.is_error)
+        return res;
+
+    // Demand paging needs page table pages for the regions that are backed.
+    paging_set_pt_page_alloc(alloc_new(&global_kvalloc, kvalloc_alloc_wrapper, kvalloc_free_wrapper));
 
     global_kvalloc_is_initiallized = true;
 
     return result_ok();
 }
 
-struct option_byte_array kvalloc_alloc(sz n_bytes, sz align)
+static struct slab_cache *kvalloc_size_class(sz n_bytes)
+{
+    sz idx = LOG2_CEIL(MAX(n_bytes, KVALLOC_SLAB_MIN_SIZE)) - LOG2_FLOOR(KVALLOC_SLAB_MIN_SIZE);
+    assert(0 <= idx && idx < KVALLOC_NUM_SIZE_CLASSES);
+    return &global_kvalloc.size_classes[idx];
+}
+
+static void kvalloc_count_alloc(sz real_size)
+{
+    global_kvalloc.n_allocs++;
+    global_kvalloc.n_bytes_live += real_size;
+    global_kvalloc.n_bytes_high_water = MAX(global_kvalloc.n_bytes_high_water, global_kvalloc.n_bytes_live);
+}
+
+static void kvalloc_count_free(sz real_size)
+{
+    assert(global_kvalloc.n_bytes_live >= real_size);
+    global_kvalloc.n_frees++;
+    global_kvalloc.n_bytes_live -= real_size;
+}
+
+static struct option_byte_array kvalloc_alloc_locked(sz n_bytes, sz align, struct str basename, sz line)
 {
     assert(global_kvalloc_is_initiallized);
+    assert(n_bytes > 0);
+
+    if (__ALLOC_STATS__)
+        alloc_stats_record_site(basename, line, n_bytes);
+
+    // Slab objects are aligned to their size, so rounding the request up to the alignment is enough to satisfy it.
+    if (MAX(n_bytes, align) <= KVALLOC_SLAB_MAX_SIZE) {
+        struct slab_cache *cache = kvalloc_size_class(MAX(n_bytes, align));
+        void *obj = slab_cache_alloc(cache);
+        if (!obj)
+            return option_byte_array_none();
+        kvalloc_count_alloc(cache->obj_size);
+        return option_byte_array_ok(byte_array_new(obj, n_bytes));
+    }
 
     // Pointers returned by the buddy allocator are naturally page-algined because the buddy
-    // allocator works in page-sized blocks. We can handle bigger alignment later.
-    assert(align <= PAGE_SIZE);
+    // allocator works in page-sized blocks. Bigger alignments are relative to the base of the
+    // buddy allocator, which is aligned to `KVALLOC_MAX_ALIGN`.
+    assert(align <= KVALLOC_MAX_ALIGN);
 
     sz real_size = ALIGN_UP(n_bytes, PAGE_SIZE);
-    return buddy_alloc(global_kvalloc.virt_alloc, real_size);
+    struct option_byte_array mem_opt =
+        buddy_alloc_aligned(global_kvalloc.virt_alloc, real_size, MAX(align, PAGE_SIZE));
+    if (mem_opt.is_none) {
+        // Memory that's kept zeroed is better used for this allocation.
+        kvalloc_release_zeroed();
+        mem_opt = buddy_alloc_aligned(global_kvalloc.virt_alloc, real_size, MAX(align, PAGE_SIZE));
+    }
+    if (!mem_opt.is_none)
+        kvalloc_count_alloc(real_size);
+    return mem_opt;
 }
 
-void kvalloc_free(struct byte_array ba)
+struct option_byte_array __kvalloc_alloc(sz n_bytes, sz align, struct str basename, sz line)
+{
+    spin_lock(&global_kvalloc.lock);
+    struct option_byte_array mem_opt = kvalloc_alloc_locked(n_bytes, align, basename, line);
+    spin_unlock(&global_kvalloc.lock);
+    return mem_opt;
+}
+
+// Take a pre-zeroed block if there is one. Otherwise, allocate memory that the caller must zero once the lock is
+// released, which is indicated by `is_zeroed`.
+static struct option_byte_array kvalloc_alloc_zeroed_locked(sz n_bytes, sz align, struct str basename, sz line,
+                                                            bool *is_zeroed)
+{
+    assert(global_kvalloc_is_initiallized);
+    assert(n_bytes > 0);
+
+    sz real_size = ALIGN_UP(n_bytes, PAGE_SIZE);
+    struct kvalloc_zeroed_class *class = NULL;
+    if (MAX(n_bytes, align) > KVALLOC_SLAB_MAX_SIZE)
+        class = kvalloc_zeroed_class(real_size / PAGE_SIZE, align);
+
+    if (class) {
+        byte *block = kvalloc_zeroed_pop(class);
+        if (block) {
+            if (__ALLOC_STATS__)
+                alloc_stats_record_site(basename, line, n_bytes);
+            global_kvalloc.n_zeroed_hits++;
+            kvalloc_count_alloc(real_size);
+            *is_zeroed = true;
+            return option_byte_array_ok(byte_array_new(block, n_bytes));
+        }
+
+        // Keep more blocks of this size around from now on.
+        global_kvalloc.n_zeroed_misses++;
+        class->target = MIN(class->target + 1, KVALLOC_ZEROED_MAX_BLOCKS);
+    }
+
+    *is_zeroed = false;
+    return kvalloc_alloc_locked(n_bytes, align, basename, line);
+}
+
+struct option_byte_array __kvalloc_alloc_zeroed(sz n_bytes, sz align, struct str basename, sz line)
+{
+    bool is_zeroed = false;
+    spin_lock(&global_kvalloc.lock);
+    struct option_byte_array mem_opt = kvalloc_alloc_zeroed_locked(n_bytes, align, basename, line, &is_zeroed);
+    spin_unlock(&global_kvalloc.lock);
+
+    // Memory that didn't come out of the pool can be many pages long. Nobody else can reach it yet, so it's zeroed
+    // without holding the lock.
+    if (!mem_opt.is_none && !is_zeroed)
+        byte_array_set(option_byte_array_checked(mem_opt), 0);
+    return mem_opt;
+}
+
+static void kvalloc_free_locked(struct byte_array ba)
 {
     assert(global_kvalloc_is_initiallized);
 
     if (!ba.dat)
         return;
 
+    // Small allocations are identified by their address and not by their length because the length alone doesn't
+    // tell if the original allocation was bigger due to its alignment.
+    u8 slab_ord = global_kvalloc.slab_map[kvalloc_page_idx(ba.dat)];
+    if (slab_ord) {
+        sz slab_len = PAGE_SIZE << (slab_ord - 1);
+        struct slab *slab = slab_lookup(global_kvalloc.virt_alloc->base, slab_len, ba.dat);
+        kvalloc_count_free(slab->cache->obj_size);
+        slab_free(slab, ba.dat);
+        return;
+    }
+
     ba.len = ALIGN_UP(ba.len, PAGE_SIZE); // This is the real size we need to free.
+    kvalloc_count_free(ba.len);
     buddy_free(global_kvalloc.virt_alloc, ba);
 }
 
+void kvalloc_free(struct byte_array ba)
+{
+    spin_lock(&global_kvalloc.lock);
+    kvalloc_free_locked(ba);
+    spin_unlock(&global_kvalloc.lock);
+}
+
 void *kvalloc_alloc_wrapper(void *a __unused, sz size, sz align)
 {
     struct option_byte_array ba = kvalloc_alloc(size, align);
@@ -80,3 +547,124 @@ void kvalloc_free_wrapper(void *a __unused, void *ptr, sz size)
 {
     kvalloc_free(byte_array_new(ptr, size));
 }
+
+void kvalloc_print_stats(void)
+{
+    assert(global_kvalloc_is_initiallized);
+
+    char underlying[256];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    print_fmt(buf, STR("kvalloc: %ld KiB live (peak %ld KiB), %ld allocs, %ld frees, %ld demand-paged frames\n"),
+              global_kvalloc.n_bytes_live / 1024, global_kvalloc.n_bytes_high_water / 1024, global_kvalloc.n_allocs,
+              global_kvalloc.n_frees, frame_n_in_use());
+
+    sz n_zeroed_pages = 0;
+    for (sz i = 0; i < KVALLOC_ZEROED_MAX_PAGES; i++)
+        n_zeroed_pages += global_kvalloc.zeroed[i].n_blocks * (i + 1);
+    print_fmt(buf, STR("kvalloc: %ld pre-zeroed pages, %ld zeroed allocations served from them, %ld not\n"),
+              n_zeroed_pages, global_kvalloc.n_zeroed_hits, global_kvalloc.n_zeroed_misses);
+    buddy_print_stats(global_kvalloc.virt_alloc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+#define KVALLOC_TEST_REGION_SIZE BIT(22) /* 4 MiB */
+
+static void test_demand_paging(void)
+{
+    sz n_frames = frame_n_in_use();
+
+    struct byte_array region = option_byte_array_checked(kvalloc_reserve(KVALLOC_TEST_REGION_SIZE));
+    assert(is_demand_paged_addr((vaddr_t)region.dat));
+    assert(frame_n_in_use() == n_frames);
+    assert(virt_to_phys((vaddr_t)region.dat).is_error);
+
+    // Only the pages that are touched are backed.
+    region.dat[0] = 1;
+    region.dat[PAGE_SIZE + 1] = 2;
+    region.dat[region.len - 1] = 3;
+    assert(frame_n_in_use() == n_frames + 3);
+    assert(region.dat[0] == 1 && region.dat[PAGE_SIZE + 1] == 2 && region.dat[region.len - 1] == 3);
+    assert(!virt_to_phys((vaddr_t)region.dat).is_error);
+
+    // A second region doesn't overlap with the first one.
+    struct byte_array other = option_byte_array_checked(kvalloc_reserve(1));
+    assert(!IN_RANGE((vaddr_t)other.dat, (vaddr_t)region.dat, region.len));
+    other.dat[0] = 4;
+    assert(frame_n_in_use() == n_frames + 4);
+
+    // Releasing the backing keeps the reservation.
+    kvalloc_release_backing(byte_array_new(region.dat, 2 * PAGE_SIZE));
+    assert(frame_n_in_use() == n_frames + 2);
+    region.dat[0] = 5;
+    assert(frame_n_in_use() == n_frames + 3);
+
+    kvalloc_unreserve(region);
+    kvalloc_unreserve(other);
+    assert(frame_n_in_use() == n_frames);
+
+    // The first gap is reused.
+    struct byte_array again = option_byte_array_checked(kvalloc_reserve(PAGE_SIZE));
+    assert(again.dat == region.dat);
+    kvalloc_unreserve(again);
+
+    // The guard page belongs to the region, so no other region is placed there.
+    struct byte_array guarded = option_byte_array_checked(kvalloc_reserve_guarded(PAGE_SIZE));
+    assert(guarded.dat == region.dat + PAGE_SIZE);
+    guarded.dat[0] = 6;
+    assert(frame_n_in_use() == n_frames + 1);
+    other = option_byte_array_checked(kvalloc_reserve(1));
+    assert(!IN_RANGE((vaddr_t)other.dat, (vaddr_t)guarded.dat - PAGE_SIZE, PAGE_SIZE + guarded.len));
+    kvalloc_unreserve(other);
+    kvalloc_unreserve(guarded);
+    assert(frame_n_in_use() == n_frames);
+}
+
+static void test_prezeroed(void)
+{
+    sz n_pages = 5;
+    struct kvalloc_zeroed_class *class = kvalloc_zeroed_class(n_pages, PAGE_SIZE);
+    sz target = class->target;
+    sz n_blocks = class->n_blocks;
+
+    // Drain the pool so that the first allocation misses.
+    byte *blocks[KVALLOC_ZEROED_MAX_BLOCKS];
+    for (sz i = 0; i < n_blocks; i++)
+        blocks[i] = kvalloc_zeroed_pop(class);
+
+    struct byte_array dirty = option_byte_array_checked(kvalloc_alloc_zeroed(n_pages * PAGE_SIZE - 1, PAGE_SIZE));
+    for (sz i = 0; i < dirty.len; i++)
+        assert(dirty.dat[i] == 0);
+    assert(class->target == MIN(target + 1, KVALLOC_ZEROED_MAX_BLOCKS));
+    byte_array_set(dirty, 0xab);
+    kvalloc_free(dirty);
+
+    while (kvalloc_prezero_step())
+        ;
+    assert(class->n_blocks == class->target);
+
+    // The next allocation comes out of the pool and it's zeroed even though the memory was dirty before.
+    byte *next = class->blocks[class->n_blocks - 1];
+    struct byte_array zeroed = option_byte_array_checked(kvalloc_alloc_zeroed(n_pages * PAGE_SIZE, 2 * PAGE_SIZE));
+    assert(zeroed.dat == next);
+    for (sz i = 0; i < zeroed.len; i++)
+        assert(zeroed.dat[i] == 0);
+    kvalloc_free(zeroed);
+
+    // Restore the pool to the way it was before the test.
+    kvalloc_release_zeroed();
+    for (sz i = 0; i < n_blocks; i++)
+        class->blocks[i] = blocks[i];
+    class->n_blocks = n_blocks;
+    class->target = target;
+}
+
+void kvalloc_run_tests(void)
+{
+    test_demand_paging();
+    test_prezeroed();
+    print_dbg(PINFO, STR("kvalloc selftest passed\n"));
+}
@@ -3,6 +3,7 @@
 #include <tx/asm.h>
 #include <tx/base.h>
 #include <tx/byte.h>
+#include <tx/dma.h>
 #include <tx/isr.h>
 #include <tx/kvalloc.h>
 #include <tx/net/netdev.h>
@@ -11,6 +12,7 @@
 #include <tx/pci.h>
 #include <tx/pic.h>
 #include <tx/print.h>
+#include <tx/work.h>
 
 // The 8254x PCI/PCI-X Family of Gigabit Ethernet Controllers Software Developer’s Manual (2009 version) was used as a
 // source for this driver References to sections are with respect to this document. A copy of the manual used can be
@@ -117,7 +119,8 @@ struct e1000_stats {
 };
 
 struct e1000_device {
-    struct byte_array tmp_recv_buf; // Just used as a source of memory to receive stuff in the interrupt handler.
+    struct byte_array tmp_recv_buf; // Just used as a source of memory to receive stuff in `e1000_rx_work`.
+    struct work rx_work;
 
     u64 mmio_base;
     u64 mmio_len;
@@ -130,12 +133,12 @@ struct e1000_device {
     struct e1000_legacy_tx_desc *tx_queue;
     sz tx_queue_n_desc;
     sz tx_tail;
-    byte (*tx_buffers)[E1000_TX_BUF_SIZE];
+    struct dma_pool tx_buffers; // Every descriptor keeps the buffer it was given at initialization.
 
     struct e1000_rx_desc *rx_queue;
     sz rx_queue_n_desc;
     sz rx_tail;
-    byte (*rx_buffers)[E1000_RX_BUF_SIZE];
+    struct dma_pool rx_buffers; // Every descriptor keeps the buffer it was given at initialization.
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -235,53 +238,35 @@ static struct result e1000_init_tx(struct e1000_device *dev)
 
     sz tx_queue_n_desc = 32;
 
-    struct option_byte_array tx_mem_opt =
-        kvalloc_alloc(tx_queue_n_desc * sizeof(struct e1000_legacy_tx_desc), alignof(struct e1000_legacy_tx_desc));
-    if (tx_mem_opt.is_none)
-        return result_error(ENOMEM);
-    struct byte_array tx_mem = option_byte_array_checked(tx_mem_opt);
-    struct e1000_legacy_tx_desc *tx_queue = byte_array_ptr(tx_mem);
-
-    struct option_byte_array tx_buffers_mem_opt = kvalloc_alloc(tx_queue_n_desc * E1000_TX_BUF_SIZE, 64);
-    if (tx_buffers_mem_opt.is_none) {
-        kvalloc_free(tx_mem);
-        return result_error(ENOMEM);
-    }
-    struct byte_array tx_buffers_mem = option_byte_array_checked(tx_buffers_mem_opt);
-
-    byte_array_set(tx_mem, 0);
-    byte_array_set(tx_buffers_mem, 0);
-
-    // The 8254x needs a physical address because it will use it for DMA.
-    struct result_paddr_t paddr_tx_queue_res = virt_to_phys((vaddr_t)tx_queue);
-    struct result_paddr_t paddr_tx_buffers_res = virt_to_phys((vaddr_t)byte_array_ptr(tx_buffers_mem));
-    if (paddr_tx_queue_res.is_error) {
-        kvalloc_free(tx_mem);
-        kvalloc_free(tx_buffers_mem);
-        return result_error(paddr_tx_queue_res.code);
-    }
-    if (paddr_tx_buffers_res.is_error) {
-        kvalloc_free(tx_mem);
-        kvalloc_free(tx_buffers_mem);
-        return result_error(paddr_tx_buffers_res.code);
+    // The 8254x uses physical addresses for DMA.
+    struct result_dma_buf tx_mem_res =
+        dma_alloc(tx_queue_n_desc * sizeof(struct e1000_legacy_tx_desc), alignof(struct e1000_legacy_tx_desc));
+    if (tx_mem_res.is_error)
+        return result_error(tx_mem_res.code);
+    struct dma_buf tx_mem = result_dma_buf_checked(tx_mem_res);
+    struct e1000_legacy_tx_desc *tx_queue = byte_array_ptr(tx_mem.mem);
+    paddr_t paddr_tx_queue = tx_mem.paddr;
+
+    struct result res = dma_pool_init(&dev->tx_buffers, E1000_TX_BUF_SIZE, tx_queue_n_desc, 64);
+    if (res.is_error) {
+        dma_free(tx_mem);
+        return res;
     }
-    paddr_t paddr_tx_queue = result_paddr_t_checked(paddr_tx_queue_res);
-    paddr_t paddr_tx_buffers = result_paddr_t_checked(paddr_tx_buffers_res);
 
     // The addresses of these buffers don't change so we can set them once and leave them. The DD bit must be set so
     // the transmit function knows that the descriptors can all be used.
     for (sz i = 0; i < tx_queue_n_desc; i++) {
         tx_queue[i].status |= E1000_TX_DESC_STATUS_DD;
-        tx_queue[i].base_addr = paddr_tx_buffers + i * E1000_TX_BUF_SIZE;
+        tx_queue[i].base_addr = option_dma_buf_checked(dma_pool_alloc(&dev->tx_buffers)).paddr;
     }
 
     assert(IS_ALIGNED(paddr_tx_queue, 16));
     mmio_write32(dev->mmio_base + E1000_OFFSET_TDBAL, (u64)paddr_tx_queue & 0xffffffff);
     mmio_write32(dev->mmio_base + E1000_OFFSET_TDBAH, ((u64)paddr_tx_queue >> 32) & 0xffffffff);
 
-    assert(IS_ALIGNED(tx_mem.len, 128));
-    assert(tx_mem.len <= U32_MAX);
-    mmio_write32(dev->mmio_base + E1000_OFFSET_TDLEN, tx_mem.len);
+    assert(IS_ALIGNED(tx_mem.mem.len, 128));
+    assert(tx_mem.mem.len <= U32_MAX);
+    mmio_write32(dev->mmio_base + E1000_OFFSET_TDLEN, tx_mem.mem.len);
 
     mmio_write64(dev->mmio_base + E1000_OFFSET_TDH, 0);
     mmio_write64(dev->mmio_base + E1000_OFFSET_TDT, 0);
@@ -297,7 +282,6 @@ static struct result e1000_init_tx(struct e1000_device *dev)
     mmio_write32(dev->mmio_base + E1000_OFFSET_TIPG, 10 | (8 << 10) | (6 << 20));
 
     dev->tx_queue = tx_queue;
-    dev->tx_buffers = byte_array_ptr(tx_buffers_mem);
     dev->tx_queue_n_desc = tx_queue_n_desc;
     dev->tx_tail = 0;
 
@@ -310,50 +294,34 @@ static struct result e1000_init_rx(struct e1000_device *dev)
 
     sz rx_queue_n_desc = 128;
 
-    struct option_byte_array rx_mem_opt =
-        kvalloc_alloc(rx_queue_n_desc * sizeof(struct e1000_rx_desc), alignof(struct e1000_rx_desc));
-    if (rx_mem_opt.is_none)
-        return result_error(ENOMEM);
-    struct byte_array rx_mem = option_byte_array_checked(rx_mem_opt);
-    struct e1000_rx_desc *rx_queue = byte_array_ptr(rx_mem);
-
-    struct option_byte_array rx_buffers_mem_opt = kvalloc_alloc(rx_queue_n_desc * E1000_RX_BUF_SIZE, 64);
-    if (rx_buffers_mem_opt.is_none) {
-        kvalloc_free(rx_mem);
-        return result_error(ENOMEM);
-    }
-    struct byte_array rx_buffers_mem = option_byte_array_checked(rx_buffers_mem_opt);
-
-    byte_array_set(rx_mem, 0);
-    byte_array_set(rx_buffers_mem, 0);
-
-    // The 8254x needs a physical addresses because it will use them for DMA.
-    struct result_paddr_t paddr_rx_queue_res = virt_to_phys((vaddr_t)rx_queue);
-    struct result_paddr_t paddr_rx_buffers_res = virt_to_phys((vaddr_t)byte_array_ptr(rx_buffers_mem));
-    if (paddr_rx_queue_res.is_error) {
-        kvalloc_free(rx_mem);
-        kvalloc_free(rx_buffers_mem);
-        return result_error(paddr_rx_queue_res.code);
-    }
-    if (paddr_rx_buffers_res.is_error) {
-        kvalloc_free(rx_mem);
-        kvalloc_free(rx_buffers_mem);
-        return result_error(paddr_rx_buffers_res.code);
+    // The 8254x uses physical addresses for DMA.
+    struct result_dma_buf rx_mem_res =
+        dma_alloc(rx_queue_n_desc * sizeof(struct e1000_rx_desc), alignof(struct e1000_rx_desc));
+    if (rx_mem_res.is_error)
+        return result_error(rx_mem_res.code);
+    struct dma_buf rx_mem = result_dma_buf_checked(rx_mem_res);
+    struct e1000_rx_desc *rx_queue = byte_array_ptr(rx_mem.mem);
+    paddr_t paddr_rx_queue = rx_mem.paddr;
+
+    struct result res = dma_pool_init(&dev->rx_buffers, E1000_RX_BUF_SIZE, rx_queue_n_desc, 64);
+    if (res.is_error) {
+        dma_free(rx_mem);
+        return res;
     }
-    paddr_t paddr_rx_queue = result_paddr_t_checked(paddr_rx_queue_res);
-    paddr_t paddr_rx_buffers = result_paddr_t_checked(paddr_rx_buffers_res);
 
-    // Initialize all descriptors to point to the right buffers.
-    for (sz i = 0; i < rx_queue_n_desc; i++)
-        rx_queue[i].base_addr = paddr_rx_buffers + i * E1000_RX_BUF_SIZE;
+    // Initialize all descriptors to point to the right buffers. The buffers of a new pool are still zeroed.
+    for (sz i = 0; i < rx_queue_n_desc; i++) {
+        struct dma_buf buf = option_dma_buf_checked(dma_pool_alloc(&dev->rx_buffers));
+        rx_queue[i].base_addr = buf.paddr;
+    }
 
     assert(IS_ALIGNED(paddr_rx_queue, 16));
     mmio_write32(dev->mmio_base + E1000_OFFSET_RDBAL, (u64)paddr_rx_queue & 0xffffffff);
     mmio_write32(dev->mmio_base + E1000_OFFSET_RDBAH, ((u64)paddr_rx_queue >> 32) & 0xffffffff);
 
-    assert(IS_ALIGNED(rx_mem.len, 128));
-    assert(rx_mem.len <= U32_MAX);
-    mmio_write32(dev->mmio_base + E1000_OFFSET_RDLEN, rx_mem.len);
+    assert(IS_ALIGNED(rx_mem.mem.len, 128));
+    assert(rx_mem.mem.len <= U32_MAX);
+    mmio_write32(dev->mmio_base + E1000_OFFSET_RDLEN, rx_mem.mem.len);
 
     // This indicates that all descriptors are available for the hardware to store packets.
     mmio_write64(dev->mmio_base + E1000_OFFSET_RDH, 1);
@@ -374,7 +342,6 @@ static struct result e1000_init_rx(struct e1000_device *dev)
 
     dev->rx_queue = rx_queue;
     dev->rx_queue_n_desc = rx_queue_n_desc;
-    dev->rx_buffers = byte_array_ptr(rx_buffers_mem);
     dev->rx_tail = 0;
 
     return result_ok();
@@ -414,7 +381,7 @@ static struct result e1000_tx_poll(struct e1000_device *dev, struct send_buf sb)
     if (!(tx_desc->status & E1000_TX_DESC_STATUS_DD))
         return result_error(ENOBUFS);
 
-    struct byte_buf tx_buf = byte_buf_new(&dev->tx_buffers[dev->tx_tail], 0, E1000_TX_BUF_SIZE);
+    struct byte_buf tx_buf = byte_buf_new(dma_pool_virt(&dev->tx_buffers, tx_desc->base_addr), 0, E1000_TX_BUF_SIZE);
     assert(!send_buf_assemble(sb, &tx_buf).is_error);
 
     tx_desc->length = (u16)len;
@@ -459,7 +426,7 @@ static struct result e1000_rx_poll(struct e1000_device *dev, struct byte_buf *bu
         return result_error(EIO);
 
     assert(rx_desc->length <= E1000_RX_BUF_SIZE);
-    struct byte_array rx_buf = byte_array_new(&dev->rx_buffers[next_tail], rx_desc->length);
+    struct byte_array rx_buf = byte_array_new(dma_pool_virt(&dev->rx_buffers, rx_desc->base_addr), rx_desc->length);
 
     byte_buf_append(buf, byte_view_from_array(rx_buf));
     byte_array_set(rx_buf, 0);
@@ -477,6 +444,26 @@ static struct result e1000_rx_poll(struct e1000_device *dev, struct byte_buf *bu
     return result_ok();
 }
 
+// Move all packets that were received into the input queue. Runs on the worker task, so interrupts stay enabled.
+static void e1000_rx_work(void *context)
+{
+    assert(context);
+    struct netdev *netdev = context;
+
+    assert(netdev->private_data);
+    struct e1000_device *dev = netdev->private_data;
+
+    while (1) {
+        struct byte_buf buf = byte_buf_from_array(dev->tmp_recv_buf);
+        struct result res = e1000_rx_poll(dev, &buf);
+        if (res.is_error && res.code == EAGAIN)
+            break; // Stop trying to receive any more data.
+        if (res.is_error)
+            crash("Failed to receive\n");
+        netdev_intr_receive(netdev, byte_view_from_buf(buf));
+    }
+}
+
 static void e1000_handle_interrupt(struct trap_frame *cpu_state __unused, void *private_data)
 {
     assert(private_data);
@@ -492,20 +479,17 @@ static void e1000_handle_interrupt(struct trap_frame *cpu_state __unused, void *
     dev->stats.n_rxdmt0_interrupts += cause & E1000_INTERRUPT_RXDMT0 ? 1 : 0;
     dev->stats.n_rxt0_interrupts += cause & E1000_INTERRUPT_RXT0 ? 1 : 0;
 
-    if (cause & E1000_INTERRUPT_RXO)
-        crash("Interrupt receive queue overrun\n");
-
-    if (cause & E1000_INTERRUPT_RXDMT0 || cause & E1000_INTERRUPT_RXT0) {
-        while (1) {
-            struct byte_buf buf = byte_buf_from_array(dev->tmp_recv_buf);
-            struct result res = e1000_rx_poll(dev, &buf);
-            if (res.is_error && res.code == EAGAIN)
-                break; // Stop trying to receive any more data.
-            if (res.is_error)
-                crash("Failed to receive\n");
-            netdev_intr_receive(netdev, byte_view_from_buf(buf));
-        }
+    // The receive ring was full, so the device dropped packets. That's packet loss like on the wire, and the protocols
+    // recover from it. Emptying the ring makes room for new packets.
+    if (cause & E1000_INTERRUPT_RXO) {
+        work_schedule(&dev->rx_work);
+        return;
     }
+
+    // Copying the packets out of the receive ring is left to the worker task. If the work is still pending from an
+    // earlier interrupt, it picks up the new packets too.
+    if (cause & E1000_INTERRUPT_RXDMT0 || cause & E1000_INTERRUPT_RXT0)
+        work_schedule(&dev->rx_work);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -577,6 +561,8 @@ static struct result e1000_probe(struct pci_device *pci)
     if (res.is_error)
         return res;
 
+    work_init(&dev->rx_work, e1000_rx_work, netdev);
+
     // NOTE: We DON'T register the `dev` (struct e1000_device) structure with the ISR handler. Instead, we register
     // the `netdev` structure that's also registered with the `netdev` subsystem so that, e.g., we can later retrieve
     // information about the IP address that was assigned to the network device.
@@ -4,6 +4,8 @@
 #include <tx/net/ethernet.h>
 #include <tx/net/netdev.h>
 #include <tx/print.h>
+#include <tx/sched.h>
+#include <tx/spinlock.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Device registration and lookup                                            //
@@ -151,6 +153,10 @@ static struct input_packet global_input_queue[NETDEV_INPUT_QUEUE_SIZE];
 static sz global_input_queue_tail;
 static sz global_input_queue_head;
 static bool global_input_queue_is_initialized;
+// Protects the head and tail indices. The head index is incremented in the receive interrupt handler, so the lock is
+// taken with interrupts disabled.
+static struct spinlock global_input_queue_lock;
+static struct wait_queue global_input_wait; // Tasks waiting for the queue to become non-empty.
 
 // NOTE: On the head and tail semantics of the queue. The head points to the next position where a new packet
 // will be stored. The tail points to the first stored packet that hasn't been processed yet. The queue is
@@ -182,6 +188,7 @@ struct result netdev_init_input_queue(void)
 
     global_input_queue_tail = 0;
     global_input_queue_head = 0;
+    wait_queue_init(&global_input_wait);
 
     global_input_queue_is_initialized = true;
 
@@ -191,8 +198,12 @@ struct result netdev_init_input_queue(void)
 static struct result netdev_intr_input_queue_add(struct mac_addr src, struct netdev *netdev, netdev_proto_t proto,
                                                  struct byte_view data)
 {
-    if ((global_input_queue_head + 1) % NETDEV_INPUT_QUEUE_SIZE == global_input_queue_tail)
+    u64 flags = spin_lock_irqsave(&global_input_queue_lock);
+
+    if ((global_input_queue_head + 1) % NETDEV_INPUT_QUEUE_SIZE == global_input_queue_tail) {
+        spin_unlock_irqrestore(&global_input_queue_lock, flags);
         return result_error(EAGAIN);
+    }
 
     struct input_packet *pkt = &global_input_queue[global_input_queue_head];
     pkt->src = src;
@@ -204,6 +215,10 @@ static struct result netdev_intr_input_queue_add(struct mac_addr src, struct net
 
     global_input_queue_head = (global_input_queue_head + 1) % NETDEV_INPUT_QUEUE_SIZE;
 
+    spin_unlock_irqrestore(&global_input_queue_lock, flags);
+
+    wake_up(&global_input_wait);
+
     return result_ok();
 }
 
@@ -246,38 +261,46 @@ struct input_packet *netdev_get_input(void)
 {
     assert(global_input_queue_is_initialized);
 
-    // We can't allow interrupts to fire while looking at the head index because the head index is incremented in
-    // the receive interrupt handler.
-    disable_interrupts();
+    u64 flags = spin_lock_irqsave(&global_input_queue_lock);
 
     if (global_input_queue_tail == global_input_queue_head) {
-        enable_interrupts();
+        spin_unlock_irqrestore(&global_input_queue_lock, flags);
         return NULL; // The queue is empty.
     }
 
-    // Interrupts can be enabled while processing the packet because the receive interrupt handler won't modify
+    // The lock can be released while processing the packet because the receive interrupt handler won't modify
     // the tail index.
-    enable_interrupts();
+    spin_unlock_irqrestore(&global_input_queue_lock, flags);
 
     return &global_input_queue[global_input_queue_tail];
 }
 
+static bool netdev_input_is_available(void *context __unused)
+{
+    return global_input_queue_tail != global_input_queue_head;
+}
+
+void netdev_wait_input(void)
+{
+    assert(global_input_queue_is_initialized);
+
+    // The condition is checked with interrupts disabled, so a packet that's received right before going to sleep
+    // isn't missed.
+    wait_event(&global_input_wait, netdev_input_is_available, NULL);
+}
+
 void netdev_release_input(struct input_packet *pkt)
 {
     assert(global_input_queue_is_initialized);
 
     assert(pkt == &global_input_queue[global_input_queue_tail]);
 
-    // We can't allow interrupts to fire while updating the tail index because the update depends on the state
-    // of the head index, but the head index is incremented in the receive interrupt handler.
-    disable_interrupts();
-
-    if (global_input_queue_tail == global_input_queue_head) {
-        enable_interrupts();
-        return;
-    }
+    // The update of the tail index depends on the state of the head index, which is incremented in the receive
+    // interrupt handler.
+    u64 flags = spin_lock_irqsave(&global_input_queue_lock);
 
-    global_input_queue_tail = (global_input_queue_tail + 1) % NETDEV_INPUT_QUEUE_SIZE;
+    if (global_input_queue_tail != global_input_queue_head)
+        global_input_queue_tail = (global_input_queue_tail + 1) % NETDEV_INPUT_QUEUE_SIZE;
 
-    enable_interrupts();
+    spin_unlock_irqrestore(&global_input_queue_lock, flags);
 }
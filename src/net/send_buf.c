@@ -26,7 +26,8 @@ struct byte_buf *send_buf_prepend(struct send_buf *sb, sz buf_size)
         return NULL;
 
     struct byte_buf *buf = &sb->parts[sb->n_used];
-    *buf = byte_buf_from_array(byte_array_from_arena(buf_size, &sb->arn));
+    // Parts are only appended to, so they don't need to be zeroed.
+    *buf = byte_buf_from_array(byte_array_from_arena_nozero(buf_size, &sb->arn));
     sb->n_used++;
 
     return buf;
@@ -1,5 +1,6 @@
 #include <tx/net/tcp.h>
 
+#include <tx/alloc_stats.h>
 #include <tx/asm.h>
 #include <tx/assert.h>
 #include <tx/byte.h>
@@ -7,7 +8,9 @@
 #include <tx/list.h>
 #include <tx/net/ip.h>
 #include <tx/net/netorder.h>
+#include <tx/pool.h>
 #include <tx/print.h>
+#include <tx/sched.h>
 #include <tx/time.h>
 
 struct tcp_header {
@@ -183,7 +186,7 @@ enum tcp_conn_state {
 #define TCP_CONN_RECV_WINDOW_SIZE 0x2000
 
 struct tcp_conn {
-    bool is_used;
+    struct dlist conn_list; // Entry in the list of all connections that are in use.
     struct ipv4_addr host_addr;
     struct ipv4_addr peer_addr;
     u16 host_port;
@@ -193,6 +196,12 @@ struct tcp_conn {
 
     struct dlist accept_queue;
 
+    // Tasks waiting for something to happen on the connection. They are woken up whenever a segment for the
+    // connection is handled. `accept_wait` points to the wait queue of the LISTEN connection this connection is
+    // accepted from, if any.
+    struct wait_queue wait;
+    struct wait_queue *accept_wait;
+
     // Transmission
     u32 send_unack; // SND.UNA
     u32 send_next; // SND.NXT
@@ -209,31 +218,58 @@ struct tcp_conn {
     struct time_ms time_wait_start;
 };
 
-// If we need to handle more connections at the same time, we could also allocate this array dynamically. The main
-// reason for using an array is that it's simple to search (without requiring much pointer chasing like linked lists
-// do).
-#define TCP_CONN_MAX_NUM 64
-static struct tcp_conn global_tcp_conn_table[TCP_CONN_MAX_NUM];
+// Connections are allocated from a pool that grows as needed. All connections that are in use are kept on a list
+// so they can be searched.
+#define TCP_CONNS_PER_SLAB 64
+static struct pool global_tcp_conn_pool;
+static struct dlist global_tcp_conn_list;
+static bool global_tcp_conn_pool_is_initialized = false;
+
+static void tcp_init_conn_pool(void)
+{
+    if (global_tcp_conn_pool_is_initialized)
+        return;
+
+    struct alloc slab_alloc = alloc_new(&global_tcp_conn_pool, kvalloc_alloc_wrapper, kvalloc_free_wrapper);
+    global_tcp_conn_pool = pool_new_growable(slab_alloc, sizeof(struct tcp_conn), TCP_CONNS_PER_SLAB);
+    alloc_stats_register_pool(STR("tcp_conn"), &global_tcp_conn_pool);
+    dlist_init_empty(&global_tcp_conn_list);
+    global_tcp_conn_pool_is_initialized = true;
+}
 
 static void tcp_free_conn(struct tcp_conn *conn)
 {
     assert(conn);
 
+    // Nobody may be waiting on a connection that's deleted.
+    assert(dlist_is_empty(&conn->wait.waiters));
+
+    // The connections that are still in the accept queue of a LISTEN connection must not wake it up any more.
+    if (conn->state == TCP_CONN_STATE_LISTEN) {
+        for (struct dlist *entry = conn->accept_queue.next; entry != &conn->accept_queue; entry = entry->next)
+            __container_of(entry, struct tcp_conn, accept_queue)->accept_wait = NULL;
+    }
+
     circ_buf_free(&conn->recv_buf);
     dlist_remove(&conn->accept_queue);
+    dlist_remove(&conn->conn_list);
 
     // Since we are reusing these, we want to make sure we don't accidentally reuse old data. Thus we set each
     // structure to an easy to recognize bit pattern.
     byte_array_set(byte_array_new((void *)conn, sizeof(*conn)), 0xee);
-    conn->is_used = false;
+    pool_free(&global_tcp_conn_pool, conn);
 }
 
 static inline void tcp_purge_old_conn(void)
 {
-    for (sz i = 0; i < TCP_CONN_MAX_NUM; i++) {
-        struct tcp_conn *conn = &global_tcp_conn_table[i];
+    tcp_init_conn_pool();
+
+    struct dlist *next = NULL;
+    for (struct dlist *entry = global_tcp_conn_list.next; entry != &global_tcp_conn_list; entry = next) {
+        next = entry->next; // `entry` might be freed.
+        struct tcp_conn *conn = __container_of(entry, struct tcp_conn, conn_list);
 
-        if (conn->is_used && conn->state == TCP_CONN_STATE_TIME_WAIT) {
+        if (conn->state == TCP_CONN_STATE_TIME_WAIT) {
             if (time_current_ms().ms >= conn->time_wait_start.ms) {
                 tcp_free_conn(conn);
             }
@@ -245,16 +281,14 @@ static struct tcp_conn *tcp_alloc_conn(void)
 {
     tcp_purge_old_conn();
 
-    for (sz i = 0; i < TCP_CONN_MAX_NUM; i++) {
-        struct tcp_conn *conn = &global_tcp_conn_table[i];
-
-        if (!conn->is_used) {
-            conn->is_used = true;
-            return conn;
-        }
-    }
+    struct tcp_conn *conn = pool_alloc(&global_tcp_conn_pool);
+    if (!conn)
+        return NULL;
 
-    return NULL;
+    dlist_init_empty(&conn->accept_queue);
+    dlist_init_empty(&conn->conn_list);
+    dlist_insert(&global_tcp_conn_list, &conn->conn_list);
+    return conn;
 }
 
 static bool ipv4_addr_wildcard_compare(struct ipv4_addr a, struct ipv4_addr b)
@@ -277,10 +311,8 @@ static struct tcp_conn *tcp_lookup_conn(struct ipv4_addr host_addr, struct ipv4_
 {
     tcp_purge_old_conn();
 
-    for (sz i = 0; i < TCP_CONN_MAX_NUM; i++) {
-        struct tcp_conn *conn = &global_tcp_conn_table[i];
-        if (!conn->is_used)
-            continue;
+    for (struct dlist *entry = global_tcp_conn_list.next; entry != &global_tcp_conn_list; entry = entry->next) {
+        struct tcp_conn *conn = __container_of(entry, struct tcp_conn, conn_list);
 
         if (use_peer_wildcards) {
             if (ipv4_addr_is_equal(host_addr, conn->host_addr) &&
@@ -346,6 +378,9 @@ static struct tcp_conn *tcp_conn_alloc_and_init(struct ipv4_addr host_addr, u16
 
     dlist_init_empty(&conn->accept_queue);
 
+    wait_queue_init(&conn->wait);
+    conn->accept_wait = NULL;
+
     conn->recv_next = 0;
     conn->recv_window = TCP_CONN_RECV_WINDOW_SIZE;
     conn->recv_buf.data = byte_array_new(NULL, 0);
@@ -568,6 +603,7 @@ static struct result tcp_handle_receive_listen(struct tcp_conn *listen_conn, str
     }
 
     dlist_insert(&listen_conn->accept_queue, &conn->accept_queue);
+    conn->accept_wait = &listen_conn->wait;
 
     conn->peer_addr = peer_addr;
     conn->peer_port = peer_port;
@@ -621,6 +657,10 @@ static struct result tcp_handle_receive_syn_rcvd(struct tcp_conn *conn, struct t
         STR("Received ACK for a connection in the SYN_RCVD state (%s). Not responding. The connection is ESTABLISHED now.\n"),
         tcp_conn_format(conn, &tmp));
 
+    // The connection can be accepted now.
+    if (conn->accept_wait)
+        wake_up(conn->accept_wait);
+
     return result_ok();
 }
 
@@ -921,6 +961,10 @@ struct result tcp_handle_packet(struct tcp_ip_pseudo_header pseudo_hdr, struct b
         tcp_handle_options(conn, tcp_options);
     }
 
+    // The connection may be deleted while handling the segment, so waiting tasks are woken up now. They run once
+    // the receiving task yields, which is after the segment was handled.
+    wake_up(&conn->wait);
+
     switch (conn->state) {
     case TCP_CONN_STATE_LISTEN:
         return tcp_handle_receive_listen(conn, peer_addr, peer_port, tcp_hdr, sb, tmp);
@@ -974,6 +1018,12 @@ struct tcp_conn *tcp_conn_listen(struct ipv4_addr addr, u16 port, struct arena t
     return conn;
 }
 
+bool tcp_conn_wait(struct tcp_conn *conn, struct time_ms timeout)
+{
+    assert(conn);
+    return wait_queue_sleep(&conn->wait, timeout);
+}
+
 struct tcp_conn *tcp_conn_accept(struct tcp_conn *listen_conn)
 {
     assert(listen_conn);
@@ -1,15 +1,22 @@
+#include <tx/alloc_stats.h>
 #include <tx/asm.h>
 #include <tx/assert.h>
+#include <tx/bench.h>
 #include <tx/fmt.h>
 #include <tx/paging.h>
 #include <tx/pool.h>
+#include <tx/smp.h>
+#include <tx/spinlock.h>
 
 // NOTE(VERY IMPORTANT): By default, all pointers use virtual addresses in the virtual
 // memory areas used by the kernel (high memory). These can be assumed to be safe to
 // dereference. Care should be taken when dealing with physical addresses and with
 // virtual addresses outside of kernel memory.
 
-// TODO(sync): Protect global variables.
+// The page table and the address mappings are protected by `global_paging_lock`. Pages are mapped by the page fault
+// handler, so the lock is taken with interrupts disabled. Page table pages may be allocated from kvalloc while the
+// lock is held, so kvalloc must not call into paging code while holding its own lock.
+static struct spinlock global_paging_lock;
 
 // Allocator used to allocate page table pages. It returns virtual memory addresses.
 // Initialized by `paging_init`.
@@ -22,44 +29,119 @@ static struct page_table global_page_table;
 ///////////////////////////////////////////////////////////////////////////////
 
 #define NUM_ADDR_MAPPINGS 32
-static struct addr_mapping global_addr_mappings[NUM_ADDR_MAPPINGS];
-static bool global_addr_mappings_used[NUM_ADDR_MAPPINGS];
+
+// The address mappings are kept in sorted arrays so that translations can use a binary search. Virtual address
+// regions never overlap, so all mappings are sorted by their `vbase`. Canonical mappings never overlap in physical
+// memory, so they are additionally sorted by their `pbase`. Alias mappings are only used to translate physical
+// addresses that aren't covered by a canonical mapping. There are few of them (e.g., for MMIO), so they're scanned.
+struct addr_mapping_table {
+    struct addr_mapping entries[NUM_ADDR_MAPPINGS];
+    sz n_entries;
+};
+
+static struct addr_mapping_table global_mappings_by_vaddr;
+static struct addr_mapping_table global_canonical_mappings_by_paddr;
+static struct addr_mapping_table global_alias_mappings;
 
 static inline bool intervals_overlap(sz a1, sz b1, sz a2, sz b2)
 {
     return a1 < b2 && a2 < b1;
 }
 
+static inline ptr addr_mapping_base(struct addr_mapping *mapping, bool by_paddr)
+{
+    return by_paddr ? mapping->pbase : mapping->vbase;
+}
+
+static void addr_mapping_table_insert(struct addr_mapping_table *table, struct addr_mapping mapping, bool by_paddr)
+{
+    assert(table);
+    assert(table->n_entries < NUM_ADDR_MAPPINGS);
+
+    sz i = table->n_entries;
+    for (; i > 0 && addr_mapping_base(&table->entries[i - 1], by_paddr) > addr_mapping_base(&mapping, by_paddr); i--)
+        table->entries[i] = table->entries[i - 1];
+    table->entries[i] = mapping;
+    table->n_entries++;
+}
+
+static bool addr_mapping_table_remove(struct addr_mapping_table *table, struct addr_mapping mapping)
+{
+    assert(table);
+
+    for (sz i = 0; i < table->n_entries; i++) {
+        struct addr_mapping *entry = &table->entries[i];
+        if (entry->vbase == mapping.vbase && entry->pbase == mapping.pbase && entry->len == mapping.len) {
+            for (sz j = i + 1; j < table->n_entries; j++)
+                table->entries[j - 1] = table->entries[j];
+            table->n_entries--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Find the mapping that contains `addr`. The entries in `table` must not overlap with respect to the kind of address
+// they are sorted by.
+static struct addr_mapping *addr_mapping_table_find(struct addr_mapping_table *table, ptr addr, bool by_paddr)
+{
+    assert(table);
+
+    // Find the last entry with a base that's less than or equal to `addr`.
+    sz lo = 0;
+    sz hi = table->n_entries;
+    while (lo < hi) {
+        sz mid = lo + (hi - lo) / 2;
+        if (addr_mapping_base(&table->entries[mid], by_paddr) <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    struct addr_mapping *mapping = &table->entries[lo - 1];
+    if (!IN_RANGE(addr, addr_mapping_base(mapping, by_paddr), mapping->len))
+        return NULL;
+
+    return mapping;
+}
+
 static struct result add_addr_mapping(struct addr_mapping new_mapping)
 {
     sz n_canonical = 0;
     sz n_alias = 0;
 
-    // Make sure there are no conflicts.
-    for (i32 i = 0; i < NUM_ADDR_MAPPINGS; i++) {
-        if (global_addr_mappings_used[i]) {
-            struct addr_mapping *mapping = &global_addr_mappings[i];
-            // Two different virtual addresses are allowed to point to the same physical address, but there cannot be
-            // two different virt-to-phys mappings for the same virtual address. This means that we don't accept
-            // overlapping virtual address regions for any kind of address mapping.
-            if (intervals_overlap(new_mapping.vbase, new_mapping.vbase + new_mapping.len, mapping->vbase,
-                                  mapping->vbase + mapping->len))
-                return result_error(EINVAL);
-
-            // For physical addresses, we just count how many overlapping canonical and alias mappings
-            // there are. See below for how these are used.
-            if (intervals_overlap(new_mapping.pbase, new_mapping.pbase + new_mapping.len, mapping->pbase,
-                                  mapping->pbase + mapping->len)) {
-                switch (mapping->type) {
-                case ADDR_MAPPING_TYPE_CANONICAL:
-                    n_canonical++;
-                    break;
-                case ADDR_MAPPING_TYPE_ALIAS:
-                    n_alias++;
-                    break;
-                default:
-                    crash("Invalid mapping type");
-                }
+    // Make sure there are no conflicts. Pages in the window for demand-paged memory aren't tracked as address
+    // mappings, so they must be checked separately.
+    if (intervals_overlap(new_mapping.vbase, new_mapping.vbase + new_mapping.len, KERN_VMEM_VADDR,
+                          KERN_VMEM_VADDR + KERN_VMEM_LEN))
+        return result_error(EINVAL);
+
+    for (sz i = 0; i < global_mappings_by_vaddr.n_entries; i++) {
+        struct addr_mapping *mapping = &global_mappings_by_vaddr.entries[i];
+        // Two different virtual addresses are allowed to point to the same physical address, but there cannot be
+        // two different virt-to-phys mappings for the same virtual address. This means that we don't accept
+        // overlapping virtual address regions for any kind of address mapping.
+        if (intervals_overlap(new_mapping.vbase, new_mapping.vbase + new_mapping.len, mapping->vbase,
+                              mapping->vbase + mapping->len))
+            return result_error(EINVAL);
+
+        // For physical addresses, we just count how many overlapping canonical and alias mappings
+        // there are. See below for how these are used.
+        if (intervals_overlap(new_mapping.pbase, new_mapping.pbase + new_mapping.len, mapping->pbase,
+                              mapping->pbase + mapping->len)) {
+            switch (mapping->type) {
+            case ADDR_MAPPING_TYPE_CANONICAL:
+                n_canonical++;
+                break;
+            case ADDR_MAPPING_TYPE_ALIAS:
+                n_alias++;
+                break;
+            default:
+                crash("Invalid mapping type");
             }
         }
     }
@@ -70,97 +152,105 @@ static struct result add_addr_mapping(struct addr_mapping new_mapping)
     if (!(n_canonical == 1 || (n_canonical == 0 && n_alias == 1) || (n_canonical == 0 && n_alias == 0)))
         return result_error(EINVAL);
 
+    // The invariant is checked against the existing mappings, so it doesn't catch a new canonical mapping that
+    // overlaps an existing one. This would make phys-to-virt translations ambiguous.
+    if (new_mapping.type == ADDR_MAPPING_TYPE_CANONICAL && n_canonical > 0)
+        return result_error(EINVAL);
+
+    if (global_mappings_by_vaddr.n_entries == NUM_ADDR_MAPPINGS)
+        return result_error(ENOMEM);
+
     // We now know the new mapping doesn't introduce any conflics. So let's create it!
-    for (i32 i = 0; i < NUM_ADDR_MAPPINGS; i++) {
-        if (!global_addr_mappings_used[i]) {
-            global_addr_mappings[i] = new_mapping;
-            global_addr_mappings_used[i] = true;
-            return result_ok();
-        }
-    }
+    addr_mapping_table_insert(&global_mappings_by_vaddr, new_mapping, false);
+    if (new_mapping.type == ADDR_MAPPING_TYPE_CANONICAL)
+        addr_mapping_table_insert(&global_canonical_mappings_by_paddr, new_mapping, true);
+    else
+        addr_mapping_table_insert(&global_alias_mappings, new_mapping, true);
 
-    return result_error(ENOMEM);
+    return result_ok();
 }
 
 static struct result remove_addr_mapping(struct addr_mapping mapping)
 {
-    for (i32 i = 0; i < NUM_ADDR_MAPPINGS; i++) {
-        if (global_addr_mappings_used[i] && global_addr_mappings[i].vbase == mapping.vbase &&
-            global_addr_mappings[i].pbase == mapping.pbase && global_addr_mappings[i].len == mapping.len) {
-            global_addr_mappings_used[i] = false;
-            return result_ok();
-        }
-    }
+    if (!addr_mapping_table_remove(&global_mappings_by_vaddr, mapping))
+        return result_error(EINVAL);
+
+    // Only one of them contains the mapping.
+    if (!addr_mapping_table_remove(&global_canonical_mappings_by_paddr, mapping))
+        assert(addr_mapping_table_remove(&global_alias_mappings, mapping));
 
-    return result_error(EINVAL);
+    return result_ok();
 }
 
 // NOTE: Multiple virtual addresses can point to the same physical address. This function returns the
 // virtual address (in high memory) that's used by the kernel to access the physical address. There may
 // be mappings that use a different virtual address to access the same physical page.
-struct result_vaddr_t phys_to_virt(paddr_t paddr)
+static struct result_vaddr_t phys_to_virt_lookup_locked(paddr_t paddr)
 {
     if (!paddr)
         return result_vaddr_t_ok(0); // To not have to check for NULL before calling this function.
 
-    struct addr_mapping *canonical = NULL;
-    struct addr_mapping *alias = NULL;
-    sz n_canonical = 0;
-    sz n_alias = 0;
+    // Use the unique canonical mapping.
+    struct addr_mapping *canonical = addr_mapping_table_find(&global_canonical_mappings_by_paddr, paddr, true);
+    if (canonical)
+        return result_vaddr_t_ok(canonical->vbase + (paddr - canonical->pbase));
 
-    for (i32 i = 0; i < NUM_ADDR_MAPPINGS; i++) {
-        if (global_addr_mappings_used[i]) {
-            struct addr_mapping *mapping = &global_addr_mappings[i];
-            if (IN_RANGE(paddr, mapping->pbase, mapping->len)) {
-                if (mapping->type == ADDR_MAPPING_TYPE_CANONICAL) {
-                    canonical = mapping;
-                    n_canonical++;
-                } else {
-                    alias = mapping;
-                    n_alias++;
-                }
-            }
-        }
+    // When there is no canonical mapping, the alias must be unique so we can use it.
+    for (sz i = 0; i < global_alias_mappings.n_entries; i++) {
+        struct addr_mapping *alias = &global_alias_mappings.entries[i];
+        if (IN_RANGE(paddr, alias->pbase, alias->len))
+            return result_vaddr_t_ok(alias->vbase + (paddr - alias->pbase));
     }
 
-    // Just check this invariant for safety.
-    assert(n_canonical == 1 || (n_canonical == 0 && n_alias == 1) || (n_canonical == 0 && n_alias == 0));
-
-    if (canonical)
-        return result_vaddr_t_ok(canonical->vbase + (paddr - canonical->pbase)); // Use the unique canonical mapping.
-    else if (alias)
-        return result_vaddr_t_ok(
-            alias->vbase +
-            (paddr - alias->pbase)); // When there is no canonical mapping, the alias must be unique so we can use it.
-
     return result_vaddr_t_error(EINVAL);
 }
 
-struct result_paddr_t virt_to_phys(vaddr_t vaddr)
+struct result_vaddr_t phys_to_virt_lookup(paddr_t paddr)
+{
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+    struct result_vaddr_t res = phys_to_virt_lookup_locked(paddr);
+    spin_unlock_irqrestore(&global_paging_lock, flags);
+    return res;
+}
+
+static struct result_paddr_t pt_translate(struct page_table page_table, vaddr_t vaddr);
+
+static struct result_paddr_t virt_to_phys_lookup_locked(vaddr_t vaddr)
 {
     if (!vaddr)
         return result_paddr_t_ok(0); // To not have to check for NULL before calling this function.
 
-    struct addr_mapping *candidate = NULL;
-    sz n_candidates = 0;
+    if (is_demand_paged_addr(vaddr))
+        return pt_translate(global_page_table, vaddr);
 
-    for (i32 i = 0; i < NUM_ADDR_MAPPINGS; i++) {
-        if (global_addr_mappings_used[i]) {
-            struct addr_mapping *mapping = &global_addr_mappings[i];
-            if (IN_RANGE(vaddr, mapping->vbase, mapping->len)) {
-                candidate = mapping;
-                n_candidates++;
-            }
-        }
-    }
+    struct addr_mapping *mapping = addr_mapping_table_find(&global_mappings_by_vaddr, vaddr, false);
+    if (mapping)
+        return result_paddr_t_ok(mapping->pbase + (vaddr - mapping->vbase));
 
-    // Just check this invariant for safety.
-    assert(n_candidates <= 1);
+    return result_paddr_t_error(EINVAL);
+}
 
-    if (candidate)
-        return result_paddr_t_ok(candidate->pbase + (vaddr - candidate->vbase));
+struct result_paddr_t virt_to_phys_lookup(vaddr_t vaddr)
+{
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+    struct result_paddr_t res = virt_to_phys_lookup_locked(vaddr);
+    spin_unlock_irqrestore(&global_paging_lock, flags);
+    return res;
+}
 
-    return result_paddr_t_error(EINVAL);
+// Like `phys_to_virt` and `virt_to_phys`, but for code that holds the lock.
+static inline struct result_vaddr_t phys_to_virt_locked(paddr_t paddr)
+{
+    if (IN_RANGE(paddr, KERN_DYN_PADDR, KERN_DYN_LEN))
+        return result_vaddr_t_ok(paddr - KERN_DYN_PADDR + KERN_DYN_VADDR);
+    return phys_to_virt_lookup_locked(paddr);
+}
+
+static inline struct result_paddr_t virt_to_phys_locked(vaddr_t vaddr)
+{
+    if (IN_RANGE(vaddr, KERN_DYN_VADDR, KERN_DYN_LEN))
+        return result_paddr_t_ok(vaddr - KERN_DYN_VADDR + KERN_DYN_PADDR);
+    return virt_to_phys_lookup_locked(vaddr);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -208,8 +298,9 @@ static struct pt *pt_get(struct pt *pt, sz idx)
     assert(0 <= idx && idx < countof(pt->entries));
 
     if (pt->entries[idx].bits & PT_FLAG_P) {
+        assert(!(pt->entries[idx].bits & PT_FLAG_PS)); // Large pages must be split first.
         paddr_t paddr = paddr_from_pte(pt->entries[idx]);
-        return (struct pt *)result_vaddr_t_checked(phys_to_virt(paddr));
+        return (struct pt *)result_vaddr_t_checked(phys_to_virt_locked(paddr));
     }
     return NULL;
 }
@@ -224,7 +315,7 @@ static struct pt *pt_get_or_alloc(struct pt *pt, sz idx, u16 perms)
         ret = pool_alloc(&global_pt_page_alloc);
         if (!ret)
             return NULL;
-        paddr_t paddr_ret = result_paddr_t_checked(virt_to_phys((vaddr_t)ret));
+        paddr_t paddr_ret = result_paddr_t_checked(virt_to_phys_locked((vaddr_t)ret));
         print_dbg(PVERBOSE, STR("Allocated page table page: vaddr=0x%lx paddr=0x%lx\n"), ret, paddr_ret);
         pt_insert(pt, idx, pte_from_paddr(paddr_ret, perms, ADDR_MAPPING_MEMORY_DEFAULT));
     } else {
@@ -240,24 +331,100 @@ static struct pt *pt_get_or_alloc(struct pt *pt, sz idx, u16 perms)
     return ret;
 }
 
-static struct result pt_map(struct page_table page_table, vaddr_t vaddr, paddr_t paddr, u16 perms,
-                            enum addr_mapping_memory_type mem_type)
+// Mappings can be made at three levels of the page table. At level 0, a PTE maps a 4 KiB page. At level 1, a PDE
+// maps a 2 MiB page and at level 2, a PDPTE maps a 1 GiB page. The PS flag marks PDEs and PDPTEs that map a page
+// (a "large page") instead of pointing to the next page table.
+#define PT_LEVEL_4K 0
+#define PT_LEVEL_2M 1
+#define PT_LEVEL_1G 2
+#define PT_LEVEL_PML4 3
+
+// Initialized by `paging_init`.
+static bool global_has_1g_pages = false;
+
+static inline u64 pt_level_bit_base(sz level)
 {
-    struct pt *pdpt = pt_get_or_alloc(page_table.pml4, PT_IDX(vaddr, PML4_BIT_BASE), perms);
-    if (!pdpt)
-        return result_error(ENOMEM);
-    struct pt *pd = pt_get_or_alloc(pdpt, PT_IDX(vaddr, PDPT_BIT_BASE), perms);
-    if (!pd)
-        return result_error(ENOMEM);
-    struct pt *pt = pt_get_or_alloc(pd, PT_IDX(vaddr, PD_BIT_BASE), perms);
-    if (!pd)
+    assert(PT_LEVEL_4K <= level && level <= PT_LEVEL_PML4);
+    return PT_BIT_BASE + 9 * level;
+}
+
+static inline sz pt_level_page_size(sz level)
+{
+    return BIT(pt_level_bit_base(level));
+}
+
+static inline bool pte_is_large(struct pte pte)
+{
+    return (pte.bits & (PT_FLAG_P | PT_FLAG_PS)) == (PT_FLAG_P | PT_FLAG_PS);
+}
+
+// Replace the large page that's mapped by the entry `idx` in `table` at `level` by a new page table. The new page
+// table maps the same memory using 512 pages of the next lower level.
+static struct result pt_split_large_page(struct pt *table, sz idx, sz level)
+{
+    assert(table);
+    assert(level == PT_LEVEL_2M || level == PT_LEVEL_1G);
+
+    struct pte large = table->entries[idx];
+    assert(pte_is_large(large));
+
+    struct pt *sub = pool_alloc(&global_pt_page_alloc);
+    if (!sub)
         return result_error(ENOMEM);
-    sz pt_idx = PT_IDX(vaddr, PT_BIT_BASE);
-    assert(0 <= pt_idx && pt_idx < countof(pt->entries));
+
+    // The new entries keep all flags of the large page. Only in PTEs, bit 7 isn't PS but the PAT bit.
+    u64 flags = large.bits & (BIT(12) - 1);
+    if (level - 1 == PT_LEVEL_4K)
+        flags &= ~PT_FLAG_PS;
+    paddr_t base = paddr_from_pte(large);
+    for (sz i = 0; i < NUM_PT_ENTRIES; i++)
+        sub->entries[i].bits = (base + i * pt_level_page_size(level - 1)) | flags;
+
+    paddr_t sub_paddr = result_paddr_t_checked(virt_to_phys_locked((vaddr_t)sub));
+    pt_insert(table, idx,
+              pte_from_paddr(sub_paddr, large.bits & (PT_FLAG_RW | PT_FLAG_US), ADDR_MAPPING_MEMORY_DEFAULT));
+
+    // The translations don't change, but the TLB must not keep entries for both the large and the small pages.
+    write_cr3(read_cr3());
+
+    print_dbg(PVERBOSE, STR("Split large page: level=%ld paddr=0x%lx\n"), level, base);
+
+    return result_ok();
+}
+
+// Map a single page of the given level.
+static struct result pt_map(struct page_table page_table, vaddr_t vaddr, paddr_t paddr, u16 perms,
+                            enum addr_mapping_memory_type mem_type, sz level)
+{
+    assert(IS_ALIGNED(vaddr, pt_level_page_size(level)));
+    assert(IS_ALIGNED(paddr, pt_level_page_size(level)));
+
+    struct pt *table = page_table.pml4;
+    for (sz l = PT_LEVEL_PML4; l > level; l--) {
+        sz idx = PT_IDX(vaddr, pt_level_bit_base(l));
+        if (pte_is_large(table->entries[idx])) {
+            struct result res = pt_split_large_page(table, idx, l);
+            if (res.is_error)
+                return res;
+        }
+        table = pt_get_or_alloc(table, idx, perms);
+        if (!table)
+            return result_error(ENOMEM);
+    }
+
+    sz idx = PT_IDX(vaddr, pt_level_bit_base(level));
+    assert(0 <= idx && idx < countof(table->entries));
     // NOTE: The reason we handle the memory type separate from the flags is that the flags are applied to
     // all page table pages along the way while the memory type is only applied to the final mapping. So the
     // flags are more like permissions.
-    pt->entries[pt_idx] = pte_from_paddr(paddr, perms, mem_type);
+    struct pte pte = pte_from_paddr(paddr, perms, mem_type);
+    if (level > PT_LEVEL_4K) {
+        // Replacing a page table with a large page would lose the mappings in the page table.
+        if ((table->entries[idx].bits & PT_FLAG_P) && !pte_is_large(table->entries[idx]))
+            return result_error(EEXIST);
+        pte.bits |= PT_FLAG_PS;
+    }
+    pt_insert(table, idx, pte);
     return result_ok();
 }
 
@@ -271,40 +438,133 @@ bool pt_is_empty(struct pt *pt)
     return true;
 }
 
-static struct result pt_unmap(struct page_table page_table, vaddr_t vaddr)
+// Remove the mapping of the page of the given level that contains `vaddr`. Large pages that contain the page
+// are split.
+static struct result pt_unmap(struct page_table page_table, vaddr_t vaddr, sz level)
 {
     if (!page_table.pml4)
         return result_error(EINVAL);
-    struct pt *pdpt = pt_get(page_table.pml4, PT_IDX(vaddr, PML4_BIT_BASE));
-    if (!pdpt)
-        return result_error(EINVAL);
-    struct pt *pd = pt_get(pdpt, PT_IDX(vaddr, PDPT_BIT_BASE));
-    if (!pd)
-        return result_error(EINVAL);
-    struct pt *pt = pt_get(pd, PT_IDX(vaddr, PD_BIT_BASE));
-    if (!pt)
-        return result_error(EINVAL);
-    sz pt_idx = PT_IDX(vaddr, PT_BIT_BASE);
-    assert(0 <= pt_idx && pt_idx < countof(pt->entries));
-    if (!(pt->entries[pt_idx].bits & PT_FLAG_P))
+
+    // `tables[l]` is the page table at level `l` that's used to translate `vaddr`.
+    struct pt *tables[PT_LEVEL_PML4 + 1];
+    tables[PT_LEVEL_PML4] = page_table.pml4;
+    for (sz l = PT_LEVEL_PML4; l > level; l--) {
+        sz idx = PT_IDX(vaddr, pt_level_bit_base(l));
+        if (pte_is_large(tables[l]->entries[idx])) {
+            struct result res = pt_split_large_page(tables[l], idx, l);
+            if (res.is_error)
+                return res;
+        }
+        tables[l - 1] = pt_get(tables[l], idx);
+        if (!tables[l - 1])
+            return result_error(EINVAL);
+    }
+
+    sz idx = PT_IDX(vaddr, pt_level_bit_base(level));
+    assert(0 <= idx && idx < countof(tables[level]->entries));
+    struct pte *pte = &tables[level]->entries[idx];
+    if (!(pte->bits & PT_FLAG_P))
         return result_error(EINVAL);
-    pt->entries[pt_idx].bits &= ~PT_FLAG_P;
-    print_dbg(PVERBOSE, STR("Removed entry: pt_idx=%ld\n"), pt_idx);
+    if (level > PT_LEVEL_4K && !pte_is_large(*pte))
+        return result_error(EINVAL); // This entry points to a page table, not to a page.
+    pte->bits &= ~PT_FLAG_P;
+    invlpg(vaddr);
+    print_dbg(PVERBOSE, STR("Removed entry: level=%ld idx=%ld\n"), level, idx);
+
+    // Free the page table pages that became empty.
+    for (sz l = level; l < PT_LEVEL_PML4 && pt_is_empty(tables[l]); l++) {
+        print_dbg(PVERBOSE, STR("Freeing page table page: level=%ld table=0x%lx\n"), l, tables[l]);
+        tables[l + 1]->entries[PT_IDX(vaddr, pt_level_bit_base(l + 1))].bits &= ~PT_FLAG_P;
+        pool_free(&global_pt_page_alloc, tables[l]);
+    }
 
-    if (pt_is_empty(pt)) {
-        print_dbg(PVERBOSE, STR("Freeing page table: pt=0x%lx\n"), pt);
-        pd->entries[PT_IDX(vaddr, PD_BIT_BASE)].bits &= ~PT_FLAG_P;
-        pool_free(&global_pt_page_alloc, pt);
+    return result_ok();
+}
+
+// Returns the level of the page that maps `vaddr` or -1 if `vaddr` isn't mapped.
+static sz pt_lookup_level(struct page_table page_table, vaddr_t vaddr)
+{
+    struct pt *table = page_table.pml4;
+    for (sz l = PT_LEVEL_PML4; l > PT_LEVEL_4K; l--) {
+        struct pte pte = table->entries[PT_IDX(vaddr, pt_level_bit_base(l))];
+        if (pte_is_large(pte))
+            return l;
+        table = pt_get(table, PT_IDX(vaddr, pt_level_bit_base(l)));
+        if (!table)
+            return -1;
     }
-    if (pt_is_empty(pd)) {
-        print_dbg(PVERBOSE, STR("Freeing page directory: pd=0x%lx\n"), pd);
-        pdpt->entries[PT_IDX(vaddr, PDPT_BIT_BASE)].bits &= ~PT_FLAG_P;
-        pool_free(&global_pt_page_alloc, pd);
+    return (table->entries[PT_IDX(vaddr, PT_BIT_BASE)].bits & PT_FLAG_P) ? PT_LEVEL_4K : -1;
+}
+
+// Translate `vaddr` using the page table.
+static struct result_paddr_t pt_translate(struct page_table page_table, vaddr_t vaddr)
+{
+    sz level = pt_lookup_level(page_table, vaddr);
+    if (level < 0)
+        return result_paddr_t_error(EINVAL);
+
+    struct pt *table = page_table.pml4;
+    for (sz l = PT_LEVEL_PML4; l > level; l--)
+        table = pt_get(table, PT_IDX(vaddr, pt_level_bit_base(l)));
+
+    struct pte pte = table->entries[PT_IDX(vaddr, pt_level_bit_base(level))];
+    if (level > PT_LEVEL_4K)
+        pte.bits &= ~BIT(12); // In large pages, this is the PAT bit and not part of the address.
+    return result_paddr_t_ok(paddr_from_pte(pte) + (vaddr & (pt_level_page_size(level) - 1)));
+}
+
+// Returns the biggest page level that can be used to map `vaddr` to `paddr` without mapping more than `len` bytes.
+static sz pt_max_level(vaddr_t vaddr, paddr_t paddr, sz len)
+{
+    sz max_level = global_has_1g_pages ? PT_LEVEL_1G : PT_LEVEL_2M;
+    for (sz level = max_level; level > PT_LEVEL_4K; level--) {
+        sz size = pt_level_page_size(level);
+        if (IS_ALIGNED(vaddr, size) && IS_ALIGNED(paddr, size) && len >= size)
+            return level;
     }
-    if (pt_is_empty(pdpt)) {
-        print_dbg(PVERBOSE, STR("Freeing page directory pointer table: pdpt=0x%lx\n"), pdpt);
-        page_table.pml4->entries[PT_IDX(vaddr, PML4_BIT_BASE)].bits &= ~PT_FLAG_P;
-        pool_free(&global_pt_page_alloc, pdpt);
+    return PT_LEVEL_4K;
+}
+
+// Map `len` bytes starting at `vaddr` to `paddr`. Large pages are used wherever the alignment of both addresses
+// allows it. Returns the number of bytes that were mapped before an error occurred in `mapped_len`.
+static struct result pt_map_range(struct page_table page_table, vaddr_t vaddr, paddr_t paddr, sz len, u16 perms,
+                                  enum addr_mapping_memory_type mem_type, sz *mapped_len)
+{
+    assert(IS_ALIGNED(vaddr, PAGE_SIZE) && IS_ALIGNED(paddr, PAGE_SIZE));
+    assert(mapped_len);
+
+    sz offset = 0;
+    while (offset < len) {
+        sz level = pt_max_level(vaddr + offset, paddr + offset, len - offset);
+        struct result res = pt_map(page_table, vaddr + offset, paddr + offset, perms, mem_type, level);
+        if (res.is_error) {
+            *mapped_len = offset;
+            return res;
+        }
+        offset += pt_level_page_size(level);
+    }
+
+    *mapped_len = offset;
+    return result_ok();
+}
+
+// Unmap `len` bytes starting at `vaddr`. Large pages that are only partially contained in the range are split.
+static struct result pt_unmap_range(struct page_table page_table, vaddr_t vaddr, sz len)
+{
+    assert(IS_ALIGNED(vaddr, PAGE_SIZE));
+
+    sz offset = 0;
+    while (offset < len) {
+        sz level = pt_lookup_level(page_table, vaddr + offset);
+        if (level < 0)
+            return result_error(EINVAL);
+        sz size = pt_level_page_size(level);
+        if (!IS_ALIGNED(vaddr + offset, size) || len - offset < size)
+            level = PT_LEVEL_4K;
+        struct result res = pt_unmap(page_table, vaddr + offset, level);
+        if (res.is_error)
+            return res;
+        offset += pt_level_page_size(level);
     }
 
     return result_ok();
@@ -339,7 +599,7 @@ __unused static struct result _pt_fmt(struct pt *pt, struct str_buf *buf, i16 le
                       (entry.bits & PT_FLAG_RW) ? 'w' : 'r', vaddr, paddr_from_pte(entry));
             if (res.is_error)
                 return res;
-            if (level < depth) {
+            if (level < depth && !(entry.bits & PT_FLAG_PS)) {
                 res = _pt_fmt((struct pt *)paddr_from_pte(entry), buf, level + 1, depth, vaddr);
                 if (res.is_error)
                     return res;
@@ -375,27 +635,47 @@ static bool cpu_has_pat(void)
     return (edx & BIT(16)) != 0;
 }
 
+static bool cpu_has_1g_pages(void)
+{
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001)
+        return false;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    return (edx & BIT(26)) != 0;
+}
+
+// Number of page table pages reserved for mappings that are created after `paging_init` (e.g., for MMIO).
+#define PAGING_EXTRA_PT_PAGES 64
+
 struct byte_array paging_init(struct addr_mapping code_addrs, struct addr_mapping dyn_addrs)
 {
     assert(PAGE_SIZE == 0x1000);
 
-    sz n_pages = ALIGN_UP(code_addrs.len + dyn_addrs.len, PAGE_SIZE) / PAGE_SIZE;
-    sz n_pts = ALIGN_UP(n_pages, NUM_PT_ENTRIES) / NUM_PT_ENTRIES;
-    sz n_pds = ALIGN_UP(n_pts, NUM_PT_ENTRIES) / NUM_PT_ENTRIES;
-    sz n_pdpts = ALIGN_UP(n_pds, NUM_PT_ENTRIES) / NUM_PT_ENTRIES;
-    sz n_pml4s = ALIGN_UP(n_pdpts, NUM_PT_ENTRIES) / NUM_PT_ENTRIES;
+    // Most of the memory is mapped with large pages. Page tables for 4 KiB pages are only needed at the unaligned
+    // start and end of both regions.
+    sz n_large_pages = ALIGN_UP(code_addrs.len + dyn_addrs.len, PDE_REGION_SIZE) / PDE_REGION_SIZE;
+    sz n_pts = 4;
+    sz n_pds = ALIGN_UP(n_large_pages, NUM_PT_ENTRIES) / NUM_PT_ENTRIES + 2;
+    sz n_pdpts = ALIGN_UP(n_pds, NUM_PT_ENTRIES) / NUM_PT_ENTRIES + 1;
+    sz n_pml4s = 1;
 
     // We reserve twice the number of page table pages required to map all available memory.
-    sz pt_bytes = 2 * PAGE_SIZE * (n_pts + n_pds + n_pdpts + n_pml4s);
+    sz pt_bytes = PAGE_SIZE * (2 * (n_pts + n_pds + n_pdpts + n_pml4s) + PAGING_EXTRA_PT_PAGES);
 
     assert(dyn_addrs.len / 200 > pt_bytes); // Make sure we don't accidentally waste tons of memory on page tables.
     assert(pt_bytes < 16 * 0x100000); // Ensure pt pages are inside the mapped region (see _start).
 
-    print_dbg(PINFO, STR("Paging with n_pages=%ld n_pts=%ld n_pds=%ld n_pdpts=%ld n_pml4s=%ld pt_bytes=0x%lx\n"),
-              n_pages, n_pts, n_pds, n_pdpts, n_pml4s, pt_bytes);
+    global_has_1g_pages = cpu_has_1g_pages();
+
+    print_dbg(PINFO, STR("Paging with n_large_pages=%ld n_pts=%ld n_pds=%ld n_pdpts=%ld pt_bytes=0x%lx 1g_pages=%d\n"),
+              n_large_pages, n_pts, n_pds, n_pdpts, pt_bytes, global_has_1g_pages);
 
     assert(cpu_has_pat()); // The cacheability controls implementation depends on this feature.
 
+    // The translation fast path in paging.h relies on the dynamic memory being mapped like this.
+    assert(dyn_addrs.vbase == KERN_DYN_VADDR && dyn_addrs.pbase == KERN_DYN_PADDR && dyn_addrs.len == KERN_DYN_LEN);
+
     global_pt_page_alloc = pool_new(byte_array_new((void *)dyn_addrs.vbase, pt_bytes), PAGE_SIZE);
     global_page_table.pml4 = pool_alloc(&global_pt_page_alloc);
     assert(global_page_table.pml4);
@@ -412,24 +692,24 @@ struct byte_array paging_init(struct addr_mapping code_addrs, struct addr_mappin
     assert(!add_addr_mapping(code_addrs).is_error);
     assert(!add_addr_mapping(dyn_addrs).is_error);
 
+    sz mapped_len = 0;
+
     // Code and data
-    for (sz offset = 0; offset < code_addrs.len; offset += PAGE_SIZE)
-        assert(!pt_map(global_page_table, code_addrs.vbase + offset, code_addrs.pbase + offset, PT_FLAG_RW,
-                       ADDR_MAPPING_MEMORY_DEFAULT)
-                    .is_error);
+    assert(!pt_map_range(global_page_table, code_addrs.vbase, code_addrs.pbase, code_addrs.len, PT_FLAG_RW,
+                         ADDR_MAPPING_MEMORY_DEFAULT, &mapped_len)
+                .is_error);
 
     // Dynamic memory
-    for (sz offset = 0; offset < dyn_addrs.len; offset += PAGE_SIZE)
-        assert(!pt_map(global_page_table, dyn_addrs.vbase + offset, dyn_addrs.pbase + offset, PT_FLAG_RW,
-                       ADDR_MAPPING_MEMORY_DEFAULT)
-                    .is_error);
+    assert(!pt_map_range(global_page_table, dyn_addrs.vbase, dyn_addrs.pbase, dyn_addrs.len, PT_FLAG_RW,
+                         ADDR_MAPPING_MEMORY_DEFAULT, &mapped_len)
+                .is_error);
 
     write_cr3(result_paddr_t_checked(virt_to_phys((vaddr_t)global_page_table.pml4)));
 
     return byte_array_new((byte *)dyn_addrs.vbase + pt_bytes, dyn_addrs.len - pt_bytes);
 }
 
-struct result paging_map_region(struct addr_mapping addrs)
+static struct result paging_map_region_locked(struct addr_mapping addrs)
 {
     struct result res = result_ok();
 
@@ -437,31 +717,143 @@ struct result paging_map_region(struct addr_mapping addrs)
     if (res.is_error)
         return res;
 
-    for (sz offset = 0; offset < addrs.len; offset += PAGE_SIZE) {
-        res = pt_map(global_page_table, addrs.vbase + offset, addrs.pbase + offset, addrs.perms, addrs.mem_type);
-        if (res.is_error) {
-            // Call unmap on all pages in case any of them have been mapped. Nothing bad will happen
-            // if we call unmap on a page that has never been mapped.
-            for (sz offset = 0; offset < addrs.len; offset += PAGE_SIZE)
-                pt_unmap(global_page_table, addrs.vbase + offset);
-            return res;
-        }
+    sz mapped_len = 0;
+    res = pt_map_range(global_page_table, addrs.vbase, addrs.pbase, addrs.len, addrs.perms, addrs.mem_type,
+                       &mapped_len);
+    if (res.is_error) {
+        // Undo the part of the mapping that was created successfully.
+        pt_unmap_range(global_page_table, addrs.vbase, mapped_len);
+        remove_addr_mapping(addrs);
+        return res;
     }
 
     return res;
 }
 
+struct result paging_map_region(struct addr_mapping addrs)
+{
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+    struct result res = paging_map_region_locked(addrs);
+    spin_unlock_irqrestore(&global_paging_lock, flags);
+    return res;
+}
+
 struct result paging_unmap_region(struct addr_mapping addrs)
 {
-    struct result res = result_ok();
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+
+    struct result res = pt_unmap_range(global_page_table, addrs.vbase, addrs.len);
+    if (!res.is_error)
+        res = remove_addr_mapping(addrs);
+
+    spin_unlock_irqrestore(&global_paging_lock, flags);
+
+    // `pt_unmap` only invalidates the TLB of the current CPU.
+    smp_flush_tlb_others();
+    return res;
+}
 
-    for (sz offset = 0; offset < addrs.len; offset += PAGE_SIZE) {
-        res = pt_unmap(global_page_table, addrs.vbase + offset);
+struct result paging_map_page(vaddr_t vaddr, paddr_t paddr)
+{
+    assert(is_demand_paged_addr(vaddr));
+    assert(IS_ALIGNED(vaddr, PAGE_SIZE));
+
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+
+    struct result res = result_error(EEXIST);
+    if (pt_lookup_level(global_page_table, vaddr) < 0)
+        res = pt_map(global_page_table, vaddr, paddr, PT_FLAG_RW, ADDR_MAPPING_MEMORY_DEFAULT, PT_LEVEL_4K);
+
+    spin_unlock_irqrestore(&global_paging_lock, flags);
+    return res;
+}
+
+struct result_paddr_t paging_unmap_page(vaddr_t vaddr)
+{
+    assert(is_demand_paged_addr(vaddr));
+    assert(IS_ALIGNED(vaddr, PAGE_SIZE));
+
+    u64 flags = spin_lock_irqsave(&global_paging_lock);
+
+    struct result_paddr_t paddr_res = pt_translate(global_page_table, vaddr);
+    if (!paddr_res.is_error) {
+        struct result res = pt_unmap(global_page_table, vaddr, PT_LEVEL_4K);
         if (res.is_error)
-            return res;
+            paddr_res = result_paddr_t_error(res.code);
     }
 
-    res = remove_addr_mapping(addrs);
+    spin_unlock_irqrestore(&global_paging_lock, flags);
 
-    return res;
+    // Other CPUs might still have the page in their TLBs. They must drop it before the caller frees the frame. Pages
+    // that weren't mapped can't be in any TLB.
+    if (!paddr_res.is_error)
+        smp_flush_tlb_others();
+    return paddr_res;
 }
+
+void paging_set_pt_page_alloc(struct alloc alloc)
+{
+    pool_set_growable(&global_pt_page_alloc, alloc, 1);
+    alloc_stats_register_pool(STR("page_table"), &global_pt_page_alloc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+#define PAGING_BENCH_N_OPS 100000
+
+// This is how translations were done before the mappings were sorted: scan all mappings and check that the
+// address is contained in at most one of them.
+static struct result_paddr_t virt_to_phys_scan(vaddr_t vaddr)
+{
+    struct addr_mapping *candidate = NULL;
+    sz n_candidates = 0;
+
+    for (sz i = 0; i < global_mappings_by_vaddr.n_entries; i++) {
+        struct addr_mapping *mapping = &global_mappings_by_vaddr.entries[i];
+        if (IN_RANGE(vaddr, mapping->vbase, mapping->len)) {
+            candidate = mapping;
+            n_candidates++;
+        }
+    }
+    assert(n_candidates <= 1);
+
+    if (candidate)
+        return result_paddr_t_ok(candidate->pbase + (vaddr - candidate->vbase));
+    return result_paddr_t_error(EINVAL);
+}
+
+void paging_run_benchmarks(void)
+{
+    // The sum keeps the compiler from removing the translations.
+    volatile paddr_t sum = 0;
+    vaddr_t dyn_vaddr = KERN_DYN_VADDR + KERN_DYN_LEN / 2;
+    vaddr_t code_vaddr = KERN_BASE_VADDR + PAGE_SIZE;
+
+    u64 start = rdtsc();
+    for (sz i = 0; i < PAGING_BENCH_N_OPS; i++)
+        sum += result_paddr_t_checked(virt_to_phys_scan(dyn_vaddr + i));
+    bench_report(STR("virt_to_phys linear scan"), start, PAGING_BENCH_N_OPS);
+
+    start = rdtsc();
+    for (sz i = 0; i < PAGING_BENCH_N_OPS; i++)
+        sum += result_paddr_t_checked(virt_to_phys_lookup(dyn_vaddr + i));
+    bench_report(STR("virt_to_phys_lookup (dynamic memory)"), start, PAGING_BENCH_N_OPS);
+
+    start = rdtsc();
+    for (sz i = 0; i < PAGING_BENCH_N_OPS; i++)
+        sum += result_paddr_t_checked(virt_to_phys_lookup(code_vaddr + i));
+    bench_report(STR("virt_to_phys_lookup (code)"), start, PAGING_BENCH_N_OPS);
+
+    start = rdtsc();
+    for (sz i = 0; i < PAGING_BENCH_N_OPS; i++)
+        sum += result_paddr_t_checked(virt_to_phys(dyn_vaddr + i));
+    bench_report(STR("virt_to_phys (dynamic memory)"), start, PAGING_BENCH_N_OPS);
+
+    start = rdtsc();
+    for (sz i = 0; i < PAGING_BENCH_N_OPS; i++)
+        sum += (paddr_t)result_vaddr_t_checked(phys_to_virt(KERN_DYN_PADDR + i));
+    bench_report(STR("phys_to_virt (dynamic memory)"), start, PAGING_BENCH_N_OPS);
+}
+
@@ -5,10 +5,18 @@
 #include <tx/fmt.h>
 #include <tx/print.h>
 #include <tx/sched.h>
+#include <tx/spinlock.h>
+
+// Keeps the output of different CPUs from being interleaved. Interrupt handlers print, too, so the lock is taken with
+// interrupts disabled.
+static struct spinlock global_print_lock;
 
 struct result print_str(struct str str)
 {
-    return com_write(COM1_PORT, str);
+    u64 flags = spin_lock_irqsave(&global_print_lock);
+    struct result res = com_write(COM1_PORT, str);
+    spin_unlock_irqrestore(&global_print_lock, flags);
+    return res;
 }
 
 struct result print_fmt(struct str_buf buf, struct str fmt, ...)
@@ -19,7 +27,7 @@ struct result print_fmt(struct str_buf buf, struct str fmt, ...)
     res = fmt_vfmt(&buf, fmt, argp);
     if (res.is_error)
         return res;
-    res = com_write(COM1_PORT, str_from_buf(buf));
+    res = print_str(str_from_buf(buf));
     va_end(argp);
     return res;
 }
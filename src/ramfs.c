@@ -276,23 +276,28 @@ struct ram_fs *ram_fs_new(struct alloc alloc)
     if (!rfs)
         return NULL;
 
-    sz node_mem_size = RAM_FS_MAX_NODES_NUM * sizeof(struct ram_fs_node);
-    void *node_mem = alloc_alloc(alloc, node_mem_size, alignof(struct ram_fs_node));
-    if (!node_mem)
-        return NULL;
-    rfs->node_alloc = pool_new(byte_array_new(node_mem, node_mem_size), sizeof(struct ram_fs_node));
+    rfs->node_alloc = pool_new_growable(alloc, sizeof(struct ram_fs_node), RAM_FS_NODES_PER_SLAB);
 
     sz scratch_mem_size = 4 * PATH_NAME_MAX_LEN;
     void *scratch_mem = alloc_alloc(alloc, scratch_mem_size, alignof(void *));
-    if (!scratch_mem)
+    if (!scratch_mem) {
+        alloc_free(alloc, rfs, sizeof(*rfs));
         return NULL;
+    }
     rfs->scratch = arena_new(byte_array_new(scratch_mem, scratch_mem_size));
 
     rfs->data_alloc = alloc;
+    spin_lock_init(&rfs->lock);
 
     // The root must exists from the beginning as `ram_fs_create_common` needs it but can't create it itself.
     struct ram_fs_node *root_dir = pool_alloc(&rfs->node_alloc);
-    assert(root_dir); // We just created the pool so there's surely enough memory.
+    if (!root_dir) {
+        // The pool failed to get its first slab, so it holds no memory that would need to be freed.
+        assert(rfs->node_alloc.n_slabs == 0);
+        alloc_free(alloc, scratch_mem, scratch_mem_size);
+        alloc_free(alloc, rfs, sizeof(*rfs));
+        return NULL;
+    }
     root_dir->first = NULL;
     root_dir->next = NULL;
     root_dir->type = RAM_FS_TYPE_DIR;
@@ -308,21 +313,33 @@ struct ram_fs *ram_fs_new(struct alloc alloc)
 struct result_ram_fs_node ram_fs_create_dir(struct ram_fs_node *root, struct str dirpath, bool recursive)
 {
     assert(root);
-    return ram_fs_create_common(root, dirpath, RAM_FS_TYPE_DIR, recursive, root->fs->scratch);
+
+    spin_lock(&root->fs->lock);
+    struct result_ram_fs_node node_res =
+        ram_fs_create_common(root, dirpath, RAM_FS_TYPE_DIR, recursive, root->fs->scratch);
+    spin_unlock(&root->fs->lock);
+    return node_res;
 }
 
 struct result_ram_fs_node ram_fs_create_file(struct ram_fs_node *root, struct str filepath, bool recursive)
 {
     assert(root);
+
+    spin_lock(&root->fs->lock);
     struct result_ram_fs_node node_res =
         ram_fs_create_common(root, filepath, RAM_FS_TYPE_FILE, recursive, root->fs->scratch);
-    if (node_res.is_error)
+    if (node_res.is_error) {
+        spin_unlock(&root->fs->lock);
         return node_res;
+    }
     struct ram_fs_node *node = result_ram_fs_node_checked(node_res);
     void *data = alloc_alloc(root->fs->data_alloc, RAM_FS_DEFAULT_FILE_SIZE, alignof(void *));
-    if (!data)
+    if (!data) {
+        spin_unlock(&root->fs->lock);
         return result_ram_fs_node_error(ENOMEM);
+    }
     node->data = byte_buf_new(data, 0, RAM_FS_DEFAULT_FILE_SIZE);
+    spin_unlock(&root->fs->lock);
     return result_ram_fs_node_ok(node);
 }
 
@@ -330,17 +347,17 @@ struct result_ram_fs_node ram_fs_open(struct ram_fs_node *root, struct str filen
 {
     assert(root);
 
+    spin_lock(&root->fs->lock);
     struct arena scratch = root->fs->scratch;
     struct result_path_name path_res = path_name_parse(filename, &scratch);
-    if (path_res.is_error)
+    if (path_res.is_error) {
+        spin_unlock(&root->fs->lock);
         return result_ram_fs_node_error(path_res.code);
+    }
 
     struct path_name path = result_path_name_checked(path_res);
-
-    if (path.n_components == 0)
-        return result_ram_fs_node_ok(root);
-
-    struct ram_fs_node *node = ram_fs_node_lookup(root, path);
+    struct ram_fs_node *node = path.n_components ? ram_fs_node_lookup(root, path) : root;
+    spin_unlock(&root->fs->lock);
     if (!node)
         return result_ram_fs_node_error(ENOENT);
 
@@ -355,21 +372,21 @@ struct result_sz ram_fs_read(struct ram_fs_node *rfs_node, struct byte_buf *bbuf
     if (rfs_node->type != RAM_FS_TYPE_FILE)
         return result_sz_error(EINVAL);
 
-    if (offset > rfs_node->data.len)
+    spin_lock(&rfs_node->fs->lock);
+    if (offset > rfs_node->data.len) {
+        spin_unlock(&rfs_node->fs->lock);
         return result_sz_error(EINVAL);
-    if (offset == rfs_node->data.len)
-        return result_sz_ok(0);
+    }
 
     sz avail = rfs_node->data.len - offset;
     sz n_appended = byte_buf_append(bbuf, byte_view_new(rfs_node->data.dat + offset, avail));
+    spin_unlock(&rfs_node->fs->lock);
 
     return result_sz_ok(n_appended);
 }
 
-struct result_sz ram_fs_write(struct ram_fs_node *rfs_node, struct byte_view bview, sz offset)
+static struct result_sz ram_fs_write_locked(struct ram_fs_node *rfs_node, struct byte_view bview, sz offset)
 {
-    assert(rfs_node);
-
     if (rfs_node->type != RAM_FS_TYPE_FILE)
         return result_sz_error(EINVAL);
 
@@ -412,6 +429,16 @@ struct result_sz ram_fs_write(struct ram_fs_node *rfs_node, struct byte_view bvi
     return result_sz_ok(write_len);
 }
 
+struct result_sz ram_fs_write(struct ram_fs_node *rfs_node, struct byte_view bview, sz offset)
+{
+    assert(rfs_node);
+
+    spin_lock(&rfs_node->fs->lock);
+    struct result_sz res = ram_fs_write_locked(rfs_node, bview, offset);
+    spin_unlock(&rfs_node->fs->lock);
+    return res;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Tests                                                                     //
 ///////////////////////////////////////////////////////////////////////////////
@@ -992,14 +1019,25 @@ static void test_ram_fs_e2e(struct arena arn)
 
 void ram_fs_run_tests(struct arena arn)
 {
-    test_path_name_parse(arn);
-    test_path_name_to_str(arn);
-    test_ram_fs_node_lookup(arn);
-    test_ram_fs_create_dir(arn);
-    test_ram_fs_create_file(arn);
-    test_ram_fs_open(arn);
-    test_ram_fs_read(arn);
-    test_ram_fs_write(arn);
-    test_ram_fs_e2e(arn);
+    void (*tests[])(struct arena) = {
+        test_path_name_parse,
+        test_path_name_to_str,
+        test_ram_fs_node_lookup,
+        test_ram_fs_create_dir,
+        test_ram_fs_create_file,
+        test_ram_fs_open,
+        test_ram_fs_read,
+        test_ram_fs_write,
+        test_ram_fs_e2e,
+    };
+
+    // Each test gets a fresh copy of the arena. If `arn` is growable, restoring the mark after a test
+    // gives back the memory that the test added to the arena.
+    struct arena_mark mark = arena_mark(&arn);
+    for (sz i = 0; i < (sz)countof(tests); i++) {
+        tests[i](arn);
+        arena_restore(&arn, mark);
+    }
+
     print_dbg(PINFO, STR("RAM fs selftest passed\n"));
 }
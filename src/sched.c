@@ -1,164 +1,918 @@
+#include <config.h>
+#include <tx/asm.h>
+#include <tx/bench.h>
 #include <tx/kvalloc.h>
+#include <tx/print.h>
 #include <tx/sched.h>
+#include <tx/smp.h>
+#include <tx/spinlock.h>
+#include <tx/string.h>
+
+// Every CPU has its own run queues, so CPUs only contend for them when one of them steals a task from another. The
+// rest of the scheduler state is shared: the list of all tasks, the sleep queue, the wait queues and the kernel lock
+// are protected by the global scheduler lock. The run queues of a CPU are protected by the lock of that CPU. If both
+// are needed, the global lock is taken first, and no CPU ever holds the locks of two CPUs. `wake_up` and the timer
+// interrupt touch the same state as tasks do, so both kinds of locks are only taken with interrupts disabled.
+//
+// A task that isn't running is in one of three places:
+//  - On the run queue of a CPU if it's ready to run.
+//  - On the sleep queue if it waits until some time. It can be on a wait queue at the same time.
+//  - Only on a wait queue if it waits without a timeout.
+//
+// A task that sleeps or waits marks itself as blocked while it holds the global lock. Only blocked tasks are put on a
+// run queue when they are woken up. The task that was woken up might still be switching away on its CPU, so the CPU
+// that woke it up waits until `on_cpu` is cleared before it puts the task on a run queue. That way, a task that's on
+// a run queue can always be switched to right away.
 
 static bool global_sched_initialized;
+static struct spinlock global_sched_lock;
 
 static struct sched_task global_main_task; // Main task.
 static u16 global_next_id; // ID to use for the next task that's registered.
-static struct sched_task *global_current_task; // Task that's currently executing.
-static struct dlist global_sleep_list; // List of all sleeping tasks.
+static sz global_n_tasks; // Number of tasks that exist, including the main task.
+static struct dlist global_tasks; // List of all tasks that exist.
 
-void sched_init(void)
+static struct sched_task *global_kernel_lock_owner; // Task that holds the kernel lock (see `kernel_lock`).
+static struct wait_queue global_kernel_lock_waiters; // Tasks waiting for the kernel lock.
+
+static u64 global_sched_start_tsc; // Time when the scheduler was initialized.
+
+// Length of a time slice if preemption is enabled.
+#define SCHED_QUANTUM_MS 10
+
+// The PIC only delivers interrupts to the BSP, so the PIT that wakes up sleeping tasks is handled there.
+#define SCHED_TIMER_CPU 0
+
+static u64 global_timer_deadline_ms = U64_MAX; // What the PIT is armed for. `U64_MAX` if it isn't.
+
+#define SCHED_TRACE_N_EVENTS (__SCHED_TRACE__ ? 4096 : 1)
+#define SCHED_TRACE_IDLE_ID U16_MAX // ID of the idle tasks.
+
+struct sched_trace_event {
+    u64 tsc;
+    u16 prev_id;
+    u16 next_id;
+};
+
+struct sched_cpu {
+    bool is_active; // The CPU runs tasks. Set once and never cleared.
+    struct sched_task idle_task; // Runs when no other task is ready.
+    struct sched_task *current; // Task that's currently executing on the CPU.
+    enum sched_priority current_priority; // Priority of `current`. Read by other CPUs without a lock.
+
+    // Protects the run queues. The other members are only modified by the CPU itself.
+    struct spinlock lock;
+    struct dlist run_queues[SCHED_N_PRIORITIES];
+    sz n_ready; // Number of tasks on the run queues. Read by other CPUs without a lock to find tasks to steal.
+
+    // Passed from the task that switches away to the task that's switched to (see `sched_finish_switch`).
+    struct sched_task *prev;
+    bool requeue_prev; // Put `prev` back on a run queue once it's switched out.
+    struct sched_task *finished; // Task that finished but whose memory wasn't freed yet.
+
+    u64 slice_start_tsc; // Time when the current task was switched to.
+    bool need_resched; // The time slice of the current task ran out or a task with a higher priority is ready.
+
+    // Statistics. Time is measured in TSC ticks.
+    u64 start_tsc; // Time when the CPU started running tasks.
+    u64 idle_tsc; // Time spent halted because no task was ready.
+    u64 n_halts;
+    u64 n_switches; // Switches to tasks other than the idle task.
+    u64 n_preemptions;
+    u64 n_steals; // Tasks taken from the run queues of other CPUs.
+
+    struct sched_trace_event trace[SCHED_TRACE_N_EVENTS];
+    u64 trace_n_events; // Number of events recorded so far. Only the last `SCHED_TRACE_N_EVENTS` are kept.
+};
+
+static struct sched_cpu global_sched_cpus[SMP_MAX_CPUS];
+static bool global_trace_is_paused; // Nothing is recorded while the trace is dumped.
+
+// Returns the scheduler state of the current CPU. Must be called with interrupts disabled, because a task can be
+// moved to another CPU whenever it's preempted.
+static inline struct sched_cpu *sched_this_cpu(void)
 {
-    assert(!global_sched_initialized);
+    return &global_sched_cpus[cpu_current()->id];
+}
 
-    byte_array_set(byte_array_new((void *)&global_main_task, sizeof(global_main_task)), 0);
-    global_main_task.id = global_next_id++;
-    global_current_task = &global_main_task;
+static inline sz sched_cpu_id(struct sched_cpu *rq)
+{
+    return rq - global_sched_cpus;
+}
 
-    dlist_init_empty(&global_sleep_list);
+static inline bool sched_cpu_is_active(struct sched_cpu *rq)
+{
+    return __atomic_load_n(&rq->is_active, __ATOMIC_ACQUIRE);
+}
 
-    global_sched_initialized = true;
+static inline bool sched_cpu_is_idle(struct sched_cpu *rq)
+{
+    return __atomic_load_n(&rq->current, __ATOMIC_RELAXED) == &rq->idle_task;
+}
+
+// Returns the task that's running on the current CPU. Must be called with interrupts disabled.
+static inline struct sched_task *sched_current(void)
+{
+    return sched_this_cpu()->current;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Sleep list                                                                //
+// Accounting and tracing                                                    //
 ///////////////////////////////////////////////////////////////////////////////
 
-// Add a task to the sleep list. Ensures that the first task in the sleep list has the lowest wake time. I.e., the
-// first task in the sleep list is the first to become ready.
-static void sched_add_sleeping(struct sched_task *new_task)
+// Every switch between tasks is timestamped with the TSC. The time between being switched to and switching away is
+// added to a task's run time, and the time between being put on a run queue and being switched to is added to its
+// wait time. While no task is ready, the CPU runs its idle task, so halted time isn't added to any other task.
+//
+// With `SCHED_TRACE=1`, the switches are also recorded in a ring buffer per CPU (see `sched_dump_trace`).
+
+// Must be called with interrupts disabled.
+static inline void sched_trace_switch(struct sched_cpu *rq, u64 tsc, u16 prev_id, u16 next_id)
 {
-    struct dlist *list = global_sleep_list.next;
-    struct sched_task *task = NULL;
+    if (!__SCHED_TRACE__ || __atomic_load_n(&global_trace_is_paused, __ATOMIC_RELAXED))
+        return;
 
-    while (list != &global_sleep_list) {
-        task = __container_of(list, struct sched_task, sleep_list);
+    struct sched_trace_event *event = &rq->trace[rq->trace_n_events++ % SCHED_TRACE_N_EVENTS];
+    event->tsc = tsc;
+    event->prev_id = prev_id;
+    event->next_id = next_id;
+}
 
-        if (task->wake_time.ms > new_task->wake_time.ms) {
-            dlist_insert(task->sleep_list.prev, &new_task->sleep_list);
-            return;
-        }
+// Account for a switch from `prev` to `next` on the CPU of `rq`. Must be called with interrupts disabled.
+static inline void sched_account_switch(struct sched_cpu *rq, struct sched_task *prev, struct sched_task *next)
+{
+    u64 now = time_current_tsc();
+    prev->run_tsc += now - prev->last_tsc;
+    next->wait_tsc += now - next->ready_tsc;
+    next->last_tsc = now;
+    next->n_switches++;
+    sched_trace_switch(rq, now, prev->id, next->id);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run queues                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// Tasks that are ready to run are kept in FIFO order, with one queue per priority and CPU. Adding and removing tasks
+// takes constant time, and no time is read to decide which task runs next.
+//
+// The queues of a CPU are served strictly by priority: a task only runs if no task with a higher priority is ready on
+// the same CPU. A task that becomes ready goes to the CPU it ran on last, unless that CPU is busy and another one is
+// idle. A CPU whose run queues are empty steals the oldest task with the highest priority from another CPU before it
+// goes idle.
+
+// Index of the run queue for `priority`. The queue for the highest priority comes first.
+#define SCHED_RUN_QUEUE_IDX(priority) (SCHED_PRIORITY_HIGH - (priority))
+static_assert(SCHED_N_PRIORITIES == SCHED_PRIORITY_HIGH - SCHED_PRIORITY_LOW + 1);
+
+static inline bool sched_is_queued(struct sched_task *task)
+{
+    return !dlist_is_empty(&task->run_list);
+}
+
+// Must be called with the lock of `rq` held.
+static inline void sched_run_queue_push(struct sched_cpu *rq, struct sched_task *task)
+{
+    assert(!sched_is_queued(task));
+    task->ready_tsc = time_current_tsc();
+    struct dlist *queue = &rq->run_queues[SCHED_RUN_QUEUE_IDX(task->priority)];
+    dlist_insert(queue->prev, &task->run_list);
+    __atomic_store_n(&rq->n_ready, rq->n_ready + 1, __ATOMIC_RELAXED);
+}
+
+// Returns the task with the highest priority that was ready the longest if its priority is at least `min_priority`.
+// Returns `NULL` otherwise. Must be called with the lock of `rq` held.
+static inline struct sched_task *sched_run_queue_pop(struct sched_cpu *rq, enum sched_priority min_priority)
+{
+    for (sz i = 0; i <= SCHED_RUN_QUEUE_IDX(min_priority); i++) {
+        struct dlist *queue = &rq->run_queues[i];
+        if (dlist_is_empty(queue))
+            continue;
+        struct sched_task *task = __container_of(queue->next, struct sched_task, run_list);
+        dlist_remove(&task->run_list);
+        __atomic_store_n(&rq->n_ready, rq->n_ready - 1, __ATOMIC_RELAXED);
+        return task;
+    }
+    return NULL;
+}
+
+// Like `sched_run_queue_pop` but takes the lock of `rq`. Must be called with interrupts disabled.
+static struct sched_task *sched_pop(struct sched_cpu *rq, enum sched_priority min_priority)
+{
+    spin_lock_raw(&rq->lock);
+    struct sched_task *task = sched_run_queue_pop(rq, min_priority);
+    spin_unlock_raw(&rq->lock);
+    return task;
+}
+
+// Returns a CPU that runs its idle task and has nothing to do, or `NULL` if there is none.
+static struct sched_cpu *sched_find_idle_cpu(void)
+{
+    for (sz i = 0; i < SMP_MAX_CPUS; i++) {
+        struct sched_cpu *rq = &global_sched_cpus[i];
+        if (sched_cpu_is_active(rq) && sched_cpu_is_idle(rq) && !__atomic_load_n(&rq->n_ready, __ATOMIC_RELAXED))
+            return rq;
+    }
+    return NULL;
+}
+
+// Put a task that's ready to run on a run queue. An idle CPU that gets the task is woken up with an IPI. If the task
+// has a higher priority than the one running on its CPU, the running task is preempted as soon as possible. Must be
+// called with interrupts disabled.
+static void sched_enqueue(struct sched_task *task)
+{
+    struct sched_cpu *rq = &global_sched_cpus[task->cpu];
+    if (!sched_cpu_is_idle(rq)) {
+        struct sched_cpu *idle = sched_find_idle_cpu();
+        if (idle)
+            rq = idle;
+    }
+    task->cpu = sched_cpu_id(rq);
+
+    spin_lock_raw(&rq->lock);
+    sched_run_queue_push(rq, task);
+    // This is read while the lock is held. An idle CPU takes the lock after it switched to its idle task and before it
+    // checks its run queues, so either it finds the task or it's seen as idle here.
+    bool is_idle = sched_cpu_is_idle(rq);
+    bool should_preempt = __PREEMPT__ && !is_idle && task->priority > rq->current_priority;
+    if (should_preempt)
+        __atomic_store_n(&rq->need_resched, true, __ATOMIC_RELAXED);
+    spin_unlock_raw(&rq->lock);
+
+    if ((is_idle || should_preempt) && rq != sched_this_cpu())
+        smp_send_resched(sched_cpu_id(rq));
+}
+
+// Take a ready task from the run queues of another CPU. Returns `NULL` if no other CPU has a task that's ready. Must
+// be called with interrupts disabled.
+static struct sched_task *sched_steal(struct sched_cpu *rq)
+{
+    sz id = sched_cpu_id(rq);
+    for (sz i = 1; i < SMP_MAX_CPUS; i++) {
+        struct sched_cpu *victim = &global_sched_cpus[(id + i) % SMP_MAX_CPUS];
+        if (!sched_cpu_is_active(victim) || !__atomic_load_n(&victim->n_ready, __ATOMIC_RELAXED))
+            continue;
+        struct sched_task *task = sched_pop(victim, SCHED_PRIORITY_LOW);
+        if (!task)
+            continue;
+        task->cpu = id;
+        rq->n_steals++;
+        return task;
+    }
+    return NULL;
+}
+
+// Returns the task that runs next when the current task blocks: a task from the run queues of the CPU, a task that's
+// stolen from another CPU or the idle task. Must be called with interrupts disabled.
+static struct sched_task *sched_pick_next(struct sched_cpu *rq)
+{
+    struct sched_task *next = sched_pop(rq, SCHED_PRIORITY_LOW);
+    if (!next)
+        next = sched_steal(rq);
+    return next ? next : &rq->idle_task;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sleep queue                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+// Tasks that wait until some time are kept in a binary min-heap ordered by wake time. Adding and removing tasks
+// takes O(log n) time and the task that should wake up first is always at the root. The PIT is armed for the wake
+// time of the root. When it fires, the tasks whose wake time has passed are moved to a run queue. The heap is
+// protected by the global lock.
+//
+// The heap never grows while tasks are put to sleep or woken up (this happens in interrupt handlers, too). Instead,
+// space for every task is reserved when the task is created.
+
+#define SCHED_SLEEP_QUEUE_MIN_CAP 16
+
+static struct sched_task **global_sleep_queue;
+static sz global_sleep_queue_len;
+static sz global_sleep_queue_cap;
+static u64 global_next_sleep_seq;
+
+// Make sure there is room for `n_tasks` sleeping tasks. Must be called with interrupts enabled and without holding
+// the global lock.
+static struct result sched_reserve_sleeping(sz n_tasks)
+{
+    u64 flags = save_and_disable_interrupts();
+    spin_lock_raw(&global_sched_lock);
+    sz cap = global_sleep_queue_cap;
+    spin_unlock_raw(&global_sched_lock);
+    restore_interrupts(flags);
+    if (n_tasks <= cap)
+        return result_ok();
+
+    sz new_cap = MAX(cap * 2, SCHED_SLEEP_QUEUE_MIN_CAP);
+    new_cap = MAX(new_cap, n_tasks);
+
+    struct option_byte_array mem_opt = kvalloc_alloc(new_cap * sizeof(*global_sleep_queue), alignof(void *));
+    if (mem_opt.is_none)
+        return result_error(ENOMEM);
+    struct sched_task **new_queue = byte_array_ptr(option_byte_array_checked(mem_opt));
+
+    flags = save_and_disable_interrupts();
+    spin_lock_raw(&global_sched_lock);
+    struct sched_task **old_queue = global_sleep_queue;
+    sz old_cap = global_sleep_queue_cap;
+    // Another CPU might have grown the heap in the meantime.
+    if (new_cap > old_cap) {
+        if (old_queue)
+            byte_copy((byte *)new_queue, (byte *)old_queue, global_sleep_queue_len * sizeof(*global_sleep_queue));
+        global_sleep_queue = new_queue;
+        global_sleep_queue_cap = new_cap;
+    } else {
+        old_queue = new_queue;
+        old_cap = new_cap;
+    }
+    spin_unlock_raw(&global_sched_lock);
+    restore_interrupts(flags);
+
+    if (old_queue)
+        kvalloc_free(byte_array_new((void *)old_queue, old_cap * sizeof(*global_sleep_queue)));
 
-        list = list->next;
+    return result_ok();
+}
+// Returns true if `a` should be woken up before `b`.
+static inline bool sched_wakes_before(struct sched_task *a, struct sched_task *b)
+{
+    if (a->wake_time.ms != b->wake_time.ms)
+        return a->wake_time.ms < b->wake_time.ms;
+    return a->sleep_seq < b->sleep_seq;
+}
+
+static inline void sched_sleep_queue_set(sz idx, struct sched_task *task)
+{
+    global_sleep_queue[idx] = task;
+    task->sleep_idx = idx;
+}
+
+static void sched_sift_up(sz idx)
+{
+    struct sched_task *task = global_sleep_queue[idx];
+
+    while (idx > 0) {
+        sz parent = (idx - 1) / 2;
+        if (!sched_wakes_before(task, global_sleep_queue[parent]))
+            break;
+        sched_sleep_queue_set(idx, global_sleep_queue[parent]);
+        idx = parent;
+    }
+
+    sched_sleep_queue_set(idx, task);
+}
+
+static void sched_sift_down(sz idx)
+{
+    struct sched_task *task = global_sleep_queue[idx];
+
+    while (true) {
+        sz child = 2 * idx + 1;
+        if (child >= global_sleep_queue_len)
+            break;
+        if (child + 1 < global_sleep_queue_len &&
+            sched_wakes_before(global_sleep_queue[child + 1], global_sleep_queue[child]))
+            child++;
+        if (!sched_wakes_before(global_sleep_queue[child], task))
+            break;
+        sched_sleep_queue_set(idx, global_sleep_queue[child]);
+        idx = child;
     }
 
-    dlist_insert(list->prev, &new_task->sleep_list);
+    sched_sleep_queue_set(idx, task);
+}
+
+// Add a task to the sleep queue. The PIT is armed again if the task should wake up before the current deadline.
+static void sched_add_sleeping(struct sched_task *task)
+{
+    assert(task->sleep_idx < 0);
+    assert(global_sleep_queue_len < global_sleep_queue_cap);
+
+    task->sleep_seq = global_next_sleep_seq++;
+    sched_sleep_queue_set(global_sleep_queue_len++, task);
+    sched_sift_up(task->sleep_idx);
+
+    if (task->wake_time.ms < global_timer_deadline_ms) {
+        global_timer_deadline_ms = task->wake_time.ms;
+        time_set_oneshot(task->wake_time);
+    }
 }
 
-// Remove a task from the sleep list.
+// Remove a task from the sleep queue. Nothing happens if the task isn't in the sleep queue.
 static void sched_remove_sleeping(struct sched_task *task)
 {
-    dlist_remove(&task->sleep_list);
+    sz idx = task->sleep_idx;
+    if (idx < 0)
+        return;
+
+    assert(idx < global_sleep_queue_len && global_sleep_queue[idx] == task);
+    task->sleep_idx = -1;
+
+    struct sched_task *last = global_sleep_queue[--global_sleep_queue_len];
+    if (last == task)
+        return;
+
+    // Move the last task into the hole. It might belong further up or further down.
+    sched_sleep_queue_set(idx, last);
+    sched_sift_up(idx);
+    sched_sift_down(last->sleep_idx);
 }
 
-// Search the sleep list for sleeping tasks that are ready to run. Returns `NULL` if there are no such tasks.
-static struct sched_task *sched_poll_sleeping(void)
+// Returns the sleeping task that should wake up first or `NULL` if no task is sleeping.
+static struct sched_task *sched_first_sleeping(void)
 {
-    // NOTE: This works because the sleep list is ordered by wake time.
+    if (global_sleep_queue_len == 0)
+        return NULL;
+    return global_sleep_queue[0];
+}
+
+// Make a task ready to run. It's taken off the sleep queue if it's on it. Nothing happens if it isn't blocked. Must
+// be called with interrupts disabled and the global lock held.
+static void sched_make_ready(struct sched_task *task)
+{
+    sched_remove_sleeping(task);
+    if (!task->is_blocked)
+        return;
+    task->is_blocked = false;
+
+    // The task blocked on another CPU, which might not have switched away from it yet.
+    while (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+        smp_handle_tlb_flush();
+    }
+
+    sched_enqueue(task);
+}
+
+// Make all tasks on `wq` ready. Must be called with the global lock held.
+static void sched_wake_up_locked(struct wait_queue *wq)
+{
+    while (!dlist_is_empty(&wq->waiters)) {
+        struct sched_task *task = __container_of(wq->waiters.next, struct sched_task, wait_list);
+        dlist_remove(&task->wait_list);
+        sched_make_ready(task);
+    }
+}
+
+// Move all sleeping tasks whose wake time has passed to a run queue. Must be called with the global lock held.
+static void sched_wake_expired(void)
+{
+    struct sched_task *first = sched_first_sleeping();
+    if (!first)
+        return;
 
-    struct sched_task *task = __container_of(global_sleep_list.next, struct sched_task, sleep_list);
     struct time_ms current_time = time_current_ms();
+    while (first && first->wake_time.ms <= current_time.ms) {
+        sched_make_ready(first);
+        first = sched_first_sleeping();
+    }
+}
 
-    if (current_time.ms < task->wake_time.ms)
-        return NULL;
+static inline void sched_start_slice(struct sched_cpu *rq)
+{
+    rq->slice_start_tsc = time_current_tsc();
+    __atomic_store_n(&rq->need_resched, false, __ATOMIC_RELAXED);
+}
 
-    return task;
+// Arm the PIT for the first sleeping task. If `for_slice` is set and preemption is enabled, the timer fires at the
+// end of the time slice of the BSP if that comes first. Must be called on the BSP with the global lock held.
+static void sched_arm_timer_locked(bool for_slice)
+{
+    u64 deadline = U64_MAX;
+    struct sched_task *first = sched_first_sleeping();
+    if (first)
+        deadline = first->wake_time.ms;
+    if (__PREEMPT__ && for_slice)
+        deadline = MIN(deadline, time_current_ms().ms + SCHED_QUANTUM_MS);
+
+    global_timer_deadline_ms = deadline;
+    if (deadline != U64_MAX)
+        time_set_oneshot(time_ms_new(deadline));
+}
+
+// Like `sched_arm_timer_locked` but takes the global lock. Must be called with interrupts disabled.
+static void sched_arm_timer(bool for_slice)
+{
+    spin_lock_raw(&global_sched_lock);
+    sched_arm_timer_locked(for_slice);
+    spin_unlock_raw(&global_sched_lock);
 }
 
-// Returns a non-null pointer to a sleeping task that's ready to run.
-static struct sched_task *sched_get_ready(void)
+// Arm the local APIC timer of an AP for the end of the time slice that just started. Must be called with interrupts
+// disabled.
+static void sched_arm_slice_timer(struct sched_cpu *rq)
 {
-    struct sched_task *ready = sched_poll_sleeping();
-    while (!ready)
-        ready = sched_poll_sleeping();
-    return ready;
+    if (__PREEMPT__ && sched_cpu_id(rq) != SCHED_TIMER_CPU && rq->current != &rq->idle_task)
+        lapic_timer_set_oneshot(time_ms_new(time_current_ms().ms + SCHED_QUANTUM_MS));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Tasks                                                                     //
+// Stacks                                                                    //
+///////////////////////////////////////////////////////////////////////////////
+
+// Task stacks are fully backed, guarded regions with a guard page below them (see `kvalloc_reserve_guarded` and
+// `sched_stack_alloc`). The stacks of finished tasks are kept for reuse, so creating a task is cheap if a task with
+// the same stack size exited before. The pool is protected by the global lock.
+
+#define SCHED_STACK_POOL_SIZE 32
+
+static struct byte_array global_free_stacks[SCHED_STACK_POOL_SIZE];
+static sz global_n_free_stacks;
+
+// Get a stack of `size` bytes. `size` must be a multiple of `PAGE_SIZE`.
+static struct option_byte_array sched_stack_alloc(sz size)
+{
+    u64 flags = save_and_disable_interrupts();
+    spin_lock_raw(&global_sched_lock);
+    for (sz i = global_n_free_stacks - 1; i >= 0; i--) {
+        if (global_free_stacks[i].len == size) {
+            struct byte_array stack = global_free_stacks[i];
+            global_free_stacks[i] = global_free_stacks[--global_n_free_stacks];
+            spin_unlock_raw(&global_sched_lock);
+            restore_interrupts(flags);
+            return option_byte_array_ok(stack);
+        }
+    }
+    spin_unlock_raw(&global_sched_lock);
+    restore_interrupts(flags);
+
+    struct option_byte_array stack_opt = kvalloc_reserve_guarded(size);
+    if (stack_opt.is_none)
+        return stack_opt;
+    struct byte_array stack = option_byte_array_checked(stack_opt);
+
+    // Interrupts are handled on the stack of the current task. If an interrupt hits a page that isn't backed yet,
+    // the CPU can't deliver the page fault. So the whole stack is backed before it's used.
+    for (sz offset = 0; offset < stack.len; offset += PAGE_SIZE)
+        ((volatile byte *)stack.dat)[offset] = 0;
+
+    return stack_opt;
+}
+
+// Keep a stack for later use. Must be called with interrupts disabled and without holding the global lock.
+static void sched_stack_free(struct byte_array stack)
+{
+    spin_lock_raw(&global_sched_lock);
+    bool is_kept = global_n_free_stacks < SCHED_STACK_POOL_SIZE;
+    if (is_kept)
+        global_free_stacks[global_n_free_stacks++] = stack;
+    spin_unlock_raw(&global_sched_lock);
+
+    if (!is_kept)
+        kvalloc_unreserve(stack);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Switching tasks                                                           //
 ///////////////////////////////////////////////////////////////////////////////
 
 // See sched.s
 extern void sched_do_context_switch(u64 **old_sp, u64 *new_sp);
 extern void sched_do_final_context_switch(u64 *new_sp);
 
-static void sched_switch_task(struct sched_task *next_task)
+// Make `next` the current task of the CPU of `rq` before switching to it. Must be called with interrupts disabled.
+static void sched_set_current(struct sched_cpu *rq, struct sched_task *prev, struct sched_task *next)
+{
+    // `next` came from a run queue or is the idle task, so it isn't sleeping.
+    assert(next->sleep_idx < 0);
+
+    __atomic_store_n(&next->on_cpu, true, __ATOMIC_RELAXED);
+    next->cpu = sched_cpu_id(rq);
+    sched_account_switch(rq, prev, next);
+    __atomic_store_n(&rq->current, next, __ATOMIC_RELAXED);
+    rq->current_priority = next->priority;
+    if (__PREEMPT__)
+        sched_start_slice(rq);
+}
+
+// A finished task can't free its own memory because it's still running on its stack. So this is done by the next
+// task once it runs. Must be called with interrupts disabled.
+static void sched_free_task(struct sched_task *task)
 {
-    if (next_task == global_current_task)
-        return; // Can skip the context switch.
+    sched_stack_free(task->stack);
+    kvalloc_free(byte_array_new((void *)task, sizeof(*task)));
+}
+
+// Runs right after every switch in the context of the task that was switched to. The task that was switched away from
+// is done with its stack now, so it can run on another CPU or be freed. Must be called with interrupts disabled.
+static void sched_finish_switch(void)
+{
+    struct sched_cpu *rq = sched_this_cpu();
+
+    struct sched_task *prev = rq->prev;
+    rq->prev = NULL;
+    if (prev) {
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+        if (rq->requeue_prev)
+            sched_enqueue(prev);
+    }
 
-    // If `next_task` isn't the current task, it came from the sleep list and must be removed there before being run.
-    sched_remove_sleeping(next_task);
+    struct sched_task *finished = rq->finished;
+    rq->finished = NULL;
+    if (finished)
+        sched_free_task(finished);
 
-    struct sched_task *old = global_current_task;
-    global_current_task = next_task;
-    sched_do_context_switch(&old->stack_ptr, global_current_task->stack_ptr);
+    sched_arm_slice_timer(rq);
 }
 
-static void sched_final_switch_task(struct sched_task *next_task)
+// Switch from the current task of the CPU of `rq` to `next`. If `requeue_prev` is set, the current task is put back
+// on a run queue once it's switched out. Must be called with interrupts disabled. The task might resume on another
+// CPU, so `rq` must not be used afterwards.
+static void sched_switch_task(struct sched_cpu *rq, struct sched_task *next, bool requeue_prev)
 {
-    assert(next_task != global_current_task);
+    struct sched_task *prev = rq->current;
+    assert(next != prev);
 
-    sched_remove_sleeping(next_task);
+    sched_set_current(rq, prev, next);
+    if (next != &rq->idle_task)
+        rq->n_switches++;
+    rq->prev = prev;
+    rq->requeue_prev = requeue_prev;
+    sched_do_context_switch(&prev->stack_ptr, next->stack_ptr);
 
-    global_current_task = next_task;
-    sched_do_final_context_switch(next_task->stack_ptr);
+    sched_finish_switch();
 }
 
-static void sched_task_finish(void)
+// Set up the stack of `task` so that switching to it for the first time calls `entry`.
+static void sched_init_stack(struct sched_task *task, void (*entry)(void))
 {
+    task->stack_ptr = (u64 *)(task->stack.dat + task->stack.len) - 1;
+
+    *(task->stack_ptr) = (u64)entry;
+    *(task->stack_ptr - 1) = (u64)task->stack_ptr; // rbp
+    *(task->stack_ptr - 2) = 0; // rbx
+    *(task->stack_ptr - 3) = 0; // r12
+    *(task->stack_ptr - 4) = 0; // r13
+    *(task->stack_ptr - 5) = 0; // r14
+    *(task->stack_ptr - 6) = 0; // r15
+
+    task->stack_ptr = task->stack_ptr - 6;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Idle tasks                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// Every CPU has an idle task that runs when no other task is ready. It isn't in the list of all tasks and it can't be
+// preempted. It steals tasks from other CPUs, prepares zeroed memory and halts the CPU when there is nothing left
+// to do. Only the idle task halts the CPU, so a CPU that's halted is always seen as idle by `sched_enqueue`.
+
+// Halt the CPU until an interrupt arrives. Must be called with interrupts disabled.
+static void sched_halt(struct sched_cpu *rq)
+{
+    bool is_timer_cpu = sched_cpu_id(rq) == SCHED_TIMER_CPU;
+
+    // No task runs while the CPU is halted, so there is no time slice that could end.
+    if (__PREEMPT__ && is_timer_cpu)
+        sched_arm_timer(false);
+
+    u64 start = time_current_tsc();
+    enable_interrupts_and_halt();
+    u64 end = time_current_tsc();
+
+    // The timer was armed for the wake time, which can be a lot later than the end of the next time slice.
+    if (__PREEMPT__ && is_timer_cpu)
+        sched_arm_timer(true);
+    rq->idle_tsc += end - start;
+    rq->n_halts++;
+}
+
+// Wake up another idle CPU if the current CPU has more ready tasks than it can run right now.
+static void sched_kick_idle_cpu(struct sched_cpu *rq)
+{
+    if (!__atomic_load_n(&rq->n_ready, __ATOMIC_RELAXED))
+        return;
+    struct sched_cpu *idle = sched_find_idle_cpu();
+    if (idle && idle != rq)
+        smp_send_resched(sched_cpu_id(idle));
+}
+
+// Runs with interrupts disabled, except for when it prepares zeroed memory or halts.
+static __noreturn void sched_idle_loop(void)
+{
+    struct sched_cpu *rq = sched_this_cpu(); // The idle task never changes CPUs.
+
+    while (true) {
+        struct sched_task *next = sched_pop(rq, SCHED_PRIORITY_LOW);
+        if (!next)
+            next = sched_steal(rq);
+        if (next) {
+            sched_kick_idle_cpu(rq);
+            sched_switch_task(rq, next, false);
+            continue;
+        }
+
+        // Interrupts are enabled while doing idle work because interrupt handlers may wake up tasks.
+        enable_interrupts();
+        bool did_work = kvalloc_prezero_step();
+        disable_interrupts();
+
+        // Once the idle work is done, the CPU is halted instead of polling the run queues.
+        if (!did_work)
+            sched_halt(rq);
+    }
+}
+
+// Entry of the idle task of the BSP, which runs on a stack of its own.
+static void sched_idle_entry(void)
+{
+    sched_finish_switch();
+    sched_idle_loop();
+}
+
+// Set up the scheduler state of the current CPU. If `idle_stack` is empty, the idle task runs on the current stack.
+// Must be called with interrupts disabled.
+static struct sched_cpu *sched_init_cpu(struct byte_array idle_stack)
+{
+    struct sched_cpu *rq = sched_this_cpu();
+    assert(!rq->is_active);
+
+    for (sz i = 0; i < SCHED_N_PRIORITIES; i++)
+        dlist_init_empty(&rq->run_queues[i]);
+    spin_lock_init(&rq->lock);
+    rq->start_tsc = time_current_tsc();
+
+    struct sched_task *idle = &rq->idle_task;
+    idle->id = SCHED_TRACE_IDLE_ID;
+    idle->name = STR("idle");
+    idle->priority = SCHED_PRIORITY_LOW;
+    idle->preempt_count = 1; // Never preempted, it switches to tasks as soon as they are ready by itself.
+    idle->sleep_idx = -1;
+    idle->cpu = sched_cpu_id(rq);
+    dlist_init_empty(&idle->task_list);
+    dlist_init_empty(&idle->run_list);
+    dlist_init_empty(&idle->wait_list);
+    if (idle_stack.len) {
+        idle->stack = idle_stack;
+        sched_init_stack(idle, sched_idle_entry);
+    }
+
+    return rq;
+}
+
+void sched_init(void)
+{
+    assert(!global_sched_initialized);
+
+    dlist_init_empty(&global_tasks);
+    wait_queue_init(&global_kernel_lock_waiters);
+    assert(!sched_reserve_sleeping(SCHED_SLEEP_QUEUE_MIN_CAP).is_error);
+
+    byte_array_set(byte_array_new((void *)&global_main_task, sizeof(global_main_task)), 0);
+    global_main_task.id = global_next_id++;
+    global_main_task.sleep_idx = -1;
+    dlist_init_empty(&global_main_task.wait_list);
+    dlist_init_empty(&global_main_task.run_list);
+    global_main_task.name = STR("main");
+    global_main_task.on_cpu = true;
+    global_n_tasks = 1;
+    dlist_insert(&global_tasks, &global_main_task.task_list);
+
+    // The APs give their boot stacks to their idle tasks. The BSP keeps using its boot stack for the main task.
+    struct option_byte_array idle_stack_opt = sched_stack_alloc(TASK_STACK_SIZE);
+    assert(!idle_stack_opt.is_none);
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_cpu *rq = sched_init_cpu(option_byte_array_checked(idle_stack_opt));
+    global_sched_start_tsc = rq->start_tsc;
+    global_main_task.last_tsc = global_sched_start_tsc;
+    global_main_task.cpu = sched_cpu_id(rq);
+    rq->current = &global_main_task;
+    rq->current_priority = global_main_task.priority;
+    sched_start_slice(rq);
+    __atomic_store_n(&rq->is_active, true, __ATOMIC_RELEASE);
+    global_sched_initialized = true;
+
+    if (__PREEMPT__)
+        sched_arm_timer(true);
+    restore_interrupts(flags);
+}
+
+void sched_run_ap(void)
+{
+    assert(global_sched_initialized);
+
+    disable_interrupts();
+    struct sched_cpu *rq = sched_init_cpu(byte_array_new(NULL, 0));
+    rq->idle_task.on_cpu = true;
+    rq->idle_task.last_tsc = rq->start_tsc;
+    rq->current = &rq->idle_task;
+    rq->current_priority = rq->idle_task.priority;
+    __atomic_store_n(&rq->is_active, true, __ATOMIC_RELEASE);
+
+    sched_idle_loop();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tasks                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+static __noreturn void sched_task_finish(void)
+{
+    disable_interrupts();
+    struct sched_task *task = sched_current();
+
     // We don't allow the main task to finish so that there is always a task left to execute.
-    assert(global_current_task != &global_main_task);
+    assert(task != &global_main_task);
+    assert(!task->kernel_lock_depth);
 
-    kvalloc_free(byte_array_new((void *)global_current_task, sizeof(*global_current_task)));
+    spin_lock_raw(&global_sched_lock);
+    global_n_tasks--;
+    dlist_remove(&task->task_list);
+    spin_unlock_raw(&global_sched_lock);
 
-    sched_final_switch_task(sched_get_ready());
+    struct sched_cpu *rq = sched_this_cpu();
+    struct sched_task *next = sched_pick_next(rq);
+    sched_set_current(rq, task, next);
+    rq->finished = task;
+    sched_do_final_context_switch(next->stack_ptr);
 
     crash("Can't return from final context switch, current task is deleted\n");
 }
 
 static void sched_task_entry(void)
 {
-    assert(global_current_task);
-    assert(global_current_task->callback);
+    // The task was switched to with interrupts disabled.
+    sched_finish_switch();
+    struct sched_task *task = sched_current();
+    assert(task->callback);
+    enable_interrupts();
 
-    global_current_task->callback(global_current_task->context);
+    task->callback(task->context);
 
     sched_task_finish();
 }
 
 struct result sched_create_task(sched_callback_func_t callback, void *context)
+{
+    struct sched_task_attrs attrs = { 0 };
+    return sched_create_task_attrs(callback, context, attrs);
+}
+
+struct result sched_create_task_attrs(sched_callback_func_t callback, void *context, struct sched_task_attrs attrs)
 {
     assert(global_sched_initialized);
 
     assert(callback);
+    assert(attrs.stack_size >= 0);
+    assert(attrs.priority >= SCHED_PRIORITY_LOW && attrs.priority <= SCHED_PRIORITY_HIGH);
 
-    struct option_byte_array task_mem_opt = kvalloc_alloc(sizeof(struct sched_task), alignof(struct sched_task));
+    sz stack_size = ALIGN_UP(attrs.stack_size ? attrs.stack_size : TASK_STACK_SIZE, PAGE_SIZE);
+
+    struct option_byte_array task_mem_opt =
+        kvalloc_alloc_zeroed(sizeof(struct sched_task), alignof(struct sched_task));
     if (task_mem_opt.is_none)
         return result_error(ENOMEM);
     struct sched_task *task = byte_array_ptr(option_byte_array_checked(task_mem_opt));
 
+    struct option_byte_array stack_opt = sched_stack_alloc(stack_size);
+    if (stack_opt.is_none) {
+        kvalloc_free(option_byte_array_checked(task_mem_opt));
+        return result_error(ENOMEM);
+    }
+    task->stack = option_byte_array_checked(stack_opt);
+
     task->callback = callback;
     task->context = context;
-
-    task->stack_ptr = (u64 *)(task->stack + TASK_STACK_SIZE) - 1;
+    task->priority = attrs.priority;
+    task->name = attrs.name.len ? attrs.name : STR("task");
 
     // Set up the stack so that context switches return to `sched_task_entry`.
-    *(task->stack_ptr) = (u64)sched_task_entry;
-    *(task->stack_ptr - 1) = (u64)task->stack_ptr; // rbp
-    *(task->stack_ptr - 2) = 0; // rbx
-    *(task->stack_ptr - 3) = 0; // r12
-    *(task->stack_ptr - 4) = 0; // r13
-    *(task->stack_ptr - 5) = 0; // r14
-    *(task->stack_ptr - 6) = 0; // r15
+    sched_init_stack(task, sched_task_entry);
 
-    task->stack_ptr = task->stack_ptr - 6;
+    task->sleep_idx = -1;
+    dlist_init_empty(&task->wait_list);
+    dlist_init_empty(&task->run_list);
+    task->is_blocked = true; // So that `sched_make_ready` puts it on a run queue.
 
-    task->id = global_next_id++;
+    u64 flags = save_and_disable_interrupts();
+    task->cpu = sched_cpu_id(sched_this_cpu());
+    spin_lock_raw(&global_sched_lock);
+    // Every task needs room in the sleep queue. Tasks that are created on other CPUs can take the room that was
+    // reserved here, so this is checked again after taking the lock.
+    while (global_n_tasks + 1 > global_sleep_queue_cap) {
+        sz n_tasks = global_n_tasks + 1;
+        spin_unlock_raw(&global_sched_lock);
+        restore_interrupts(flags);
 
-    task->wake_time = time_ms_new(0); // Will be woken up as soon as possible.
-    sched_add_sleeping(task);
+        struct result res = sched_reserve_sleeping(n_tasks);
+        if (res.is_error) {
+            flags = save_and_disable_interrupts();
+            sched_stack_free(task->stack);
+            restore_interrupts(flags);
+            kvalloc_free(option_byte_array_checked(task_mem_opt));
+            return res;
+        }
+
+        flags = save_and_disable_interrupts();
+        spin_lock_raw(&global_sched_lock);
+    }
+    task->id = global_next_id++;
+    global_n_tasks++;
+    dlist_insert(global_tasks.prev, &task->task_list);
+    sched_make_ready(task);
+    spin_unlock_raw(&global_sched_lock);
+    restore_interrupts(flags);
 
     return result_ok();
 }
@@ -167,24 +921,617 @@ u16 sched_current_id(void)
 {
     if (!global_sched_initialized)
         return 0;
-    return global_current_task->id;
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_cpu *rq = sched_this_cpu();
+    u16 id = sched_cpu_is_active(rq) ? rq->current->id : 0;
+    restore_interrupts(flags);
+    return id;
+}
+
+// Copy of the information about a task that `sched_print_stats` and `sched_dump_trace` print.
+struct sched_task_info {
+    u16 id;
+    struct str name;
+    enum sched_priority priority;
+    sz cpu;
+    u64 run_tsc;
+    u64 wait_tsc;
+    u64 n_switches;
+    u64 n_preemptions;
+};
+
+// Copy the information about all tasks into memory from kvalloc, so that it can be printed without holding the global
+// lock. Returns `none` if there isn't enough memory. The memory must be freed with `kvalloc_free`.
+static struct option_byte_array sched_snapshot_tasks(sz *n_tasks)
+{
+    while (true) {
+        u64 flags = save_and_disable_interrupts();
+        spin_lock_raw(&global_sched_lock);
+        sz cap = global_n_tasks;
+        spin_unlock_raw(&global_sched_lock);
+        restore_interrupts(flags);
+
+        struct option_byte_array mem_opt =
+            kvalloc_alloc(cap * sizeof(struct sched_task_info), alignof(struct sched_task_info));
+        if (mem_opt.is_none)
+            return mem_opt;
+        struct sched_task_info *infos = byte_array_ptr(option_byte_array_checked(mem_opt));
+
+        flags = save_and_disable_interrupts();
+        spin_lock_raw(&global_sched_lock);
+        if (global_n_tasks > cap) {
+            // Tasks were created in the meantime.
+            spin_unlock_raw(&global_sched_lock);
+            restore_interrupts(flags);
+            kvalloc_free(option_byte_array_checked(mem_opt));
+            continue;
+        }
+
+        u64 now = time_current_tsc();
+        sz i = 0;
+        for (struct dlist *cur = global_tasks.next; cur != &global_tasks; cur = cur->next, i++) {
+            struct sched_task *task = __container_of(cur, struct sched_task, task_list);
+            infos[i].id = task->id;
+            infos[i].name = task->name;
+            infos[i].priority = task->priority;
+            infos[i].cpu = task->cpu;
+            infos[i].run_tsc = task->run_tsc;
+            if (__atomic_load_n(&task->on_cpu, __ATOMIC_RELAXED))
+                infos[i].run_tsc += now - task->last_tsc;
+            infos[i].wait_tsc = task->wait_tsc;
+            infos[i].n_switches = task->n_switches;
+            infos[i].n_preemptions = task->n_preemptions;
+        }
+        *n_tasks = i;
+        spin_unlock_raw(&global_sched_lock);
+        restore_interrupts(flags);
+
+        return mem_opt;
+    }
+}
+
+void sched_print_stats(void)
+{
+    assert(global_sched_initialized);
+
+    for (sz i = 0; i < SMP_MAX_CPUS; i++) {
+        struct sched_cpu *rq = &global_sched_cpus[i];
+        if (!sched_cpu_is_active(rq))
+            continue;
+
+        // The counters of other CPUs are read without synchronization. They might be slightly out of date.
+        u64 total_tsc = time_current_tsc() - rq->start_tsc;
+        u64 idle_tsc = rq->idle_tsc;
+        u64 idle_ms = time_ms_from_tsc(idle_tsc).ms;
+        u64 busy_ms = time_ms_from_tsc(total_tsc - idle_tsc).ms;
+        u64 idle_permille = total_tsc ? idle_tsc * 1000 / total_tsc : 0;
+
+        print_dbg(PINFO,
+                  STR("Scheduler: cpu=%ld idle=%lums busy=%lums idle_permille=%lu halts=%lu switches=%lu "
+                      "preemptions=%lu steals=%lu\n"),
+                  i, idle_ms, busy_ms, idle_permille, rq->n_halts, rq->n_switches, rq->n_preemptions, rq->n_steals);
+    }
+
+    sz n_tasks = 0;
+    struct option_byte_array mem_opt = sched_snapshot_tasks(&n_tasks);
+    if (mem_opt.is_none) {
+        print_dbg(PWARN, STR("Not enough memory to print the statistics of the tasks\n"));
+        return;
+    }
+    struct sched_task_info *infos = byte_array_ptr(option_byte_array_checked(mem_opt));
+
+    for (sz i = 0; i < n_tasks; i++) {
+        struct sched_task_info *info = &infos[i];
+        print_dbg(PINFO,
+                  STR("  task %hu (%s): priority=%d cpu=%ld run=%lums wait=%lums switches=%lu preemptions=%lu\n"),
+                  info->id, info->name, info->priority, info->cpu, time_ms_from_tsc(info->run_tsc).ms,
+                  time_ms_from_tsc(info->wait_tsc).ms, info->n_switches, info->n_preemptions);
+    }
+
+    kvalloc_free(option_byte_array_checked(mem_opt));
+}
+
+// Print the trace event for the time from `event` to `end_tsc`, during which `event->next_id` was running on the CPU
+// that's shown as process `pid`.
+static void sched_print_trace_slice(struct sched_trace_event *event, sz pid, u64 end_tsc)
+{
+    char underlying[160];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    u64 ts_us = time_us_from_tsc(event->tsc - global_sched_start_tsc);
+    u64 dur_us = time_us_from_tsc(end_tsc - event->tsc);
+    struct str name = event->next_id == SCHED_TRACE_IDLE_ID ? STR("idle") : STR("running");
+    print_fmt(buf, STR(",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%hu,\"ts\":%lu,\"dur\":%lu}\n"), name, pid,
+              event->next_id, ts_us, dur_us);
+}
+
+// Print the switches that were recorded on the CPU of `rq`. Each CPU shows up as a process.
+static void sched_print_trace_cpu(struct sched_cpu *rq, struct sched_task_info *infos, sz n_tasks, u64 end_tsc)
+{
+    char underlying[160];
+    struct str_buf buf = str_buf_new(underlying, 0, countof(underlying));
+
+    sz id = sched_cpu_id(rq);
+    sz pid = id + 1;
+    print_fmt(buf, STR("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":\"cpu %ld\"}}\n"),
+              id ? STR(",") : STR(""), pid, id);
+    print_fmt(buf,
+              STR(",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%hu,\"args\":{\"name\":\"idle\"}}\n"),
+              pid, SCHED_TRACE_IDLE_ID);
+    for (sz i = 0; i < n_tasks; i++) {
+        print_fmt(buf,
+                  STR(",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%hu,\"args\":{\"name\":\"%s "
+                      "%hu\"}}\n"),
+                  pid, infos[i].id, infos[i].name, infos[i].id);
+    }
+
+    u64 n_events = rq->trace_n_events;
+    u64 first = n_events > SCHED_TRACE_N_EVENTS ? n_events - SCHED_TRACE_N_EVENTS : 0;
+    for (u64 i = first; i < n_events; i++) {
+        struct sched_trace_event *event = &rq->trace[i % SCHED_TRACE_N_EVENTS];
+        u64 slice_end_tsc = i + 1 < n_events ? rq->trace[(i + 1) % SCHED_TRACE_N_EVENTS].tsc : end_tsc;
+        sched_print_trace_slice(event, pid, slice_end_tsc);
+    }
+}
+
+void sched_dump_trace(void)
+{
+    assert(global_sched_initialized);
+
+    if (!__SCHED_TRACE__) {
+        print_dbg(PWARN, STR("Tracing is disabled, build with SCHED_TRACE=1\n"));
+        return;
+    }
+
+    sz n_tasks = 0;
+    struct option_byte_array mem_opt = sched_snapshot_tasks(&n_tasks);
+    if (mem_opt.is_none) {
+        print_dbg(PWARN, STR("Not enough memory to dump the trace\n"));
+        return;
+    }
+    struct sched_task_info *infos = byte_array_ptr(option_byte_array_checked(mem_opt));
+
+    // Stop recording so that the rings aren't overwritten.
+    __atomic_store_n(&global_trace_is_paused, true, __ATOMIC_SEQ_CST);
+    u64 end_tsc = time_current_tsc();
+
+    print_str(STR("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"));
+    for (sz i = 0; i < SMP_MAX_CPUS; i++) {
+        if (sched_cpu_is_active(&global_sched_cpus[i]))
+            sched_print_trace_cpu(&global_sched_cpus[i], infos, n_tasks, end_tsc);
+    }
+    print_str(STR("]}\n"));
+
+    __atomic_store_n(&global_trace_is_paused, false, __ATOMIC_SEQ_CST);
+    kvalloc_free(option_byte_array_checked(mem_opt));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Preemption                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// Switch to the next ready task on the CPU of `rq` that has the same or a higher priority and put the current task
+// back on a run queue, as if it called `sched_yield`. Must be called with interrupts disabled.
+static void sched_preempt(struct sched_cpu *rq)
+{
+    struct sched_task *task = rq->current;
+    struct sched_task *next = sched_pop(rq, task->priority);
+    if (!next) {
+        sched_start_slice(rq); // No other task with the same or a higher priority is ready, so the task keeps running.
+        sched_arm_slice_timer(rq);
+        return;
+    }
+
+    rq->n_preemptions++;
+    task->n_preemptions++;
+    sched_switch_task(rq, next, true);
+}
+
+void sched_preempt_disable(void)
+{
+    if (!global_sched_initialized)
+        return;
+
+    // The task can't change CPUs while interrupts are disabled.
+    u64 flags = save_and_disable_interrupts();
+    struct sched_cpu *rq = sched_this_cpu();
+    if (sched_cpu_is_active(rq))
+        rq->current->preempt_count++;
+    restore_interrupts(flags);
+}
+
+void sched_preempt_enable(void)
+{
+    if (!global_sched_initialized)
+        return;
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_cpu *rq = sched_this_cpu();
+    if (!sched_cpu_is_active(rq)) {
+        restore_interrupts(flags);
+        return;
+    }
+
+    struct sched_task *task = rq->current;
+    assert(task->preempt_count > 0);
+    task->preempt_count--;
+
+    // Sections that disable interrupts can't be preempted either.
+    if (__PREEMPT__ && !task->preempt_count && rq->need_resched && (flags & RFLAGS_IF))
+        sched_preempt(rq);
+    restore_interrupts(flags);
+}
+
+void sched_timer_tick(void)
+{
+    if (!global_sched_initialized)
+        return;
+
+    struct sched_cpu *rq = sched_this_cpu();
+    if (!sched_cpu_is_active(rq))
+        return;
+
+    bool is_idle = sched_cpu_is_idle(rq);
+    if (__PREEMPT__ && !is_idle &&
+        time_ms_from_tsc(time_current_tsc() - rq->slice_start_tsc).ms >= SCHED_QUANTUM_MS)
+        rq->need_resched = true;
+
+    if (sched_cpu_id(rq) == SCHED_TIMER_CPU) {
+        spin_lock_raw(&global_sched_lock);
+        sched_wake_expired();
+        sched_arm_timer_locked(true);
+        spin_unlock_raw(&global_sched_lock);
+    } else if (!rq->need_resched) {
+        // The timer fired early, so the slice hasn't ended yet.
+        sched_arm_slice_timer(rq);
+    }
+}
+
+void sched_preempt_from_interrupt(void)
+{
+    if (!__PREEMPT__ || !global_sched_initialized)
+        return;
+
+    struct sched_cpu *rq = sched_this_cpu();
+    if (!sched_cpu_is_active(rq))
+        return;
+
+    // Interrupts are disabled in interrupt handlers. If the task can't be preempted right now, it's preempted once it
+    // calls `sched_preempt_enable`.
+    if (rq->need_resched && !rq->current->preempt_count)
+        sched_preempt(rq);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Blocking and the kernel lock                                              //
+///////////////////////////////////////////////////////////////////////////////
+
+// The owner of the kernel lock and the tasks waiting for it are protected by the global lock. A task that blocks
+// while it holds the kernel lock gives it up and takes it again before it continues, so that tasks on other CPUs can
+// run the code that the kernel lock protects in the meantime.
+
+// Release the kernel lock if `task` holds it. Returns `true` in that case. Must be called with the global lock held.
+static bool sched_kernel_lock_drop(struct sched_task *task)
+{
+    if (global_kernel_lock_owner != task)
+        return false;
+
+    global_kernel_lock_owner = NULL;
+    sched_wake_up_locked(&global_kernel_lock_waiters);
+    return true;
+}
+
+// Switch away from the current task until it's made ready again by `sched_make_ready`. The task must be on the sleep
+// queue or on a wait queue. Must be called with interrupts disabled and the global lock held, which is released.
+// Returns `true` if the task had to give up the kernel lock, which it must take again then.
+static bool sched_block(struct sched_task *task)
+{
+    task->is_blocked = true;
+    bool dropped_kernel_lock = sched_kernel_lock_drop(task);
+    spin_unlock_raw(&global_sched_lock);
+
+    struct sched_cpu *rq = sched_this_cpu();
+    sched_switch_task(rq, sched_pick_next(rq), false);
+    return dropped_kernel_lock;
+}
+
+// Block until the current task owns the kernel lock. Must be called with interrupts disabled and without holding the
+// global lock.
+static void sched_kernel_lock_acquire(struct sched_task *task)
+{
+    spin_lock_raw(&global_sched_lock);
+    while (global_kernel_lock_owner) {
+        dlist_insert(global_kernel_lock_waiters.waiters.prev, &task->wait_list);
+        sched_block(task);
+        spin_lock_raw(&global_sched_lock);
+        dlist_remove(&task->wait_list);
+    }
+    global_kernel_lock_owner = task;
+    spin_unlock_raw(&global_sched_lock);
+}
+
+void kernel_lock(void)
+{
+    assert(global_sched_initialized);
+
+    sched_preempt_disable();
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+    if (!task->kernel_lock_depth++)
+        sched_kernel_lock_acquire(task);
+    restore_interrupts(flags);
+}
+
+void kernel_unlock(void)
+{
+    assert(global_sched_initialized);
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+    assert(task->kernel_lock_depth > 0);
+    if (!--task->kernel_lock_depth) {
+        spin_lock_raw(&global_sched_lock);
+        bool dropped = sched_kernel_lock_drop(task);
+        assert(dropped);
+        spin_unlock_raw(&global_sched_lock);
+    }
+    restore_interrupts(flags);
+    sched_preempt_enable();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Sleep                                                                     //
+// Yield and sleep                                                           //
 ///////////////////////////////////////////////////////////////////////////////
 
+void sched_yield(void)
+{
+    assert(global_sched_initialized);
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+
+    bool dropped_kernel_lock = false;
+    if (task->kernel_lock_depth) {
+        spin_lock_raw(&global_sched_lock);
+        dropped_kernel_lock = sched_kernel_lock_drop(task);
+        spin_unlock_raw(&global_sched_lock);
+    }
+
+    struct sched_cpu *rq = sched_this_cpu();
+    struct sched_task *next = sched_pop(rq, task->priority);
+    if (next)
+        sched_switch_task(rq, next, true);
+
+    if (dropped_kernel_lock)
+        sched_kernel_lock_acquire(task);
+    restore_interrupts(flags);
+}
+
 void sleep_ms(struct time_ms duration)
 {
     assert(global_sched_initialized);
 
+    if (duration.ms == 0) {
+        sched_yield();
+        return;
+    }
+
     struct time_ms start_time = time_current_ms();
-    global_current_task->wake_time = time_ms_new(start_time.ms + duration.ms);
 
-    sched_add_sleeping(global_current_task);
-    sched_switch_task(sched_get_ready());
-    sched_remove_sleeping(global_current_task);
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+    spin_lock_raw(&global_sched_lock);
+    task->wake_time = time_ms_new(start_time.ms + duration.ms);
+    sched_add_sleeping(task);
+    // The timer interrupt moves the task to a run queue once its wake time has passed.
+    bool dropped_kernel_lock = sched_block(task);
+    assert(task->sleep_idx < 0);
+    if (dropped_kernel_lock)
+        sched_kernel_lock_acquire(task);
+    restore_interrupts(flags);
 
     // Verify that the sleep didn't end prematurely.
     assert(time_current_ms().ms - start_time.ms >= duration.ms);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait queues                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+// A waiting task with a deadline is on the wait queue and on the sleep queue at the same time. Its wake time is the
+// deadline of the wait. `wake_up` moves it from the sleep queue to a run queue. If the deadline passes first, the
+// task runs even though it's still on the wait queue. Tasks that wait forever are only on the wait queue.
+//
+// A task is put on the wait queue before it checks for the event and blocks afterwards. A `wake_up` on another CPU
+// in between takes it off the wait queue again, and the task doesn't block then.
+
+void wait_queue_init(struct wait_queue *wq)
+{
+    assert(wq);
+    dlist_init_empty(&wq->waiters);
+}
+
+static struct time_ms sched_deadline(struct time_ms timeout)
+{
+    u64 now = time_current_ms().ms;
+    if (timeout.ms > U64_MAX - now)
+        return time_ms_new(U64_MAX);
+    return time_ms_new(now + timeout.ms);
+}
+
+// Put `task` on `wq`. Must be called with interrupts disabled.
+static void sched_prepare_wait(struct sched_task *task, struct wait_queue *wq)
+{
+    spin_lock_raw(&global_sched_lock);
+    dlist_insert(wq->waiters.prev, &task->wait_list);
+    spin_unlock_raw(&global_sched_lock);
+}
+
+// Take `task` off the wait queue it was put on by `sched_prepare_wait`. Returns `true` if `wake_up` did that already.
+// Must be called with the global lock held.
+static bool sched_finish_wait_locked(struct sched_task *task)
+{
+    sched_remove_sleeping(task);
+    bool was_woken_up = dlist_is_empty(&task->wait_list);
+    dlist_remove(&task->wait_list);
+    return was_woken_up;
+}
+
+// Block until `task` is taken off the wait queue it was put on by `sched_prepare_wait` or until `deadline`. Afterwards
+// the task isn't on the wait queue anymore. Returns `true` if the task was woken up. Must be called with interrupts
+// disabled.
+static bool sched_wait(struct sched_task *task, struct time_ms deadline)
+{
+    bool dropped_kernel_lock = false;
+
+    spin_lock_raw(&global_sched_lock);
+    if (!dlist_is_empty(&task->wait_list) && time_current_ms().ms < deadline.ms) {
+        task->wake_time = deadline;
+        if (deadline.ms != U64_MAX)
+            sched_add_sleeping(task);
+        dropped_kernel_lock = sched_block(task);
+        spin_lock_raw(&global_sched_lock);
+    }
+    bool was_woken_up = sched_finish_wait_locked(task);
+    spin_unlock_raw(&global_sched_lock);
+
+    // The task can only be on one wait queue, so it must leave the one above before it waits for the kernel lock.
+    if (dropped_kernel_lock)
+        sched_kernel_lock_acquire(task);
+
+    return was_woken_up;
+}
+
+bool wait_queue_sleep(struct wait_queue *wq, struct time_ms timeout)
+{
+    assert(global_sched_initialized);
+    assert(wq);
+
+    struct time_ms deadline = sched_deadline(timeout);
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+    sched_prepare_wait(task, wq);
+    bool was_woken_up = sched_wait(task, deadline);
+    restore_interrupts(flags);
+
+    return was_woken_up;
+}
+
+bool wait_event_timeout(struct wait_queue *wq, wait_cond_func_t cond, void *context, struct time_ms timeout)
+{
+    assert(global_sched_initialized);
+    assert(wq);
+    assert(cond);
+
+    struct time_ms deadline = sched_deadline(timeout);
+
+    u64 flags = save_and_disable_interrupts();
+    struct sched_task *task = sched_current();
+    while (true) {
+        sched_prepare_wait(task, wq);
+        bool is_true = cond(context);
+        if (is_true || time_current_ms().ms >= deadline.ms) {
+            spin_lock_raw(&global_sched_lock);
+            sched_finish_wait_locked(task);
+            spin_unlock_raw(&global_sched_lock);
+            restore_interrupts(flags);
+            return is_true;
+        }
+        sched_wait(task, deadline);
+    }
+}
+
+void wake_up(struct wait_queue *wq)
+{
+    assert(wq);
+
+    u64 flags = save_and_disable_interrupts();
+    spin_lock_raw(&global_sched_lock);
+    sched_wake_up_locked(wq);
+    spin_unlock_raw(&global_sched_lock);
+
+    // Interrupt handlers leave switching to a woken task with a higher priority to `sched_preempt_from_interrupt`.
+    if (__PREEMPT__ && global_sched_initialized && (flags & RFLAGS_IF)) {
+        struct sched_cpu *rq = sched_this_cpu();
+        if (sched_cpu_is_active(rq) && rq->need_resched && !rq->current->preempt_count)
+            sched_preempt(rq);
+    }
+
+    restore_interrupts(flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+#define SCHED_BENCH_N_ROUNDS 10000
+
+static struct wait_queue sched_bench_wq;
+
+// Blocks until the benchmark is over. The timeout keeps it in the sleep queue while the other tasks switch.
+static void sched_bench_sleeper(void *context __unused)
+{
+    wait_queue_sleep(&sched_bench_wq, time_ms_new(3600 * 1000));
+}
+
+// Switches back and forth with the main task.
+static void sched_bench_partner(void *context __unused)
+{
+    for (sz i = 0; i < SCHED_BENCH_N_ROUNDS; i++)
+        sched_yield();
+}
+
+// Let all other tasks run until they have finished.
+static void sched_bench_drain(void)
+{
+    while (__atomic_load_n(&global_n_tasks, __ATOMIC_RELAXED) > 1)
+        sched_yield();
+}
+
+// Returns the number of switches between tasks on all CPUs.
+static u64 sched_n_switches(void)
+{
+    u64 n_switches = 0;
+    for (sz i = 0; i < SMP_MAX_CPUS; i++)
+        n_switches += __atomic_load_n(&global_sched_cpus[i].n_switches, __ATOMIC_RELAXED);
+    return n_switches;
+}
+
+static void sched_bench_switches(struct str name, sz n_sleepers)
+{
+    wait_queue_init(&sched_bench_wq);
+    for (sz i = 0; i < n_sleepers; i++)
+        assert(!sched_create_task(sched_bench_sleeper, NULL).is_error);
+    assert(!sched_create_task(sched_bench_partner, NULL).is_error);
+
+    // Run all new tasks once. The sleepers block on the wait queue and the partner starts switching.
+    sched_yield();
+
+    u64 start_switches = sched_n_switches();
+    u64 start = rdtsc();
+    for (sz i = 0; i < SCHED_BENCH_N_ROUNDS; i++)
+        sched_yield();
+    u64 cycles = rdtsc() - start;
+    sz n_switches = sched_n_switches() - start_switches;
+    bench_report(name, start, n_switches);
+
+    u64 ms = time_ms_from_tsc(cycles).ms;
+    print_dbg(PINFO, STR("bench: %s: %lu switches/s\n"), name, ms ? n_switches * 1000 / ms : 0);
+
+    wake_up(&sched_bench_wq);
+    sched_bench_drain();
+}
+
+void sched_run_benchmarks(void)
+{
+    assert(global_sched_initialized);
+    assert(sched_current_id() == global_main_task.id && global_n_tasks == 1);
+    // With other CPUs running, the partner would run next to the main task instead of switching with it.
+    assert(smp_n_cpus_online() == 1);
+
+    sched_bench_switches(STR("context switch (10 sleeping tasks)"), 10);
+    sched_bench_switches(STR("context switch (100 sleeping tasks)"), 100);
+    sched_bench_switches(STR("context switch (1000 sleeping tasks)"), 1000);
+}
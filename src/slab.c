@@ -0,0 +1,195 @@
+#include <tx/buddy.h>
+#include <tx/slab.h>
+
+// This is a simple version of the slab allocator described by Jeff Bonwick in "The Slab Allocator: An Object-Caching
+// Kernel Memory Allocator" (USENIX Summer 1994). Objects are never constructed, so a cache is little more than a set
+// of slabs with a free list each.
+//
+// Objects that were never handed out are carved out of a slab with a bump pointer (`n_carved`). Only objects that
+// were freed are kept on the free list of their slab. This means that creating a slab doesn't require touching
+// all of its memory.
+
+void slab_cache_init(struct slab_cache *cache, sz obj_size, struct alloc page_alloc)
+{
+    assert(cache);
+    assert(obj_size >= sizeof(ptr));
+    assert((obj_size & (obj_size - 1)) == 0);
+
+    sz slab_len = PAGE_SIZE;
+    sz obj_offset = ALIGN_UP(sizeof(struct slab), obj_size);
+    while ((slab_len - obj_offset) / obj_size < SLAB_MIN_OBJS)
+        slab_len *= 2;
+
+    cache->obj_size = obj_size;
+    cache->slab_len = slab_len;
+    cache->obj_offset = obj_offset;
+    cache->n_objs = (slab_len - obj_offset) / obj_size;
+    dlist_init_empty(&cache->partial);
+    dlist_init_empty(&cache->full);
+    cache->empty = NULL;
+    cache->page_alloc = page_alloc;
+}
+
+static struct slab *slab_new(struct slab_cache *cache)
+{
+    assert(cache);
+
+    if (cache->empty) {
+        struct slab *slab = cache->empty;
+        cache->empty = NULL;
+        return slab;
+    }
+
+    struct slab *slab = alloc_alloc(cache->page_alloc, cache->slab_len, cache->slab_len);
+    if (!slab)
+        return NULL;
+    assert(IS_ALIGNED((uptr)slab, PAGE_SIZE));
+
+    dlist_init_empty(&slab->link);
+    slab->cache = cache;
+    slab->free_head = NULL;
+    slab->n_carved = 0;
+    slab->n_used = 0;
+
+    print_dbg(PVERBOSE, STR("Created slab: slab=0x%lx obj_size=%ld n_objs=%ld\n"), slab, cache->obj_size,
+              cache->n_objs);
+
+    return slab;
+}
+
+void *slab_cache_alloc(struct slab_cache *cache)
+{
+    assert(cache);
+
+    struct slab *slab = NULL;
+
+    if (!dlist_is_empty(&cache->partial)) {
+        slab = __container_of(cache->partial.next, struct slab, link);
+    } else {
+        slab = slab_new(cache);
+        if (!slab)
+            return NULL;
+        dlist_insert(&cache->partial, &slab->link);
+    }
+
+    assert(slab->n_used < cache->n_objs);
+
+    void *obj = NULL;
+    if (slab->free_head) {
+        obj = slab->free_head;
+        slab->free_head = (ptr *)*slab->free_head;
+    } else {
+        assert(slab->n_carved < cache->n_objs);
+        obj = (byte *)slab + cache->obj_offset + slab->n_carved * cache->obj_size;
+        slab->n_carved++;
+    }
+
+    slab->n_used++;
+    if (slab->n_used == cache->n_objs) {
+        dlist_remove(&slab->link);
+        dlist_insert(&cache->full, &slab->link);
+    }
+
+    return obj;
+}
+
+void slab_free(struct slab *slab, void *obj)
+{
+    assert(slab);
+    assert(obj);
+
+    struct slab_cache *cache = slab->cache;
+    assert(cache);
+    assert(slab->n_used > 0);
+    assert(IN_RANGE((byte *)obj, (byte *)slab + cache->obj_offset, cache->n_objs * cache->obj_size));
+    assert(((byte *)obj - ((byte *)slab + cache->obj_offset)) % cache->obj_size == 0);
+
+    if (slab->n_used == cache->n_objs) {
+        // The slab was full and is now partially used again.
+        dlist_remove(&slab->link);
+        dlist_insert(&cache->partial, &slab->link);
+    }
+
+    *(ptr *)obj = (ptr)slab->free_head;
+    slab->free_head = obj;
+    slab->n_used--;
+
+    if (slab->n_used > 0)
+        return;
+
+    dlist_remove(&slab->link);
+
+    // An empty slab is as good as new, so we can forget about the free list and start carving from the beginning.
+    slab->free_head = NULL;
+    slab->n_carved = 0;
+
+    if (!cache->empty) {
+        cache->empty = slab;
+        return;
+    }
+
+    print_dbg(PVERBOSE, STR("Releasing slab: slab=0x%lx obj_size=%ld\n"), slab, cache->obj_size);
+    alloc_free(cache->page_alloc, slab, cache->slab_len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+#define SLAB_TEST_SIZE BIT(20) /* 1MiB */
+
+static void test_slab_cache(struct arena arn, sz obj_size)
+{
+    struct buddy *buddy = buddy_init(byte_array_from_arena(SLAB_TEST_SIZE, &arn), &arn);
+    struct slab_cache cache;
+    slab_cache_init(&cache, obj_size, alloc_new(buddy, buddy_alloc_wrapper, buddy_free_wrapper));
+
+    assert(cache.n_objs >= SLAB_MIN_OBJS);
+    assert(cache.obj_offset >= sizeof(struct slab));
+
+    // Allocate enough objects to require three slabs.
+    sz n_objs = 2 * cache.n_objs + 1;
+    byte **objs = arena_alloc_array(&arn, n_objs, sizeof(*objs));
+
+    for (sz i = 0; i < n_objs; i++) {
+        objs[i] = slab_cache_alloc(&cache);
+        assert(objs[i]);
+        assert(IS_ALIGNED((uptr)objs[i], obj_size));
+        assert(slab_lookup(buddy->base, cache.slab_len, objs[i])->cache == &cache);
+        byte_array_set(byte_array_new(objs[i], obj_size), (byte)i);
+    }
+
+    // No object may overlap with any other object.
+    for (sz i = 0; i < n_objs; i++)
+        for (sz j = 0; j < obj_size; j++)
+            assert(objs[i][j] == (byte)i);
+
+    assert(!dlist_is_empty(&cache.full));
+    assert(!dlist_is_empty(&cache.partial));
+
+    // Freed objects are handed out again.
+    slab_free(slab_lookup(buddy->base, cache.slab_len, objs[3]), objs[3]);
+    byte *reused = slab_cache_alloc(&cache);
+    assert(reused == objs[3]);
+
+    for (sz i = 0; i < n_objs; i++)
+        slab_free(slab_lookup(buddy->base, cache.slab_len, objs[i]), objs[i]);
+
+    assert(dlist_is_empty(&cache.full));
+    assert(dlist_is_empty(&cache.partial));
+    assert(cache.empty);
+
+    // The cached empty slab is used again.
+    struct slab *empty = cache.empty;
+    void *obj = slab_cache_alloc(&cache);
+    assert(slab_lookup(buddy->base, cache.slab_len, obj) == empty);
+    assert(!cache.empty);
+}
+
+void slab_run_tests(struct arena arn)
+{
+    test_slab_cache(arn, 16);
+    test_slab_cache(arn, 256);
+    test_slab_cache(arn, 2048);
+    print_dbg(PINFO, STR("Slab selftest passed\n"));
+}
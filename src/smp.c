@@ -0,0 +1,493 @@
+// Multiprocessor startup
+//
+// References:
+//  - IA-32 Software Developers Manual Volume 3, Section 10.4 (MP initialization) and Section 11.6 (IPIs)
+
+#include <config.h>
+#include <tx/acpi.h>
+#include <tx/asm.h>
+#include <tx/assert.h>
+#include <tx/gdt.h>
+#include <tx/idt.h>
+#include <tx/isr.h>
+#include <tx/kvalloc.h>
+#include <tx/paging.h>
+#include <tx/print.h>
+#include <tx/sched.h>
+#include <tx/smp.h>
+#include <tx/time.h>
+
+static struct cpu global_cpus[SMP_MAX_CPUS];
+static sz global_n_cpus = 1; // Only the BSP is known before `smp_discover_cpus`.
+static paddr_t global_lapic_paddr;
+
+static void cpu_set_current(struct cpu *cpu)
+{
+    assert(cpu);
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (u64)cpu);
+}
+
+void smp_init_bsp(void)
+{
+    struct cpu *bsp = &global_cpus[0];
+    bsp->id = 0;
+    bsp->is_online = true;
+    cpu_set_current(bsp);
+}
+
+sz smp_n_cpus_online(void)
+{
+    sz n_online = 0;
+    for (sz i = 0; i < global_n_cpus; i++) {
+        if (__atomic_load_n(&global_cpus[i].is_online, __ATOMIC_ACQUIRE))
+            n_online++;
+    }
+    return n_online;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Local APIC                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xb0
+#define LAPIC_REG_SVR 0xf0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INITIAL_COUNT 0x380
+#define LAPIC_REG_TIMER_CURRENT_COUNT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_ID_SHIFT 24
+
+#define LAPIC_SVR_ENABLE BIT(8)
+#define LAPIC_LVT_MASKED BIT(16) // The timer is in one-shot mode if bits 17 and 18 are zero.
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+
+#define LAPIC_ICR_DELIVERY_FIXED (0 << 8)
+#define LAPIC_ICR_DELIVERY_INIT (5 << 8)
+#define LAPIC_ICR_DELIVERY_STARTUP (6 << 8)
+#define LAPIC_ICR_PENDING BIT(12)
+#define LAPIC_ICR_LEVEL_ASSERT BIT(14)
+#define LAPIC_ICR_DEST_SHIFT 24
+
+static volatile u32 *lapic_reg(u32 reg)
+{
+    return (volatile u32 *)(global_lapic_paddr + reg);
+}
+
+static struct result lapic_init_mmio(void)
+{
+    struct addr_mapping mapping;
+    mapping.type = ADDR_MAPPING_TYPE_CANONICAL;
+    mapping.mem_type = ADDR_MAPPING_MEMORY_STRONG_UNCACHEABLE;
+    mapping.perms = PT_FLAG_RW;
+    mapping.pbase = global_lapic_paddr;
+    mapping.vbase = global_lapic_paddr;
+    mapping.len = PAGE_SIZE;
+    return paging_map_region(mapping);
+}
+
+// Enable the local APIC of the current CPU so that it accepts IPIs, and set up its timer. The LINT pins are left
+// alone, the BSP still receives the interrupts of the PIC through them.
+static void lapic_init_cpu(void)
+{
+    *lapic_reg(LAPIC_REG_TPR) = 0; // Accept interrupts of all priorities.
+    *lapic_reg(LAPIC_REG_SVR) = LAPIC_SVR_ENABLE | VECTOR_LAPIC_SPURIOUS;
+    *lapic_reg(LAPIC_REG_TIMER_DIVIDE) = LAPIC_TIMER_DIVIDE_BY_16;
+    *lapic_reg(LAPIC_REG_LVT_TIMER) = VECTOR_LAPIC_TIMER;
+}
+
+static u8 lapic_id(void)
+{
+    return *lapic_reg(LAPIC_REG_ID) >> LAPIC_ID_SHIFT;
+}
+
+static void lapic_send_ipi(u8 apic_id, u32 icr_low)
+{
+    // An interrupt handler that sends an IPI in between the two writes would change the destination.
+    u64 flags = save_and_disable_interrupts();
+
+    *lapic_reg(LAPIC_REG_ICR_HIGH) = (u32)apic_id << LAPIC_ICR_DEST_SHIFT;
+    *lapic_reg(LAPIC_REG_ICR_LOW) = icr_low; // Writing the low half sends the IPI.
+
+    while (*lapic_reg(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        cpu_relax();
+
+    restore_interrupts(flags);
+}
+
+void lapic_send_eoi(void)
+{
+    *lapic_reg(LAPIC_REG_EOI) = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Local APIC timer                                                          //
+///////////////////////////////////////////////////////////////////////////////
+
+// The timer counts down at the bus frequency divided by 16. All CPUs share the bus, so the frequency is measured once
+// on the BSP against the TSC.
+
+#define LAPIC_TIMER_CALIBRATION_US 10000
+
+static u64 global_lapic_timer_hz;
+
+static void lapic_timer_calibrate(void)
+{
+    *lapic_reg(LAPIC_REG_LVT_TIMER) = LAPIC_LVT_MASKED | VECTOR_LAPIC_TIMER;
+    *lapic_reg(LAPIC_REG_TIMER_INITIAL_COUNT) = U32_MAX;
+    time_delay_us(LAPIC_TIMER_CALIBRATION_US);
+    u64 n_ticks = U32_MAX - *lapic_reg(LAPIC_REG_TIMER_CURRENT_COUNT);
+    *lapic_reg(LAPIC_REG_TIMER_INITIAL_COUNT) = 0; // Stops the timer.
+    *lapic_reg(LAPIC_REG_LVT_TIMER) = VECTOR_LAPIC_TIMER;
+
+    global_lapic_timer_hz = n_ticks * (1000000 / LAPIC_TIMER_CALIBRATION_US);
+    print_dbg(PINFO, STR("Local APIC timer frequency estimate: %lu Hz\n"), global_lapic_timer_hz);
+}
+
+void lapic_timer_set_oneshot(struct time_ms deadline)
+{
+    assert(global_lapic_timer_hz);
+
+    struct time_ms now = time_current_ms();
+    u64 delay_ms = deadline.ms > now.ms ? deadline.ms - now.ms : 0;
+    delay_ms = MIN(delay_ms, 1000); // Like for the PIT, later deadlines just cause an early interrupt.
+    u64 count = MAX(1, MIN(delay_ms * global_lapic_timer_hz / 1000, U32_MAX));
+
+    // Writing the initial count starts the timer again.
+    *lapic_reg(LAPIC_REG_TIMER_INITIAL_COUNT) = count;
+}
+
+static void smp_handle_lapic_timer(struct trap_frame *cpu_state __unused, void *private_data __unused)
+{
+    sched_timer_tick();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IPIs                                                                      //
+///////////////////////////////////////////////////////////////////////////////
+
+void smp_send_resched(sz cpu_id)
+{
+    assert(0 <= cpu_id && cpu_id < global_n_cpus);
+
+    struct cpu *cpu = &global_cpus[cpu_id];
+    if (__atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE))
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_DELIVERY_FIXED | LAPIC_ICR_LEVEL_ASSERT | VECTOR_IPI_RESCHED);
+}
+
+// There is nothing to do here. Switching to a task that was put on the run queue of the CPU happens in
+// `sched_preempt_from_interrupt` or in the idle loop of the scheduler, which the IPI wakes up.
+static void smp_handle_resched(struct trap_frame *cpu_state __unused, void *private_data __unused)
+{
+}
+
+static void smp_handle_spurious(struct trap_frame *cpu_state __unused, void *private_data __unused)
+{
+}
+
+// TLB shootdowns are numbered. A CPU that flushes its TLB because of a shootdown has also flushed the entries of all
+// earlier ones, so it only has to remember the number of the last one. The TLB is flushed entirely by reloading CR3,
+// which is simpler than passing addresses around and cheap enough because pages are rarely unmapped. Kernel pages
+// aren't global, so reloading CR3 drops them.
+static u64 global_tlb_flush_gen;
+
+void smp_handle_tlb_flush(void)
+{
+    if (!__SMP__)
+        return;
+
+    struct cpu *cpu = cpu_current();
+    u64 gen = __atomic_load_n(&global_tlb_flush_gen, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&cpu->tlb_flush_gen, __ATOMIC_RELAXED) >= gen)
+        return;
+
+    write_cr3(read_cr3());
+    __atomic_store_n(&cpu->tlb_flush_gen, gen, __ATOMIC_RELEASE);
+}
+
+static void smp_handle_tlb_flush_ipi(struct trap_frame *cpu_state __unused, void *private_data __unused)
+{
+    smp_handle_tlb_flush();
+}
+
+void smp_flush_tlb_others(void)
+{
+    if (!__SMP__ || smp_n_cpus_online() == 1)
+        return;
+
+    // Interrupts are disabled so that the task can't move to another CPU while it waits.
+    u64 flags = save_and_disable_interrupts();
+    struct cpu *self = cpu_current();
+    u64 gen = __atomic_add_fetch(&global_tlb_flush_gen, 1, __ATOMIC_SEQ_CST);
+
+    for (sz i = 0; i < global_n_cpus; i++) {
+        struct cpu *cpu = &global_cpus[i];
+        if (cpu != self && __atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE))
+            lapic_send_ipi(cpu->apic_id, LAPIC_ICR_DELIVERY_FIXED | LAPIC_ICR_LEVEL_ASSERT | VECTOR_IPI_TLB_FLUSH);
+    }
+
+    for (sz i = 0; i < global_n_cpus; i++) {
+        struct cpu *cpu = &global_cpus[i];
+        if (cpu == self || !__atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE))
+            continue;
+        while (__atomic_load_n(&cpu->tlb_flush_gen, __ATOMIC_ACQUIRE) < gen) {
+            cpu_relax();
+            smp_handle_tlb_flush(); // The other CPU might be waiting for this one.
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trampoline                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// An AP starts in real mode at the physical address given by the vector of the startup IPI times 4 KiB. The
+// trampoline is copied there. It switches to long mode using the kernel's page table, loads the stack prepared for
+// the AP and calls `smp_ap_main`.
+//
+// The trampoline is built for the address it runs at. The page is identity-mapped while the APs start, so the
+// instructions right after paging is enabled can still be fetched.
+#define SMP_TRAMPOLINE_PADDR 0x8000
+#define SMP_TRAMPOLINE_ADDR(label) "(" #label " - smp_trampoline_start + " TOSTRING(SMP_TRAMPOLINE_PADDR) ")"
+
+// The GDT of the trampoline puts the 64-bit code segment at the same index as the kernel's GDT so that CS is valid
+// before and after the AP loads the kernel's GDT.
+static_assert(SEG_IDX_KERN_CODE == 1);
+
+__asm__(".pushsection .rodata\n"
+        ".balign 16\n" // Keeps the slots at the end aligned after the copy.
+        ".code16\n"
+        "smp_trampoline_start:\n"
+        "    cli\n"
+        "    cld\n"
+        "    xorw %ax, %ax\n"
+        "    movw %ax, %ds\n"
+        "    lgdtl " SMP_TRAMPOLINE_ADDR(smp_trampoline_gdtr) "\n"
+        "    movl %cr0, %eax\n"
+        "    orl $1, %eax\n" // Protection enable
+        "    movl %eax, %cr0\n"
+        "    ljmpl $0x18, $" SMP_TRAMPOLINE_ADDR(smp_trampoline_prot_mode) "\n"
+        ".code32\n"
+        "smp_trampoline_prot_mode:\n"
+        "    movw $0x10, %ax\n"
+        "    movw %ax, %ds\n"
+        "    movw %ax, %es\n"
+        "    movw %ax, %ss\n"
+        "    movl %cr4, %eax\n"
+        "    orl $(1 << 5), %eax\n" // Physical address extension
+        "    movl %eax, %cr4\n"
+        "    movl " SMP_TRAMPOLINE_ADDR(smp_trampoline_cr3) ", %eax\n"
+        "    movl %eax, %cr3\n"
+        "    movl $0xc0000080, %ecx\n" // EFER
+        "    rdmsr\n"
+        "    orl $(1 << 8), %eax\n" // Long mode enable
+        "    wrmsr\n"
+        "    movl %cr0, %eax\n"
+        "    orl $(1 << 31), %eax\n" // Paging
+        "    movl %eax, %cr0\n"
+        "    ljmpl $0x08, $" SMP_TRAMPOLINE_ADDR(smp_trampoline_long_mode) "\n"
+        ".code64\n"
+        "smp_trampoline_long_mode:\n"
+        "    movq " SMP_TRAMPOLINE_ADDR(smp_trampoline_stack) ", %rsp\n"
+        "    movq " SMP_TRAMPOLINE_ADDR(smp_trampoline_entry) ", %rax\n"
+        "    call *%rax\n"
+        "1:  hlt\n"
+        "    jmp 1b\n"
+        ".balign 8\n"
+        "smp_trampoline_gdt:\n"
+        "    .quad 0\n"
+        "    .quad 0x00af9a000000ffff\n" // 0x08: 64-bit code
+        "    .quad 0x00cf92000000ffff\n" // 0x10: data
+        "    .quad 0x00cf9a000000ffff\n" // 0x18: 32-bit code
+        "smp_trampoline_gdtr:\n"
+        "    .word smp_trampoline_gdtr - smp_trampoline_gdt - 1\n"
+        "    .long " SMP_TRAMPOLINE_ADDR(smp_trampoline_gdt) "\n"
+        ".balign 8\n"
+        "smp_trampoline_cr3:\n"
+        "    .quad 0\n"
+        "smp_trampoline_stack:\n"
+        "    .quad 0\n"
+        "smp_trampoline_entry:\n"
+        "    .quad 0\n"
+        "smp_trampoline_end:\n"
+        ".popsection\n");
+
+extern const byte smp_trampoline_start[];
+extern const byte smp_trampoline_cr3[];
+extern const byte smp_trampoline_stack[];
+extern const byte smp_trampoline_entry[];
+extern const byte smp_trampoline_end[];
+
+static u64 *smp_trampoline_slot(const byte *label)
+{
+    return (u64 *)(SMP_TRAMPOLINE_PADDR + (label - smp_trampoline_start));
+}
+
+static struct addr_mapping smp_trampoline_mapping(void)
+{
+    struct addr_mapping mapping;
+    mapping.type = ADDR_MAPPING_TYPE_CANONICAL;
+    mapping.mem_type = ADDR_MAPPING_MEMORY_DEFAULT;
+    mapping.perms = PT_FLAG_RW;
+    mapping.pbase = SMP_TRAMPOLINE_PADDR;
+    mapping.vbase = SMP_TRAMPOLINE_PADDR;
+    mapping.len = PAGE_SIZE;
+    return mapping;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AP startup                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// The APs are started one after the other. This is the CPU that's currently starting.
+static struct cpu *global_starting_cpu;
+
+#define SMP_AP_ONLINE_TIMEOUT_MS 100
+
+__noreturn static void smp_ap_main(void)
+{
+    // The BSP gave up on this AP before it got here.
+    struct cpu *cpu = __atomic_load_n(&global_starting_cpu, __ATOMIC_ACQUIRE);
+    if (!cpu)
+        hlt();
+
+    gdt_init_cpu(cpu->id);
+    interrupt_init_cpu();
+    cpu_set_current(cpu);
+    lapic_init_cpu();
+
+    // Either this AP claims the start or the BSP times out and gives up on it, never both.
+    struct cpu *expected = cpu;
+    if (!__atomic_compare_exchange_n(&global_starting_cpu, &expected, NULL, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+        hlt();
+    __atomic_store_n(&cpu->is_online, true, __ATOMIC_RELEASE);
+
+    // The boot stack of the AP becomes the stack of its idle task.
+    sched_run_ap();
+}
+
+void smp_discover_cpus(void)
+{
+    struct acpi_cpu_info info;
+    struct result res = acpi_find_cpus(&info);
+    if (res.is_error) {
+        print_dbg(PWARN, STR("No CPUs found in the ACPI tables (error %hu), running on the BSP only\n"), res.code);
+        return;
+    }
+
+    global_lapic_paddr = info.lapic_base;
+
+    res = lapic_init_mmio();
+    if (res.is_error) {
+        print_dbg(PWARN, STR("Failed to map the local APIC (error %hu), running on the BSP only\n"), res.code);
+        return;
+    }
+
+    // The BSP keeps index 0. The others are numbered in the order they appear in the MADT.
+    u8 bsp_apic_id = lapic_id();
+    global_cpus[0].apic_id = bsp_apic_id;
+    global_n_cpus = 1;
+    for (sz i = 0; i < info.n_cpus; i++) {
+        if (info.apic_ids[i] == bsp_apic_id)
+            continue;
+        struct cpu *cpu = &global_cpus[global_n_cpus];
+        cpu->id = global_n_cpus;
+        cpu->apic_id = info.apic_ids[i];
+        global_n_cpus++;
+    }
+
+    print_dbg(PINFO, STR("Found %ld CPUs, BSP has APIC ID %hhu, local APIC at 0x%lx\n"), global_n_cpus, bsp_apic_id,
+              global_lapic_paddr);
+}
+
+static bool smp_start_ap(struct cpu *cpu)
+{
+    assert(cpu);
+
+    // The stack is only freed if the AP doesn't come online. Otherwise, the AP keeps running on it.
+    struct option_byte_array stack_opt = kvalloc_alloc(TASK_STACK_SIZE, 16);
+    if (stack_opt.is_none)
+        return false;
+    struct byte_array stack = option_byte_array_checked(stack_opt);
+
+    *smp_trampoline_slot(smp_trampoline_stack) = (u64)(stack.dat + stack.len);
+    __atomic_store_n(&global_starting_cpu, cpu, __ATOMIC_RELEASE);
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_DELIVERY_INIT | LAPIC_ICR_LEVEL_ASSERT);
+    time_delay_us(10000);
+
+    // The second startup IPI is only needed if the first one is lost. An AP that's already running ignores it.
+    for (sz i = 0; i < 2; i++) {
+        lapic_send_ipi(cpu->apic_id,
+                       LAPIC_ICR_DELIVERY_STARTUP | LAPIC_ICR_LEVEL_ASSERT | (SMP_TRAMPOLINE_PADDR / PAGE_SIZE));
+        time_delay_us(200);
+    }
+
+    struct time_ms deadline = time_ms_new(time_current_ms().ms + SMP_AP_ONLINE_TIMEOUT_MS);
+    while (__atomic_load_n(&global_starting_cpu, __ATOMIC_ACQUIRE) && time_current_ms().ms < deadline.ms)
+        cpu_relax();
+
+    struct cpu *expected = cpu;
+    if (__atomic_compare_exchange_n(&global_starting_cpu, &expected, NULL, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        // The AP might still be running the trampoline or be on its way into `smp_ap_main`. INIT stops it wherever
+        // it is, so it doesn't touch the trampoline page or its stack once they are gone.
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_DELIVERY_INIT | LAPIC_ICR_LEVEL_ASSERT);
+        time_delay_us(10000);
+        kvalloc_free(stack);
+        return false;
+    }
+
+    // The AP claimed the start, so it's about to come online.
+    while (!__atomic_load_n(&cpu->is_online, __ATOMIC_ACQUIRE))
+        cpu_relax();
+    return true;
+}
+
+void smp_start_aps(void)
+{
+    if (global_n_cpus == 1)
+        return;
+
+    lapic_init_cpu();
+    lapic_timer_calibrate();
+    assert(!isr_register_handler(VECTOR_LAPIC_TIMER, smp_handle_lapic_timer, NULL).is_error);
+    assert(!isr_register_handler(VECTOR_IPI_RESCHED, smp_handle_resched, NULL).is_error);
+    assert(!isr_register_handler(VECTOR_IPI_TLB_FLUSH, smp_handle_tlb_flush_ipi, NULL).is_error);
+    assert(!isr_register_handler(VECTOR_LAPIC_SPURIOUS, smp_handle_spurious, NULL).is_error);
+
+    struct addr_mapping trampoline_mapping = smp_trampoline_mapping();
+    struct result res = paging_map_region(trampoline_mapping);
+    if (res.is_error) {
+        print_dbg(PWARN, STR("Failed to map the AP trampoline (error %hu)\n"), res.code);
+        return;
+    }
+
+    sz trampoline_len = smp_trampoline_end - smp_trampoline_start;
+    assert(trampoline_len <= PAGE_SIZE);
+    byte_copy((byte *)SMP_TRAMPOLINE_PADDR, DECONST(byte *, smp_trampoline_start), trampoline_len);
+
+    // The trampoline loads CR3 while still in 32-bit mode.
+    u64 cr3 = read_cr3();
+    assert(cr3 < BIT(32));
+    *smp_trampoline_slot(smp_trampoline_cr3) = cr3;
+    *smp_trampoline_slot(smp_trampoline_entry) = (u64)smp_ap_main;
+
+    for (sz i = 1; i < global_n_cpus; i++) {
+        struct cpu *cpu = &global_cpus[i];
+        if (!smp_start_ap(cpu))
+            print_dbg(PWARN, STR("CPU %ld with APIC ID %hhu didn't come online\n"), cpu->id, cpu->apic_id);
+    }
+
+    assert(!paging_unmap_region(trampoline_mapping).is_error);
+
+    print_dbg(PINFO, STR("%ld of %ld CPUs online\n"), smp_n_cpus_online(), global_n_cpus);
+}
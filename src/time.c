@@ -1,5 +1,6 @@
 #include <tx/asm.h>
 #include <tx/assert.h>
+#include <tx/pic.h>
 #include <tx/print.h>
 #include <tx/time.h>
 
@@ -15,9 +16,12 @@
 #define PIT_MAX_HZ 1193182 /* Base frequency of the PIT in Hz */
 #define PIT_DIVISOR_HZ 100
 
+#define PIT_IRQ 0
+
 #define PIT_PORT_CHAN0 0x40
 #define PIT_PORT_CMD 0x43
 
+#define PIT_CMD_ONESHOT 0 /* Operating mode: interrupt on terminal count */
 #define PIT_CMD_RATEGEN BIT(2) /* Operating mode: rate generator */
 #define PIT_CMD_ACCESS_HILO (BIT(4) | BIT(5)) /* Access mode: both the lobyte and the hibyte */
 
@@ -76,6 +80,11 @@ void time_init(void)
     global_tsc_base = base;
     global_tsc_freq_hz = freq_est;
 
+    // From now on, the PIT is only used as a one-shot timer (see `time_set_oneshot`). Writing the command without a
+    // count stops the periodic interrupts until the timer is armed.
+    outb(PIT_PORT_CMD, PIT_CMD_ONESHOT | PIT_CMD_ACCESS_HILO);
+    pic_enable_irq(PIT_IRQ);
+
     global_time_initialized = true;
 }
 
@@ -87,3 +96,58 @@ struct time_ms time_current_ms(void)
     assert(!MUL_OVERFLOW(elapsed_ticks, 1000));
     return time_ms_new((elapsed_ticks * 1000) / global_tsc_freq_hz);
 }
+
+u64 time_current_tsc(void)
+{
+    return rdtsc();
+}
+
+struct time_ms time_ms_from_tsc(u64 ticks)
+{
+    assert(global_time_initialized);
+    assert(!MUL_OVERFLOW(ticks, 1000));
+    return time_ms_new((ticks * 1000) / global_tsc_freq_hz);
+}
+
+u64 time_us_from_tsc(u64 ticks)
+{
+    assert(global_time_initialized);
+    // Split into whole seconds and the rest so that long intervals don't overflow.
+    u64 secs = ticks / global_tsc_freq_hz;
+    u64 rem = ticks % global_tsc_freq_hz;
+    return secs * 1000000 + (rem * 1000000) / global_tsc_freq_hz;
+}
+
+void time_delay_us(u64 us)
+{
+    assert(global_time_initialized);
+    assert(!MUL_OVERFLOW(us, global_tsc_freq_hz));
+
+    u64 end = rdtsc() + (us * global_tsc_freq_hz) / 1000000;
+    while (rdtsc() < end)
+        cpu_relax();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// One-shot timer                                                            //
+///////////////////////////////////////////////////////////////////////////////
+
+// The PIT counts down from at most 2^16, so the longest delay it can produce is about 55 ms. Later deadlines
+// just cause an early interrupt. That's fine because the timer is only used to wake up the CPU.
+#define PIT_MAX_COUNT U16_MAX
+
+void time_set_oneshot(struct time_ms deadline)
+{
+    assert(global_time_initialized);
+
+    struct time_ms now = time_current_ms();
+    u64 delay_ms = deadline.ms > now.ms ? deadline.ms - now.ms : 0;
+    delay_ms = MIN(delay_ms, 1000); // The count saturates long before this, but it prevents an overflow.
+    u64 count = MAX(1, MIN(delay_ms * PIT_MAX_HZ / 1000, PIT_MAX_COUNT));
+
+    // Writing the command resets the counter. The interrupt is raised once the count that's written afterwards
+    // reaches zero.
+    outb(PIT_PORT_CMD, PIT_CMD_ONESHOT | PIT_CMD_ACCESS_HILO);
+    outb(PIT_PORT_CHAN0, count & 0xff);
+    outb(PIT_PORT_CHAN0, (count >> 8) & 0xff);
+}
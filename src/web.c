@@ -1,6 +1,8 @@
 #include <config.h>
+#include <tx/alloc_stats.h>
 #include <tx/arena.h>
 #include <tx/byte.h>
+#include <tx/channel.h>
 #include <tx/error.h>
 #include <tx/fmt.h>
 #include <tx/kvalloc.h>
@@ -8,6 +10,7 @@
 #include <tx/print.h>
 #include <tx/ramfs.h>
 #include <tx/sched.h>
+#include <tx/smp.h>
 #include <tx/string.h>
 #include <tx/time.h>
 #include <tx/web.h>
@@ -365,14 +368,15 @@ static bool http_is_complete_header(struct str request_data)
 // Connection handling                                                       //
 ///////////////////////////////////////////////////////////////////////////////
 
-#define WEB_NUM_RECV_RETRIES 10
+#define WEB_RECV_TIMEOUT_MS 100
+#define WEB_SEND_TIMEOUT_MS 100
 #define WEB_NUM_RECV_REQUEST_RETRIES 5
 
 static struct tcp_conn *web_wait_accept_conn(struct tcp_conn *listen_conn)
 {
     struct tcp_conn *conn = NULL;
     while (!(conn = tcp_conn_accept(listen_conn)))
-        sleep_ms(time_ms_new(10));
+        tcp_conn_wait(listen_conn, WAIT_FOREVER);
     return conn;
 }
 
@@ -388,17 +392,21 @@ static struct result web_respond_close(struct tcp_conn *conn, struct byte_view r
         if (res.is_error)
             return result_error(res.code);
 
-        n_transmitted += result_sz_checked(res);
+        sz n_new = result_sz_checked(res);
+        n_transmitted += n_new;
         if (n_transmitted >= response.len)
             break;
 
-        sleep_ms(time_ms_new(10)); // Wait a bit for ACKs to arrive.
+        // The transmit window is full. Wait for ACKs to arrive. The timeout makes sure we notice if the peer has
+        // closed the connection in the meantime.
+        if (!n_new)
+            tcp_conn_wait(conn, time_ms_new(WEB_SEND_TIMEOUT_MS));
     }
 
     return tcp_conn_close(&conn, sb, tmp);
 }
 
-// Poll the TCP module for newly received data and store it in `recv_buf`.
+// Wait for newly received data and store it in `recv_buf`. Returns 0 if no data arrived for `WEB_RECV_TIMEOUT_MS`.
 static struct result_sz web_recv_retry(struct tcp_conn *conn, struct byte_buf *recv_buf)
 {
     assert(conn);
@@ -406,8 +414,9 @@ static struct result_sz web_recv_retry(struct tcp_conn *conn, struct byte_buf *r
 
     sz n_received = 0;
     bool peer_closed_conn = false;
+    struct time_ms deadline = time_ms_new(time_current_ms().ms + WEB_RECV_TIMEOUT_MS);
 
-    for (sz i = 0; i < WEB_NUM_RECV_RETRIES; i++) {
+    while (true) {
         struct result_sz res = tcp_conn_recv(conn, recv_buf, &peer_closed_conn);
         if (res.is_error)
             return result_sz_error(res.code);
@@ -419,13 +428,17 @@ static struct result_sz web_recv_retry(struct tcp_conn *conn, struct byte_buf *r
         if (peer_closed_conn)
             break;
 
-        sleep_ms(time_ms_new(10));
+        struct time_ms now = time_current_ms();
+        if (now.ms >= deadline.ms)
+            break;
+
+        tcp_conn_wait(conn, time_ms_new(deadline.ms - now.ms));
     }
 
     return result_sz_ok(n_received);
 }
 
-// Try receiving a full HTTP header by polling the `web_recv_retry` function.
+// Try receiving a full HTTP header by calling the `web_recv_retry` function repeatedly.
 static struct result_sz web_recv_http_request(struct tcp_conn *conn, struct byte_buf *recv_buf, struct send_buf sb,
                                               struct arena tmp)
 {
@@ -463,8 +476,6 @@ static struct result_sz web_recv_http_request(struct tcp_conn *conn, struct byte
 
         if (http_is_complete_header(str_from_byte_buf(*recv_buf)))
             return result_sz_ok(n_received);
-
-        sleep_ms(time_ms_new(10));
     }
 
     return result_sz_error(EINVAL);
@@ -472,14 +483,12 @@ static struct result_sz web_recv_http_request(struct tcp_conn *conn, struct byte
 
 #define WEB_MAX_RESPONSE_SIZE BIT(22) /* 4 MiB */
 
-static struct result web_handle_conn(struct tcp_conn *listen_conn, struct ram_fs_node *root, struct send_buf sb,
-                                     struct arena tmp)
+static struct result web_handle_conn(struct tcp_conn *conn, struct ram_fs_node *root, struct send_buf sb,
+                                     struct byte_array response_mem, struct arena tmp)
 {
-    struct tcp_conn *conn = web_wait_accept_conn(listen_conn);
-
     print_dbg(PDBG, STR("Accepted connection %s\n"), tcp_conn_format(conn, &tmp));
 
-    struct byte_buf recv_buf = byte_buf_from_array(byte_array_from_arena(1024, &tmp));
+    struct byte_buf recv_buf = byte_buf_from_array(byte_array_from_arena_nozero(1024, &tmp));
     struct result_sz res = web_recv_http_request(conn, &recv_buf, sb, tmp);
     if (res.is_error) {
         print_dbg(PDBG, STR("Failed to receive HTTP request for %s. Closing ...\n"), tcp_conn_format(conn, &tmp));
@@ -494,9 +503,14 @@ static struct result web_handle_conn(struct tcp_conn *listen_conn, struct ram_fs
         return result_ok();
     }
 
-    struct byte_buf response_buf = byte_buf_from_array(byte_array_from_arena(WEB_MAX_RESPONSE_SIZE, &tmp));
+    // The response buffer is only ever appended to, so there is no need to zero it for every request.
+    struct byte_buf response_buf = byte_buf_from_array(response_mem);
 
+    // Building the response only touches the file system and memory that belongs to this worker. It can take long
+    // for big files, so the workers on other CPUs can use the network stack in the meantime.
+    kernel_unlock();
     struct result http_res = http_handle_request(root, str_from_byte_buf(recv_buf), &response_buf, tmp);
+    kernel_lock();
     if (http_res.is_error) {
         print_dbg(PDBG, STR("Failed to handle HTTP request for %s. Closing ...\n"), tcp_conn_format(conn, &tmp));
         tcp_conn_close(&conn, sb, tmp);
@@ -506,20 +520,105 @@ static struct result web_handle_conn(struct tcp_conn *listen_conn, struct ram_fs
     return web_respond_close(conn, byte_view_from_buf(response_buf), sb, tmp);
 }
 
-struct result web_listen(struct ipv4_addr ip_addr, u16 port, struct ram_fs_node *root)
+// Size of the blocks of the scratch arenas.
+#define WEB_TMP_BLOCK_SIZE 0x4000
+
+// Number of accepted connections that can wait for a worker.
+#define WEB_CONN_QUEUE_SIZE 16
+
+// The task that listens for connections hands every accepted connection to one of the workers over a channel. There
+// is one worker per CPU, so the responses for different connections are built in parallel.
+struct web_worker {
+    struct channel *conns;
+    struct ram_fs_node *root;
+    struct arena_chain tmp_chain;
+    struct byte_array response_mem;
+    struct byte_array sb_mem;
+};
+
+// Set up the memory of a worker. This runs in the worker task, so nothing is allocated for workers whose task
+// couldn't be created.
+static void web_worker_init(struct web_worker *worker)
 {
-    struct arena tmp = arena_new(option_byte_array_checked(kvalloc_alloc(0x4000 + WEB_MAX_RESPONSE_SIZE, 64)));
-    struct send_buf sb =
-        send_buf_new(arena_new(option_byte_array_checked(kvalloc_alloc(0x4000 + WEB_MAX_RESPONSE_SIZE, 64))));
+    // The scratch arena grows as needed and it's reset after every connection. Memory that was needed
+    // to handle one connection is returned to kvalloc afterwards.
+    arena_chain_init(&worker->tmp_chain, alloc_new(&worker->tmp_chain, kvalloc_alloc_wrapper, kvalloc_free_wrapper),
+                     WEB_TMP_BLOCK_SIZE);
+    alloc_stats_register_arena_chain(STR("web_tmp"), &worker->tmp_chain);
+
+    // Most responses are much smaller than the maximum, so these buffers are demand-paged. They only take up the
+    // memory that's actually used. The backing of both buffers is released after every connection.
+    worker->response_mem = option_byte_array_checked(kvalloc_reserve(WEB_MAX_RESPONSE_SIZE));
+    worker->sb_mem = option_byte_array_checked(kvalloc_reserve(0x4000 + WEB_MAX_RESPONSE_SIZE));
+}
 
-    struct tcp_conn *listen_conn = tcp_conn_listen(ip_addr, port, tmp);
+static void web_worker(void *context)
+{
+    assert(context);
+    struct web_worker *worker = context;
+
+    web_worker_init(worker);
 
-    print_dbg(PINFO, STR("Listening for connections on %s:%hu\n"), ipv4_addr_format(ip_addr, &tmp), port);
+    // The network stack is protected by the kernel lock (see `web_handle_conn` for the exception).
+    kernel_lock();
+
+    struct arena tmp = arena_new_chained(&worker->tmp_chain);
+    struct send_buf sb = send_buf_new(arena_new(worker->sb_mem));
+    struct arena_mark tmp_mark = arena_mark(&tmp);
 
     while (true) {
-        struct result res = web_handle_conn(listen_conn, root, sb, tmp);
+        struct tcp_conn *conn = NULL;
+        channel_recv(worker->conns, &conn);
+
+        struct result res = web_handle_conn(conn, worker->root, sb, worker->response_mem, tmp);
+        arena_restore(&tmp, tmp_mark);
+        kvalloc_release_backing(worker->response_mem);
+        kvalloc_release_backing(worker->sb_mem);
         if (res.is_error)
             print_dbg(PERROR, STR("Error handling connection: %s\n"), error_code_str(res.code));
-        sleep_ms(time_ms_new(10));
+    }
+}
+
+struct result web_listen(struct ipv4_addr ip_addr, u16 port, struct ram_fs_node *root)
+{
+    kernel_lock();
+
+    // This function never returns, so the workers can use memory on its stack.
+    struct tcp_conn *conns_buf[WEB_CONN_QUEUE_SIZE];
+    struct channel conns;
+    channel_init(&conns, byte_array_new((void *)conns_buf, sizeof(conns_buf)), sizeof(*conns_buf));
+
+    sz n_workers = smp_n_cpus_online();
+    struct byte_array workers_mem =
+        option_byte_array_checked(kvalloc_alloc(n_workers * sizeof(struct web_worker), alignof(struct web_worker)));
+    struct web_worker *workers = byte_array_ptr(workers_mem);
+    for (sz i = 0; i < n_workers; i++) {
+        workers[i].conns = &conns;
+        workers[i].root = root;
+
+        struct sched_task_attrs attrs = { 0 };
+        attrs.name = STR("web_worker");
+        struct result res = sched_create_task_attrs(web_worker, &workers[i], attrs);
+        if (res.is_error && !i) {
+            kvalloc_free(workers_mem);
+            kernel_unlock();
+            return res;
+        }
+        if (res.is_error) {
+            // The workers that were created already use the channel, so keep serving with fewer workers.
+            n_workers = i;
+            break;
+        }
+    }
+
+    struct arena tmp = arena_new(option_byte_array_checked(kvalloc_alloc(0x2000, 64)));
+    struct tcp_conn *listen_conn = tcp_conn_listen(ip_addr, port, tmp);
+
+    print_dbg(PINFO, STR("Listening for connections on %s:%hu with %ld workers\n"), ipv4_addr_format(ip_addr, &tmp),
+              port, n_workers);
+
+    while (true) {
+        struct tcp_conn *conn = web_wait_accept_conn(listen_conn);
+        channel_send(&conns, &conn);
     }
 }
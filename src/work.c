@@ -0,0 +1,112 @@
+#include <tx/assert.h>
+#include <tx/print.h>
+#include <tx/sched.h>
+#include <tx/spinlock.h>
+#include <tx/work.h>
+
+// There is a single worker task. It runs with a high priority, so with `PREEMPT=1` it preempts the running task as
+// soon as an interrupt handler scheduled some work. Otherwise, it runs the next time the running task blocks or yields.
+
+static struct dlist global_work_queue;
+// Protects the queue and the `is_pending` flags. Work is scheduled from interrupt handlers, so the lock is taken with
+// interrupts disabled.
+static struct spinlock global_work_lock;
+static struct wait_queue global_work_wait; // The worker waits here while the queue is empty.
+static bool global_work_initialized;
+
+static bool work_queue_is_nonempty(void *context __unused)
+{
+    u64 flags = spin_lock_irqsave(&global_work_lock);
+    bool is_nonempty = !dlist_is_empty(&global_work_queue);
+    spin_unlock_irqrestore(&global_work_lock, flags);
+    return is_nonempty;
+}
+
+static void work_worker(void *context __unused)
+{
+    while (true) {
+        wait_event(&global_work_wait, work_queue_is_nonempty, NULL);
+
+        u64 flags = spin_lock_irqsave(&global_work_lock);
+        while (!dlist_is_empty(&global_work_queue)) {
+            struct work *work = __container_of(global_work_queue.next, struct work, list);
+            dlist_remove(&work->list);
+            // Clear the flag before running the work, so that it runs again if it's scheduled while running.
+            work->is_pending = false;
+            spin_unlock_irqrestore(&global_work_lock, flags);
+
+            work->func(work->context);
+
+            flags = spin_lock_irqsave(&global_work_lock);
+        }
+        spin_unlock_irqrestore(&global_work_lock, flags);
+    }
+}
+
+void work_queue_init(void)
+{
+    assert(!global_work_initialized);
+
+    dlist_init_empty(&global_work_queue);
+    wait_queue_init(&global_work_wait);
+
+    struct sched_task_attrs attrs = { 0 };
+    attrs.priority = SCHED_PRIORITY_HIGH;
+    attrs.name = STR("work");
+    assert(!sched_create_task_attrs(work_worker, NULL, attrs).is_error);
+
+    global_work_initialized = true;
+}
+
+bool work_schedule(struct work *work)
+{
+    assert(global_work_initialized);
+    assert(work);
+    assert(work->func);
+
+    u64 flags = spin_lock_irqsave(&global_work_lock);
+    bool was_pending = work->is_pending;
+    if (!was_pending) {
+        work->is_pending = true;
+        dlist_insert(global_work_queue.prev, &work->list);
+    }
+    spin_unlock_irqrestore(&global_work_lock, flags);
+
+    if (!was_pending)
+        wake_up(&global_work_wait);
+
+    return !was_pending;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+static void work_test_count(void *context)
+{
+    sz *n_runs = context;
+    (*n_runs)++;
+}
+
+void work_run_tests(void)
+{
+    sz n_runs = 0;
+    struct work work;
+    work_init(&work, work_test_count, &n_runs);
+
+    // Scheduling pending work again doesn't make it run twice.
+    assert(work_schedule(&work));
+    assert(!work_schedule(&work));
+    while (n_runs == 0)
+        sched_yield();
+    assert(n_runs == 1);
+    assert(!work.is_pending);
+
+    // Once it ran, it can be scheduled again.
+    assert(work_schedule(&work));
+    while (n_runs == 1)
+        sched_yield();
+    assert(n_runs == 2);
+
+    print_dbg(PINFO, STR("Work queue selftest passed\n"));
+}